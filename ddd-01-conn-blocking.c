@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <openssl/ssl.h>
 
 /* 
@@ -10,6 +11,8 @@
  * larger application.
  */
 
+#include "ddd-common.h"
+
 /*
  * The application is initializing and wants an SSL_CTX which it will use for
  * some number of outgoing connections, which it creates in subsequent calls to
@@ -19,6 +22,7 @@
 SSL_CTX *create_ssl_ctx(void)
 {
     SSL_CTX *ctx;
+    X509_STORE *store;
 
     ctx = SSL_CTX_new(TLS_client_method());
     if (ctx == NULL)
@@ -27,8 +31,16 @@ SSL_CTX *create_ssl_ctx(void)
     /* Enable trust chain verification. */
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
 
-    /* Load default root CA store. */
-    if (SSL_CTX_set_default_verify_paths(ctx) == 0) {
+    /* Use the default root CA store, shared with every other SSL_CTX. */
+    store = get_trust_store();
+    if (store == NULL) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set1_cert_store(ctx, store);
+
+    /* Cache sessions so that later connections to a server can resume. */
+    if (sess_cache_enable(ctx) == 0) {
         SSL_CTX_free(ctx);
         return NULL;
     }
@@ -75,6 +87,12 @@ BIO *new_conn(SSL_CTX *ctx, const char *hostname)
         return NULL;
     }
 
+    /* Offer the session we last got from this hostname:port, if any. */
+    if (sess_cache_attach(ssl, hostname) == 0) {
+        BIO_free_all(out);
+        return NULL;
+    }
+
     return out;
 }
 
@@ -119,27 +137,121 @@ void teardown_ctx(SSL_CTX *ctx)
  * Example driver for the above code. This is just to demonstrate that the code
  * works and is not intended to be representative of a real application.
  */
+#include "ddd-driver.h"
+
+/*
+ * The single-connection hooks for the benchmarks. BIO_s_connect connects as
+ * part of the first tx(), so the TCP handshake counts towards the TLS one.
+ */
+struct drv_link_st {
+    BIO *b;
+};
+
+static DRV_LINK *drv_open(SSL_CTX *ctx, const DRV_TARGET *t)
+{
+    char hostname[512];
+    DRV_LINK *lk;
+
+    lk = malloc(sizeof(DRV_LINK));
+    if (lk == NULL)
+        return NULL;
+
+    snprintf(hostname, sizeof(hostname), "%s:%s", t->hostname, t->port);
+    lk->b = new_conn(ctx, hostname);
+    if (lk->b == NULL) {
+        free(lk);
+        return NULL;
+    }
+
+    return lk;
+}
+
+static int drv_send(DRV_LINK *lk, const void *buf, int len, DRV_XFER *x)
+{
+    return tx(lk->b, buf, len) == len;
+}
+
+static int drv_recv(DRV_LINK *lk, void *buf, int len, DRV_XFER *x)
+{
+    int l = rx(lk->b, buf, len);
+
+    return l > 0 ? l : 0;
+}
+
+static void drv_close(DRV_LINK *lk)
+{
+    teardown(lk->b);
+    free(lk);
+}
+
 int main(int argc, char **argv)
 {
-    const char msg[] = "GET / HTTP/1.0\r\nHost: www.example.com\r\n\r\n";
+    char msg[512], hostname[512];
     SSL_CTX *ctx = NULL;
     BIO *b = NULL;
     char buf[2048];
-    int l, res = 1;
+    int l, msg_len, res = 1;
+    DRV_OPTS opts;
+    DRV_TARGET t;
 
-    ctx = create_ssl_ctx();
+    if (drv_getopt(argc, argv, &opts) == 0)
+        return 1;
+
+    msg_len = snprintf(msg, sizeof(msg),
+                       "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                       opts.path, opts.hostname);
+    snprintf(hostname, sizeof(hostname), "%s:%s", opts.hostname, opts.port);
+
+    ctx = drv_create_ctx(&opts);
     if (ctx == NULL) {
         fprintf(stderr, "could not create context\n");
         goto fail;
     }
 
-    b = new_conn(ctx, "www.example.com:443");
+    t.opts      = &opts;
+    t.hostname  = opts.hostname;
+    t.port      = opts.port;
+    t.ai        = NULL;
+    t.tx_msg    = msg;
+    t.tx_len    = msg_len;
+
+    if (opts.num_handshakes > 0) {
+        if (drv_bench_handshake(ctx, &t, opts.num_handshakes))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.bulk_size > 0) {
+        if (drv_bench_bulk(ctx, &t, opts.bulk_size))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_pingpongs > 0) {
+        if (drv_bench_pingpong(ctx, &t, opts.num_pingpongs))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_idle > 0) {
+        if (drv_bench_idle(ctx, &t, opts.num_idle))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.startup) {
+        if (drv_bench_startup(ctx, &t))
+            res = 0;
+        goto fail;
+    }
+
+    b = new_conn(ctx, hostname);
     if (b == NULL) {
         fprintf(stderr, "could not create conn\n");
         goto fail;
     }
 
-    if (tx(b, msg, sizeof(msg)) < sizeof(msg)) {
+    if (tx(b, msg, msg_len) < msg_len) {
         fprintf(stderr, "tx error\n");
         goto fail;
     }
@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include <sys/poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 
 /* 
@@ -22,6 +26,10 @@ typedef struct app_conn_st {
     int rx_need_tx, tx_need_rx;
 } APP_CONN;
 
+#define DDD_ASYNC_VERIFY
+#define DDD_CONN_CACHE
+#include "ddd-common.h"
+
 /*
  * The application is initializing and wants an SSL_CTX which it will use for
  * some number of outgoing connections, which it creates in subsequent calls to
@@ -31,6 +39,7 @@ typedef struct app_conn_st {
 SSL_CTX *create_ssl_ctx(void)
 {
     SSL_CTX *ctx;
+    X509_STORE *store;
 
     ctx = SSL_CTX_new(TLS_client_method());
     if (ctx == NULL)
@@ -39,8 +48,16 @@ SSL_CTX *create_ssl_ctx(void)
     /* Enable trust chain verification. */
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
 
-    /* Load default root CA store. */
-    if (SSL_CTX_set_default_verify_paths(ctx) == 0) {
+    /* Use the default root CA store, shared with every other SSL_CTX. */
+    store = get_trust_store();
+    if (store == NULL) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set1_cert_store(ctx, store);
+
+    /* Cache sessions so that later connections to a server can resume. */
+    if (sess_cache_enable(ctx) == 0) {
         SSL_CTX_free(ctx);
         return NULL;
     }
@@ -61,24 +78,25 @@ APP_CONN *new_conn(SSL_CTX *ctx, const char *hostname)
     SSL *ssl = NULL;
     const char *bare_hostname;
 
-    conn = calloc(1, sizeof(APP_CONN));
+    conn = conn_alloc();
     if (conn == NULL)
         return NULL;
 
     out = BIO_new_ssl_connect(ctx);
     if (out == NULL) {
-        free(conn);
+        conn_release(conn);
         return NULL;
     }
 
     if (BIO_get_ssl(out, &ssl) == 0) {
         BIO_free_all(out);
+        conn_release(conn);
         return NULL;
     }
 
     if (BIO_set_conn_hostname(out, hostname) == 0) {
         BIO_free_all(out);
-        free(conn);
+        conn_release(conn);
         return NULL;
     }
 
@@ -86,21 +104,29 @@ APP_CONN *new_conn(SSL_CTX *ctx, const char *hostname)
     bare_hostname = BIO_get_conn_hostname(out);
     if (bare_hostname == NULL) {
         BIO_free_all(out);
-        free(conn);
+        conn_release(conn);
         return NULL;
     }
 
     /* Tell the SSL object the hostname to check certificates against. */
     if (SSL_set1_host(ssl, bare_hostname) <= 0) {
         BIO_free_all(out);
-        free(conn);
+        conn_release(conn);
+        return NULL;
+    }
+
+    /* Offer the session we last got from this hostname:port, if any. */
+    if (sess_cache_attach(ssl, hostname) == 0) {
+        BIO_free_all(out);
+        conn_release(conn);
         return NULL;
     }
 
     /* Make the BIO nonblocking. */
     BIO_set_nbio(out, 1);
 
-    conn->ssl_bio = out;
+    conn->ssl       = ssl;
+    conn->ssl_bio   = out;
     return conn;
 }
 
@@ -118,6 +144,8 @@ int tx(APP_CONN *conn, const void *buf, int buf_len)
 
     l = BIO_write(conn->ssl_bio, buf, buf_len);
     if (l <= 0) {
+        if (SSL_want_retry_verify(conn->ssl))
+            return -2;
         if (BIO_should_retry(conn->ssl_bio)) {
             conn->tx_need_rx = BIO_should_read(conn->ssl_bio);
             return -2;
@@ -143,6 +171,8 @@ int rx(APP_CONN *conn, void *buf, int buf_len)
 
     l = BIO_read(conn->ssl_bio, buf, buf_len);
     if (l <= 0) {
+        if (SSL_want_retry_verify(conn->ssl))
+            return -2;
         if (BIO_should_retry(conn->ssl_bio)) {
             conn->rx_need_tx = BIO_should_write(conn->ssl_bio);
             return -2;
@@ -178,11 +208,18 @@ int get_conn_fd(APP_CONN *conn)
  */
 int get_conn_pending_tx(APP_CONN *conn)
 {
+    /* Nothing on the network can help until the verification is done. */
+    if (SSL_want_retry_verify(conn->ssl))
+        return 0;
+
     return (conn->tx_need_rx ? POLLIN : 0) | POLLOUT | POLLERR;
 }
 
 int get_conn_pending_rx(APP_CONN *conn)
 {
+    if (SSL_want_retry_verify(conn->ssl))
+        return 0;
+
     return (conn->rx_need_tx ? POLLOUT : 0) | POLLIN | POLLERR;
 }
 
@@ -193,7 +230,7 @@ int get_conn_pending_rx(APP_CONN *conn)
 void teardown(APP_CONN *conn)
 {
     BIO_free_all(conn->ssl_bio);
-    free(conn);
+    conn_release(conn);
 }
 
 /*
@@ -210,23 +247,112 @@ void teardown_ctx(SSL_CTX *ctx)
  * Example driver for the above code. This is just to demonstrate that the code
  * works and is not intended to be representative of a real application.
  */
+#define DRV_REACTOR
+#define DRV_CONN_CACHE
+#include "ddd-driver.h"
+
+/*
+ * libssl creates the socket and connects it itself, so the fd is only known
+ * once the first tx() has started connecting.
+ */
+static APP_CONN *drv_conn_new(SSL_CTX *ctx, const DRV_TARGET *t, DRV_CONN *dc)
+{
+    char hostname[512];
+
+    snprintf(hostname, sizeof(hostname), "%s:%s", t->hostname, t->port);
+    return new_conn(ctx, hostname);
+}
+
+static int drv_conn_fd(DRV_CONN *dc)
+{
+    return get_conn_fd(dc->conn);
+}
+
+static int drv_conn_pump(DRV_CONN *dc)
+{
+    return 0;
+}
+
+static int drv_conn_events(DRV_CONN *dc, int pending)
+{
+    return pending;
+}
+
+static void drv_conn_free(DRV_CONN *dc)
+{
+    teardown(dc->conn);
+}
+
 int main(int argc, char **argv)
 {
-    const char tx_msg[] = "GET / HTTP/1.0\r\nHost: www.example.com\r\n\r\n";
+    char tx_msg[512], hostname[512];
     const char *tx_p = tx_msg;
     char rx_msg[2048], *rx_p = rx_msg;
-    int res = 1, l, tx_len = sizeof(tx_msg)-1, rx_len = sizeof(rx_msg);
+    int res = 1, l, tx_len, rx_len = sizeof(rx_msg);
     int timeout = 2000 /* ms */;
     APP_CONN *conn = NULL;
-    SSL_CTX *ctx;
+    SSL_CTX *ctx = NULL;
+    DRV_OPTS opts;
+    DRV_TARGET t;
+
+    if (drv_getopt(argc, argv, &opts) == 0)
+        return 1;
 
-    ctx = create_ssl_ctx();
+    tx_len = snprintf(tx_msg, sizeof(tx_msg),
+                      "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                      opts.path, opts.hostname);
+    snprintf(hostname, sizeof(hostname), "%s:%s", opts.hostname, opts.port);
+
+    ctx = drv_create_ctx(&opts);
     if (ctx == NULL) {
         fprintf(stderr, "cannot create SSL context\n");
         goto fail;
     }
 
-    conn = new_conn(ctx, "www.example.com:443");
+    t.opts      = &opts;
+    t.hostname  = opts.hostname;
+    t.port      = opts.port;
+    t.ai        = NULL;
+    t.tx_msg    = tx_msg;
+    t.tx_len    = tx_len;
+
+    if (opts.num_handshakes > 0) {
+        if (drv_bench_handshake(ctx, &t, opts.num_handshakes))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.bulk_size > 0) {
+        if (drv_bench_bulk(ctx, &t, opts.bulk_size))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_pingpongs > 0) {
+        if (drv_bench_pingpong(ctx, &t, opts.num_pingpongs))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_idle > 0) {
+        if (drv_bench_idle(ctx, &t, opts.num_idle))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.startup) {
+        if (drv_bench_startup(ctx, &t))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_conns > 0) {
+        if (drv_run_many(ctx, &t, &opts))
+            res = 0;
+        goto fail;
+    }
+
+    conn = new_conn(ctx, hostname);
     if (conn == NULL) {
         fprintf(stderr, "cannot establish connection\n");
         goto fail;
@@ -240,6 +366,7 @@ int main(int argc, char **argv)
             tx_len -= l;
         } else if (l == -1) {
             fprintf(stderr, "tx error\n");
+            goto fail;
         } else if (l == -2) {
             struct pollfd pfd = {0};
             pfd.fd = get_conn_fd(conn);
@@ -1,3 +1,12 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
 #include <openssl/ssl.h>
 
 /* 
@@ -11,6 +20,9 @@
  * larger application.
  */
 
+#define DDD_SSL_POOL
+#include "ddd-common.h"
+
 /*
  * The application is initializing and wants an SSL_CTX which it will use for
  * some number of outgoing connections, which it creates in subsequent calls to
@@ -20,6 +32,7 @@
 SSL_CTX *create_ssl_ctx(void)
 {
     SSL_CTX *ctx;
+    X509_STORE *store;
 
     ctx = SSL_CTX_new(TLS_client_method());
     if (ctx == NULL)
@@ -28,8 +41,16 @@ SSL_CTX *create_ssl_ctx(void)
     /* Enable trust chain verification. */
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
 
-    /* Load default root CA store. */
-    if (SSL_CTX_set_default_verify_paths(ctx) == 0) {
+    /* Use the default root CA store, shared with every other SSL_CTX. */
+    store = get_trust_store();
+    if (store == NULL) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set1_cert_store(ctx, store);
+
+    /* Cache sessions so that later connections to a server can resume. */
+    if (sess_cache_enable(ctx) == 0) {
         SSL_CTX_free(ctx);
         return NULL;
     }
@@ -37,22 +58,39 @@ SSL_CTX *create_ssl_ctx(void)
     return ctx;
 }
 
+/*
+ * Flags for new_conn_ex.
+ *
+ * APP_CONN_KTLS: have libssl hand the record layer's crypto to kernel TLS
+ * after the handshake where the kernel and the negotiated cipher allow it.
+ * This lets tx_file() send files without copying them into user space.
+ */
+#define APP_CONN_KTLS       1
+
 /*
  * The application wants to create a new outgoing connection using a given
  * SSL_CTX.
  *
- * hostname is a string like "example.com" used for certificate validation.
+ * hostname is a string like "example.com" used for certificate validation,
+ * and port the server's port, like "443". Sessions are filed under
+ * hostname:port. new_conn() is new_conn_ex() without flags for a server on
+ * port 443.
  */
-SSL *new_conn(SSL_CTX *ctx, int fd, const char *bare_hostname)
+SSL *new_conn_ex(SSL_CTX *ctx, int fd, const char *bare_hostname,
+                 const char *port, int flags)
 {
     SSL *ssl;
+    char key[300];
 
-    ssl = SSL_new(ctx);
+    ssl = ssl_pool_take(ctx);
     if (ssl == NULL)
         return NULL;
 
     SSL_set_connect_state(ssl); /* cannot fail */
 
+    if (flags & APP_CONN_KTLS)
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+
     if (SSL_set_fd(ssl, fd) <= 0) {
         SSL_free(ssl);
         return NULL;
@@ -68,9 +106,21 @@ SSL *new_conn(SSL_CTX *ctx, int fd, const char *bare_hostname)
         return NULL;
     }
 
+    /* Offer the session we last got from this server, if any. */
+    snprintf(key, sizeof(key), "%s:%s", bare_hostname, port);
+    if (sess_cache_attach(ssl, key) == 0) {
+        SSL_free(ssl);
+        return NULL;
+    }
+
     return ssl;
 }
 
+SSL *new_conn(SSL_CTX *ctx, int fd, const char *bare_hostname)
+{
+    return new_conn_ex(ctx, fd, bare_hostname, "443", 0);
+}
+
 /*
  * The application wants to send some block of data to the peer.
  * This is a blocking call.
@@ -80,6 +130,126 @@ int tx(SSL *ssl, const void *buf, int buf_len)
     return SSL_write(ssl, buf, buf_len);
 }
 
+/*
+ * Without kernel TLS, tx_file() maps the file this much at a time, or reads it
+ * this much at a time where it cannot be mapped.
+ */
+#define TX_FILE_MAP_SIZE    (8 * 1024 * 1024)
+#define TX_FILE_BUF_SIZE    (256 * 1024)
+
+/*
+ * The application wants to send len bytes of an open file, starting at
+ * offset, to the peer. This is a blocking call. Returns the number of bytes
+ * sent, which is less than len if the file ends first or on error, or -1 if
+ * nothing could be sent.
+ *
+ * If kernel TLS is encrypting for the connection (see new_conn_ex()) the
+ * kernel sends the file's pages itself via SSL_sendfile(). Otherwise the file
+ * is mapped a window at a time and each window passed to SSL_write() whole, so
+ * that the only copy made is libssl's encryption into its record buffer. Files
+ * which cannot be mapped (pipes, some special files) are read into a large
+ * buffer instead; for pipes and sockets offset is ignored and reading starts
+ * wherever they are. The file must not shrink while it is mapped.
+ */
+ossl_ssize_t tx_file(SSL *ssl, int file_fd, off_t offset, size_t len)
+{
+    struct stat st;
+    size_t done = 0, n, skip;
+    off_t pos, map_off;
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char *p;
+    ssize_t r;
+    int l, failed = 0, seekable = 1;
+
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        ossl_ssize_t s = 1;
+
+        while (done < len) {
+            s = SSL_sendfile(ssl, file_fd, offset + done, len - done, 0);
+            if (s <= 0)
+                break;
+
+            done += s;
+        }
+
+        return done > 0 || s == 0 ? (ossl_ssize_t)done : -1;
+    }
+#endif
+
+    /* Only map what is there; touching pages past the end raises SIGBUS. */
+    if (fstat(file_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (offset >= st.st_size)
+            return 0;
+        if (len > (size_t)(st.st_size - offset))
+            len = st.st_size - offset;
+
+        while (done < len) {
+            pos     = offset + done;
+            map_off = pos & ~(off_t)(page - 1);
+            skip    = pos - map_off;
+            n       = len - done;
+            if (n > TX_FILE_MAP_SIZE - skip)
+                n = TX_FILE_MAP_SIZE - skip;
+
+            p = mmap(NULL, skip + n, PROT_READ, MAP_SHARED, file_fd, map_off);
+            if (p == MAP_FAILED)
+                break;
+
+            /* Advice values are not flags, so each takes a call of its own. */
+            madvise(p, skip + n, MADV_SEQUENTIAL);
+            madvise(p, skip + n, MADV_WILLNEED);
+            l = SSL_write(ssl, p + skip, n);
+            munmap(p, skip + n);
+            if (l <= 0)
+                return done > 0 ? (ossl_ssize_t)done : -1;
+
+            done += l;
+        }
+    }
+
+    /* Not a regular file, or mmap failed part way: read it instead. */
+    if (done < len) {
+        p = malloc(TX_FILE_BUF_SIZE);
+        if (p == NULL)
+            return done > 0 ? (ossl_ssize_t)done : -1;
+
+        while (done < len) {
+            n = len - done;
+            if (n > TX_FILE_BUF_SIZE)
+                n = TX_FILE_BUF_SIZE;
+
+            if (seekable) {
+                r = pread(file_fd, p, n, offset + done);
+                if (r < 0 && errno == ESPIPE) {
+                    seekable = 0;
+                    continue;
+                }
+            } else {
+                r = read(file_fd, p, n);
+            }
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                failed = r < 0;
+                break;
+            }
+
+            l = SSL_write(ssl, p, r);
+            if (l <= 0) {
+                failed = 1;
+                break;
+            }
+
+            done += l;
+        }
+
+        free(p);
+    }
+
+    return done > 0 || !failed ? (ossl_ssize_t)done : -1;
+}
+
 /*
  * The application wants to receive some block of data from
  * the peer. This is a blocking call.
@@ -89,13 +259,39 @@ int rx(SSL *ssl, void *buf, int buf_len)
     return SSL_read(ssl, buf, buf_len);
 }
 
+/*
+ * Returned by get_conn_ktls().
+ */
+#define APP_CONN_KTLS_TX    1
+#define APP_CONN_KTLS_RX    2
+
+/*
+ * The application wants to know which directions of a connection created with
+ * APP_CONN_KTLS are encrypted and decrypted by the kernel. Returns zero or more
+ * of APP_CONN_KTLS_TX and APP_CONN_KTLS_RX once the handshake is done.
+ */
+int get_conn_ktls(SSL *ssl)
+{
+    int ktls = 0;
+
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+        ktls |= APP_CONN_KTLS_TX;
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        ktls |= APP_CONN_KTLS_RX;
+#endif
+    return ktls;
+}
+
 /*
  * The application wants to close the connection and free bookkeeping
  * structures.
  */
 void teardown(SSL *ssl)
 {
-    SSL_free(ssl);
+    SSL_shutdown(ssl);
+    if (!ssl_pool_give(ssl))
+        SSL_free(ssl);
 }
 
 /*
@@ -104,6 +300,7 @@ void teardown(SSL *ssl)
  */
 void teardown_ctx(SSL_CTX *ctx)
 {
+    ssl_pool_drain(ctx);
     SSL_CTX_free(ctx);
 }
 
@@ -112,22 +309,103 @@ void teardown_ctx(SSL_CTX *ctx)
  * Example driver for the above code. This is just to demonstrate that the code
  * works and is not intended to be representative of a real application.
  */
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/signal.h>
-#include <netdb.h>
-#include <unistd.h>
+#define DRV_SSL_POOL
+#include "ddd-driver.h"
+
+/*
+ * The single-connection hooks for the benchmarks.
+ */
+struct drv_link_st {
+    SSL *ssl;
+    int fd;
+};
+
+static DRV_LINK *drv_open(SSL_CTX *ctx, const DRV_TARGET *t)
+{
+    DRV_LINK *lk;
+
+    lk = malloc(sizeof(DRV_LINK));
+    if (lk == NULL)
+        return NULL;
+
+    lk->ssl = NULL;
+    lk->fd  = socket(t->ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (lk->fd < 0)
+        goto fail;
+
+    if (connect(lk->fd, t->ai->ai_addr, t->ai->ai_addrlen) < 0)
+        goto fail;
+
+    lk->ssl = new_conn_ex(ctx, lk->fd, t->hostname, t->port,
+                          t->opts->ktls ? APP_CONN_KTLS : 0);
+    if (lk->ssl == NULL)
+        goto fail;
+
+    return lk;
+
+fail:
+    if (lk->fd >= 0)
+        close(lk->fd);
+    free(lk);
+    return NULL;
+}
+
+static int drv_send(DRV_LINK *lk, const void *buf, int len, DRV_XFER *x)
+{
+    return tx(lk->ssl, buf, len) == len;
+}
+
+static int drv_recv(DRV_LINK *lk, void *buf, int len, DRV_XFER *x)
+{
+    int l = rx(lk->ssl, buf, len);
+
+    return l > 0 ? l : 0;
+}
+
+static void drv_close(DRV_LINK *lk)
+{
+    teardown(lk->ssl);
+    close(lk->fd);
+    free(lk);
+}
 
 int main(int argc, char **argv)
 {
-    int rc, fd = -1, l, res = 1;
-    const char msg[] = "GET / HTTP/1.0\r\nHost: www.example.com\r\n\r\n";
+    int rc, fd = -1, file_fd = -1, l, res = 1;
+    char msg[512];
+    int msg_len;
     struct addrinfo hints = {0}, *result = NULL;
+    struct timespec t0, t1;
+    struct stat st;
+    ossl_ssize_t sent;
     SSL *ssl = NULL;
-    SSL_CTX *ctx;
+    SSL_CTX *ctx = NULL;
     char buf[2048];
+    DRV_OPTS opts;
+    DRV_TARGET t;
+
+    if (drv_getopt(argc, argv, &opts) == 0)
+        return 1;
+
+    if (opts.file != NULL) {
+        /* Upload the file as the body of a PUT. */
+        file_fd = open(opts.file, O_RDONLY);
+        if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+            fprintf(stderr, "cannot open %s\n", opts.file);
+            goto fail;
+        }
+
+        msg_len = snprintf(msg, sizeof(msg),
+                           "PUT %s HTTP/1.0\r\nHost: %s\r\n"
+                           "Content-Length: %lld\r\n\r\n",
+                           opts.path, opts.hostname, (long long)st.st_size);
+    } else {
+        msg_len = snprintf(msg, sizeof(msg),
+                           "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                           opts.path, opts.hostname);
+    }
 
-    ctx = create_ssl_ctx();
+    ctx = drv_create_ctx(&opts);
     if (ctx == NULL) {
         fprintf(stderr, "cannot create context\n");
         goto fail;
@@ -136,14 +414,51 @@ int main(int argc, char **argv)
     hints.ai_family     = AF_INET;
     hints.ai_socktype   = SOCK_STREAM;
     hints.ai_flags      = AI_PASSIVE;
-    rc = getaddrinfo("www.example.com", "443", &hints, &result);
-    if (rc < 0) {
+    rc = getaddrinfo(opts.hostname, opts.port, &hints, &result);
+    if (rc != 0) {
         fprintf(stderr, "cannot resolve\n");
         goto fail;
     }
 
     signal(SIGPIPE, SIG_IGN);
 
+    t.opts      = &opts;
+    t.hostname  = opts.hostname;
+    t.port      = opts.port;
+    t.ai        = result;
+    t.tx_msg    = msg;
+    t.tx_len    = msg_len;
+
+    if (opts.num_handshakes > 0) {
+        if (drv_bench_handshake(ctx, &t, opts.num_handshakes))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.bulk_size > 0) {
+        if (drv_bench_bulk(ctx, &t, opts.bulk_size))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_pingpongs > 0) {
+        if (drv_bench_pingpong(ctx, &t, opts.num_pingpongs))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_idle > 0) {
+        if (drv_bench_idle(ctx, &t, opts.num_idle))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.startup) {
+        if (drv_bench_startup(ctx, &t))
+            res = 0;
+        goto fail;
+    }
+
     fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (fd < 0) {
         fprintf(stderr, "cannot create socket\n");
@@ -156,17 +471,35 @@ int main(int argc, char **argv)
         goto fail;
     }
 
-    ssl = new_conn(ctx, fd, "www.example.com");
+    ssl = new_conn_ex(ctx, fd, opts.hostname, opts.port,
+                      opts.ktls ? APP_CONN_KTLS : 0);
     if (ssl == NULL) {
         fprintf(stderr, "cannot create connection\n");
         goto fail;
     }
 
-    if (tx(ssl, msg, sizeof(msg)-1) < sizeof(msg)-1) {
+    if (tx(ssl, msg, msg_len) < msg_len) {
         fprintf(stderr, "tx error\n");
         goto fail;
     }
 
+    if (file_fd >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        sent = tx_file(ssl, file_fd, 0, st.st_size);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        if (sent != st.st_size) {
+            fprintf(stderr, "tx_file error\n");
+            goto fail;
+        }
+
+        fprintf(stderr, "tx_file: %lld bytes in %.3f s; %.2f MB/s (%s)\n",
+                (long long)sent, timespec_diff(&t0, &t1),
+                sent / timespec_diff(&t0, &t1) / 1e6,
+                get_conn_ktls(ssl) & APP_CONN_KTLS_TX
+                    ? "SSL_sendfile" : "SSL_write");
+    }
+
     for (;;) {
         l = rx(ssl, buf, sizeof(buf));
         if (l <= 0)
@@ -182,6 +515,8 @@ fail:
         teardown_ctx(ctx);
     if (fd >= 0)
         close(fd);
+    if (file_fd >= 0)
+        close(file_fd);
     if (result != NULL)
         freeaddrinfo(result);
     return res;
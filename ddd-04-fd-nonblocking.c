@@ -1,4 +1,11 @@
+#define _GNU_SOURCE
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
 #include <openssl/ssl.h>
 #define API_V 1
 
@@ -16,8 +23,24 @@ typedef struct app_conn_st {
     SSL *ssl;
     int fd;
     int rx_need_tx, tx_need_rx;
+    int flags, ktls;
+    int early_state;
+    unsigned char *early_buf;
+    size_t early_cap, early_len, early_off;
 } APP_CONN;
 
+/* States of the 0-RTT early data path, see tx(). */
+#define EARLY_DATA_NONE     0   /* not possible, or finished with */
+#define EARLY_DATA_TRY      1   /* the first tx() will send early data */
+#define EARLY_DATA_SENT     2   /* sent; waiting for the server's verdict */
+#define EARLY_DATA_REPLAY   3   /* rejected; resending it */
+
+#define DDD_ASYNC_VERIFY
+#define DDD_ASYNC_JOBS
+#define DDD_SSL_POOL
+#define DDD_CONN_CACHE
+#include "ddd-common.h"
+
 /*
  * The application is initializing and wants an SSL_CTX which it will use for
  * some number of outgoing connections, which it creates in subsequent calls to
@@ -27,6 +50,7 @@ typedef struct app_conn_st {
 SSL_CTX *create_ssl_ctx(void)
 {
     SSL_CTX *ctx;
+    X509_STORE *store;
 
     ctx = SSL_CTX_new(TLS_client_method());
     if (ctx == NULL)
@@ -35,8 +59,16 @@ SSL_CTX *create_ssl_ctx(void)
     /* Enable trust chain verification. */
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
 
-    /* Load default root CA store. */
-    if (SSL_CTX_set_default_verify_paths(ctx) == 0) {
+    /* Use the default root CA store, shared with every other SSL_CTX. */
+    store = get_trust_store();
+    if (store == NULL) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set1_cert_store(ctx, store);
+
+    /* Cache sessions so that later connections to a server can resume. */
+    if (sess_cache_enable(ctx) == 0) {
         SSL_CTX_free(ctx);
         return NULL;
     }
@@ -44,51 +76,218 @@ SSL_CTX *create_ssl_ctx(void)
     return ctx;
 }
 
+/*
+ * Flags for new_conn_ex.
+ *
+ * APP_CONN_KTLS: have libssl hand the record layer's crypto to kernel TLS
+ * after the handshake where the kernel and the negotiated cipher allow it.
+ * Directions which end up offloaded (see get_conn_ktls()) bypass libssl in
+ * tx() and rx(); the others stay in user space.
+ */
+#define APP_CONN_KTLS       1
+
+/*
+ * APP_CONN_ASYNC: run libssl's work in async jobs (SSL_MODE_ASYNC), so that an
+ * engine or provider doing crypto asynchronously pauses the job rather than
+ * blocking the caller. While an operation is in flight, tx() and rx() return
+ * -2 and get_conn_pending_tx() and get_conn_pending_rx() ask for no network
+ * events; the application waits for the fds from get_conn_async_fds() to
+ * become readable instead, then repeats the same call to resume the job. If
+ * libcrypto has no async job to run it in (SSL_ERROR_WANT_ASYNC_JOB), there
+ * is nothing to wait for, and the call fails with -1.
+ */
+#define APP_CONN_ASYNC      2
+
 /*
  * The application wants to create a new outgoing connection using a given
  * SSL_CTX.
  *
- * hostname is a string like "example.com" used for certificate validation.
+ * hostname is a string like "example.com" used for certificate validation,
+ * and port the server's port, like "443". Sessions are filed under
+ * hostname:port. new_conn() is new_conn_ex() without flags for a server on
+ * port 443.
  */
-APP_CONN *new_conn(SSL_CTX *ctx, int fd, const char *bare_hostname)
+APP_CONN *new_conn_ex(SSL_CTX *ctx, int fd, const char *bare_hostname,
+                      const char *port, int flags)
 {
     APP_CONN *conn;
     SSL *ssl;
+    SSL_SESSION *sess;
+    char key[300];
 
-    conn = calloc(1, sizeof(APP_CONN));
+    conn = conn_alloc();
     if (conn == NULL)
         return NULL;
 
-    ssl = conn->ssl = SSL_new(ctx);
+    ssl = conn->ssl = ssl_pool_take(ctx);
     if (ssl == NULL) {
-        free(conn);
+        conn_release(conn);
         return NULL;
     }
 
     SSL_set_connect_state(ssl); /* cannot fail */
 
+    if (flags & APP_CONN_KTLS)
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+
+    if (flags & APP_CONN_ASYNC)
+        SSL_set_mode(ssl, SSL_MODE_ASYNC);
+
     if (SSL_set_fd(ssl, fd) <= 0) {
         SSL_free(ssl);
-        free(conn);
+        conn_release(conn);
         return NULL;
     }
 
     if (SSL_set1_host(ssl, bare_hostname) <= 0) {
         SSL_free(ssl);
-        free(conn);
+        conn_release(conn);
         return NULL;
     }
 
     if (SSL_set_tlsext_host_name(ssl, bare_hostname) <= 0) {
         SSL_free(ssl);
-        free(conn);
+        conn_release(conn);
         return NULL;
     }
 
-    conn->fd = fd;
+    /* Offer the session we last got from this server, if any. */
+    snprintf(key, sizeof(key), "%s:%s", bare_hostname, port);
+    if (sess_cache_attach(ssl, key) == 0) {
+        SSL_free(ssl);
+        conn_release(conn);
+        return NULL;
+    }
+
+    /* A resumed session may let the first tx() go out as early data. */
+    sess = SSL_get0_session(ssl);
+    if (sess != NULL && SSL_SESSION_get_max_early_data(sess) > 0)
+        conn->early_state = EARLY_DATA_TRY;
+
+    conn->fd    = fd;
+    conn->flags = flags;
     return conn;
 }
 
+APP_CONN *new_conn(SSL_CTX *ctx, int fd, const char *bare_hostname)
+{
+    return new_conn_ex(ctx, fd, bare_hostname, "443", 0);
+}
+
+/*
+ * Returned by get_conn_ktls().
+ */
+#define APP_CONN_KTLS_TX    1
+#define APP_CONN_KTLS_RX    2
+
+/*
+ * Notes which directions libssl has handed to kernel TLS. Only called when
+ * libssl has no data of its own left to write (or, for rx(), no data of its
+ * own left to return), so that from then on tx() and rx() can do plain socket
+ * I/O in that direction.
+ */
+static void update_ktls(APP_CONN *conn, int dir)
+{
+#ifndef OPENSSL_NO_KTLS
+    if ((conn->flags & APP_CONN_KTLS) == 0 || (conn->ktls & dir) != 0
+        || conn->early_state != EARLY_DATA_NONE
+        || !SSL_is_init_finished(conn->ssl))
+        return;
+
+    if (dir == APP_CONN_KTLS_TX && BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+        conn->ktls |= APP_CONN_KTLS_TX;
+    if (dir == APP_CONN_KTLS_RX && BIO_get_ktls_recv(SSL_get_rbio(conn->ssl))
+        && SSL_pending(conn->ssl) == 0)
+        conn->ktls |= APP_CONN_KTLS_RX;
+#endif
+}
+
+/*
+ * 0-RTT early data
+ * ----------------
+ *
+ * If new_conn() resumed a session which allows it, the first tx() sends the
+ * application's data as TLS 1.3 early data along with the ClientHello rather
+ * than waiting a round trip for the handshake to complete. A copy is kept
+ * until the handshake is done: the server may reject early data, in which
+ * case it is sent again as ordinary application data before anything else
+ * is written or read.
+ */
+static int tx_early(APP_CONN *conn, const void *buf, int buf_len)
+{
+    SSL_SESSION *sess = SSL_get0_session(conn->ssl);
+    size_t max_early = SSL_SESSION_get_max_early_data(sess), written;
+
+    if ((size_t)buf_len > max_early)
+        buf_len = max_early;
+
+    /* We must be able to replay whatever we send. */
+    if ((size_t)buf_len > conn->early_cap) {
+        void *p = realloc(conn->early_buf, buf_len);
+
+        if (p == NULL) {
+            conn->early_state = EARLY_DATA_NONE;
+            return SSL_write(conn->ssl, buf, buf_len);
+        }
+
+        conn->early_buf = p;
+        conn->early_cap = buf_len;
+    }
+
+    if (SSL_write_early_data(conn->ssl, buf, buf_len, &written) <= 0)
+        return 0;
+
+    memcpy(conn->early_buf, buf, written);
+    conn->early_len     = written;
+    conn->early_state   = EARLY_DATA_SENT;
+    return written;
+}
+
+/*
+ * Completes the handshake once early data has been sent and replays the early
+ * data if the server rejected it. Returns 1 when done, otherwise the return
+ * value of the libssl call which could not complete, for SSL_get_error.
+ */
+static int finish_early_data(APP_CONN *conn)
+{
+    int l;
+
+    if (conn->early_state == EARLY_DATA_TRY) {
+        /* The handshake is starting without us having sent anything. */
+        conn->early_state = EARLY_DATA_NONE;
+        return 1;
+    }
+
+    if (conn->early_state == EARLY_DATA_SENT) {
+        l = SSL_do_handshake(conn->ssl);
+        if (l <= 0)
+            return l;
+
+        if (SSL_get_early_data_status(conn->ssl) == SSL_EARLY_DATA_ACCEPTED) {
+            conn->early_state = EARLY_DATA_NONE;
+        } else {
+            conn->early_state   = EARLY_DATA_REPLAY;
+            conn->early_off     = 0;
+        }
+    }
+
+    while (conn->early_state == EARLY_DATA_REPLAY
+           && conn->early_off < conn->early_len) {
+        l = SSL_write(conn->ssl, conn->early_buf + conn->early_off,
+                      conn->early_len - conn->early_off);
+        if (l <= 0)
+            return l;
+
+        conn->early_off += l;
+    }
+
+    free(conn->early_buf);
+    conn->early_buf     = NULL;
+    conn->early_cap     = 0;
+    conn->early_state   = EARLY_DATA_NONE;
+    return 1;
+}
+
 /*
  * Non-blocking transmission.
  *
@@ -101,7 +300,20 @@ int tx(APP_CONN *conn, const void *buf, int buf_len)
 
     conn->tx_need_rx = 0;
 
-    l = SSL_write(conn->ssl, buf, buf_len);
+    if (conn->ktls & APP_CONN_KTLS_TX) {
+        /* The kernel frames and encrypts what we write to the socket. */
+        l = send(conn->fd, buf, buf_len, MSG_NOSIGNAL);
+        if (l < 0)
+            return (errno == EAGAIN || errno == EINTR) ? -2 : -1;
+
+        return l;
+    }
+
+    if (conn->early_state == EARLY_DATA_TRY)
+        l = tx_early(conn, buf, buf_len);
+    else if ((l = finish_early_data(conn)) > 0)
+        l = SSL_write(conn->ssl, buf, buf_len);
+
     if (l <= 0) {
         rc = SSL_get_error(conn->ssl, l);
         switch (rc) {
@@ -109,12 +321,15 @@ int tx(APP_CONN *conn, const void *buf, int buf_len)
                 conn->tx_need_rx = 1;
             case SSL_ERROR_WANT_CONNECT:
             case SSL_ERROR_WANT_WRITE:
+            case SSL_ERROR_WANT_RETRY_VERIFY:
+            case SSL_ERROR_WANT_ASYNC:
                 return -2;
             default:
                 return -1;
         }
     }
 
+    update_ktls(conn, APP_CONN_KTLS_TX);
     return l;
 }
 
@@ -130,22 +345,67 @@ int rx(APP_CONN *conn, void *buf, int buf_len)
 
     conn->rx_need_tx = 0;
 
-    l = SSL_read(conn->ssl, buf, buf_len);
+    if ((conn->ktls & APP_CONN_KTLS_RX) != 0 && SSL_pending(conn->ssl) == 0) {
+        /*
+         * The kernel decrypts application data records for us. It fails with
+         * EIO if the next record is anything else (an alert, a post-handshake
+         * message), which is then left to libssl.
+         */
+        l = recv(conn->fd, buf, buf_len, 0);
+        if (l > 0)
+            return l;
+        if (l < 0 && (errno == EAGAIN || errno == EINTR))
+            return -2;
+        if (l == 0 || errno != EIO)
+            return -1;
+    }
+
+    if ((l = finish_early_data(conn)) > 0)
+        l = SSL_read(conn->ssl, buf, buf_len);
+
     if (l <= 0) {
         rc = SSL_get_error(conn->ssl, l);
         switch (rc) {
             case SSL_ERROR_WANT_WRITE:
                 conn->rx_need_tx = 1;
             case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_RETRY_VERIFY:
+            case SSL_ERROR_WANT_ASYNC:
                 return -2;
             default:
                 return -1;
         }
     }
 
+    update_ktls(conn, APP_CONN_KTLS_RX);
     return l;
 }
 
+/*
+ * The application wants to know what became of the data it passed to the
+ * first tx(). Returns SSL_EARLY_DATA_NOT_SENT if it was not sent as 0-RTT early
+ * data, SSL_EARLY_DATA_ACCEPTED if the server accepted it as such, or
+ * SSL_EARLY_DATA_REJECTED if the server rejected it and tx() or rx() resent it
+ * after the handshake. Only meaningful once the handshake is complete.
+ */
+int get_conn_early_data_status(APP_CONN *conn)
+{
+    return SSL_get_early_data_status(conn->ssl);
+}
+
+/*
+ * The application wants to know which directions of a connection created with
+ * APP_CONN_KTLS are encrypted and decrypted by the kernel. Returns zero or more
+ * of APP_CONN_KTLS_TX and APP_CONN_KTLS_RX once the handshake is done and the
+ * first tx() or rx() after it has succeeded. A direction is not offloaded if
+ * the kernel has no TLS support, or does not support the negotiated cipher or
+ * protocol version; libssl then carries on doing its crypto in user space.
+ */
+int get_conn_ktls(APP_CONN *conn)
+{
+    return conn->ktls;
+}
+
 /*
  * The application wants to know a fd it can poll on to determine when the
  * SSL state machine needs to be pumped.
@@ -166,6 +426,20 @@ int get_conn_fd(APP_CONN *conn)
     return conn->fd;
 }
 
+/*
+ * The application wants to know which fds to wait on, in addition to the
+ * network, while an operation of an APP_CONN_ASYNC connection is in flight.
+ * Returns the fds added since the last call in add and those removed in del,
+ * either of which may be NULL to just get the counts in *num_add and
+ * *num_del. The application waits for readability on the fds it was given
+ * and has not had taken away again. Returns 0 on error.
+ */
+int get_conn_async_fds(APP_CONN *conn, int *add, size_t *num_add,
+                       int *del, size_t *num_del)
+{
+    return SSL_get_changed_async_fds(conn->ssl, add, num_add, del, num_del);
+}
+
 /*
  * These functions returns zero or more of:
  * 
@@ -181,11 +455,21 @@ int get_conn_fd(APP_CONN *conn)
  */
 int get_conn_pending_tx(APP_CONN *conn)
 {
+    /*
+     * Nothing on the network can help until the verification or the
+     * asynchronous operation is done.
+     */
+    if (SSL_want_retry_verify(conn->ssl) || SSL_waiting_for_async(conn->ssl))
+        return 0;
+
     return (conn->tx_need_rx ? POLLIN : 0) | POLLOUT | POLLERR;
 }
 
 int get_conn_pending_rx(APP_CONN *conn)
 {
+    if (SSL_want_retry_verify(conn->ssl) || SSL_waiting_for_async(conn->ssl))
+        return 0;
+
     return (conn->rx_need_tx ? POLLOUT : 0) | POLLIN | POLLERR;
 }
 
@@ -196,8 +480,10 @@ int get_conn_pending_rx(APP_CONN *conn)
 void teardown(APP_CONN *conn)
 {
     SSL_shutdown(conn->ssl);
-    SSL_free(conn->ssl);
-    free(conn);
+    if (!ssl_pool_give(conn->ssl))
+        SSL_free(conn->ssl);
+    free(conn->early_buf);
+    conn_release(conn);
 }
 
 /*
@@ -206,6 +492,7 @@ void teardown(APP_CONN *conn)
  */
 void teardown_ctx(SSL_CTX *ctx)
 {
+    ssl_pool_drain(ctx);
     SSL_CTX_free(ctx);
 }
 
@@ -214,26 +501,90 @@ void teardown_ctx(SSL_CTX *ctx)
  * Example driver for the above code. This is just to demonstrate that the code
  * works and is not intended to be representative of a real application.
  */
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/signal.h>
-#include <netdb.h>
-#include <unistd.h>
-#include <fcntl.h>
+#define DRV_REACTOR
+#define DRV_EARLY_DATA
+#define DRV_ASYNC
+#define DRV_CONNECT
+#define DRV_SSL_POOL
+#define DRV_CONN_CACHE
+#include "ddd-driver.h"
+#include <stdatomic.h>
+
+/* Connections which had each direction offloaded to kernel TLS. */
+static atomic_ulong drv_num_ktls_tx, drv_num_ktls_rx;
+
+/*
+ * The application owns the socket and hands it to libssl, which does all
+ * network I/O on it.
+ */
+static APP_CONN *drv_conn_new(SSL_CTX *ctx, const DRV_TARGET *t, DRV_CONN *dc)
+{
+    APP_CONN *conn;
+    int fd;
+
+    fd = drv_connect(t);
+    if (fd < 0)
+        return NULL;
+
+    conn = new_conn_ex(ctx, fd, t->hostname, t->port,
+                       (t->opts->ktls ? APP_CONN_KTLS : 0)
+                       | (t->opts->async ? APP_CONN_ASYNC : 0));
+    if (conn == NULL)
+        close(fd);
+
+    return conn;
+}
+
+static int drv_conn_fd(DRV_CONN *dc)
+{
+    return get_conn_fd(dc->conn);
+}
+
+static int drv_conn_pump(DRV_CONN *dc)
+{
+    return 0;
+}
+
+static int drv_conn_events(DRV_CONN *dc, int pending)
+{
+    return pending;
+}
+
+static void drv_conn_free(DRV_CONN *dc)
+{
+    int fd = get_conn_fd(dc->conn);
+
+    if (get_conn_ktls(dc->conn) & APP_CONN_KTLS_TX)
+        ++drv_num_ktls_tx;
+    if (get_conn_ktls(dc->conn) & APP_CONN_KTLS_RX)
+        ++drv_num_ktls_rx;
+
+    teardown(dc->conn);
+    close(fd);
+}
 
 int main(int argc, char **argv)
 {
     int rc, fd = -1, res = 1;
-    const char tx_msg[] = "GET / HTTP/1.0\r\nHost: www.example.com\r\n\r\n";
+    char tx_msg[512];
     const char *tx_p = tx_msg;
     char rx_msg[2048], *rx_p = rx_msg;
-    int l, tx_len = sizeof(tx_msg)-1, rx_len = sizeof(rx_msg);
+    int l, tx_len, rx_len = sizeof(rx_msg);
     int timeout = 2000 /* ms */;
     APP_CONN *conn = NULL;
     struct addrinfo hints = {0}, *result = NULL;
-    SSL_CTX *ctx;
+    SSL_CTX *ctx = NULL;
+    DRV_OPTS opts;
+    DRV_TARGET t;
+
+    if (drv_getopt(argc, argv, &opts) == 0)
+        return 1;
+
+    tx_len = snprintf(tx_msg, sizeof(tx_msg),
+                      "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                      opts.path, opts.hostname);
 
-    ctx = create_ssl_ctx();
+    ctx = drv_create_ctx(&opts);
     if (ctx == NULL) {
         fprintf(stderr, "cannot create SSL context\n");
         goto fail;
@@ -242,14 +593,60 @@ int main(int argc, char **argv)
     hints.ai_family     = AF_INET;
     hints.ai_socktype   = SOCK_STREAM;
     hints.ai_flags      = AI_PASSIVE;
-    rc = getaddrinfo("www.example.com", "443", &hints, &result);
-    if (rc < 0) {
+    rc = getaddrinfo(opts.hostname, opts.port, &hints, &result);
+    if (rc != 0) {
         fprintf(stderr, "cannot resolve\n");
         goto fail;
     }
 
     signal(SIGPIPE, SIG_IGN);
 
+    t.opts      = &opts;
+    t.hostname  = opts.hostname;
+    t.port      = opts.port;
+    t.ai        = result;
+    t.tx_msg    = tx_msg;
+    t.tx_len    = tx_len;
+
+    if (opts.num_handshakes > 0) {
+        if (drv_bench_handshake(ctx, &t, opts.num_handshakes))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.bulk_size > 0) {
+        if (drv_bench_bulk(ctx, &t, opts.bulk_size))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_pingpongs > 0) {
+        if (drv_bench_pingpong(ctx, &t, opts.num_pingpongs))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_idle > 0) {
+        if (drv_bench_idle(ctx, &t, opts.num_idle))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.startup) {
+        if (drv_bench_startup(ctx, &t))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_conns > 0) {
+        if (drv_run_many(ctx, &t, &opts))
+            res = 0;
+        if (opts.ktls)
+            fprintf(stderr, "kTLS: TX offloaded on %lu connections, "
+                    "RX on %lu\n", drv_num_ktls_tx, drv_num_ktls_rx);
+        goto fail;
+    }
+
     fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (fd < 0) {
         fprintf(stderr, "cannot create socket\n");
@@ -268,7 +665,9 @@ int main(int argc, char **argv)
         goto fail;
     }
 
-    conn = new_conn(ctx, fd, "www.example.com");
+    /* No APP_CONN_ASYNC: drv_getopt() rejects -a without -n. */
+    conn = new_conn_ex(ctx, fd, opts.hostname, opts.port,
+                       opts.ktls ? APP_CONN_KTLS : 0);
     if (conn == NULL) {
         fprintf(stderr, "cannot establish connection\n");
         goto fail;
@@ -315,6 +714,11 @@ int main(int argc, char **argv)
 
     fwrite(rx_msg, 1, rx_p - rx_msg, stdout);
 
+    if (opts.ktls)
+        fprintf(stderr, "kTLS: TX %s, RX %s\n",
+                get_conn_ktls(conn) & APP_CONN_KTLS_TX ? "offloaded" : "in user space",
+                get_conn_ktls(conn) & APP_CONN_KTLS_RX ? "offloaded" : "in user space");
+
     res = 0;
 fail:
     if (conn != NULL)
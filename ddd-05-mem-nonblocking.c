@@ -1,5 +1,12 @@
+#define _GNU_SOURCE
 #include <sys/poll.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
+#include <openssl/err.h>
 
 /* 
  * Demo 5: Client — Client Uses Memory BIO — Nonblocking
@@ -19,8 +26,27 @@ typedef struct app_conn_st {
     SSL *ssl;
     BIO *ssl_bio, *net_bio;
     int rx_need_tx, tx_need_rx;
+    int early_state;
+    unsigned char *early_buf;
+    size_t early_cap, early_len, early_off;
+    int shrink, shrunk;     /* see APP_CONN_IDLE_SHRINK */
+    long bio_size;
+    struct hs_offload_st *offload; /* see enable_handshake_offload() */
 } APP_CONN;
 
+/* States of the 0-RTT early data path, see tx(). */
+#define EARLY_DATA_NONE     0   /* not possible, or finished with */
+#define EARLY_DATA_TRY      1   /* the first tx() will send early data */
+#define EARLY_DATA_SENT     2   /* sent; waiting for the server's verdict */
+#define EARLY_DATA_REPLAY   3   /* rejected; resending it */
+
+#define DDD_ASYNC_VERIFY
+#define DDD_ASYNC_JOBS
+#define DDD_SSL_POOL
+#define DDD_CONN_CACHE
+#define DDD_CONN_CACHE_BIO_PAIR
+#include "ddd-common.h"
+
 /*
  * The application is initializing and wants an SSL_CTX which it will use for
  * some number of outgoing connections, which it creates in subsequent calls to
@@ -30,235 +56,2318 @@ typedef struct app_conn_st {
 SSL_CTX *create_ssl_ctx(void)
 {
     SSL_CTX *ctx;
+    X509_STORE *store;
 
     ctx = SSL_CTX_new(TLS_client_method());
     if (ctx == NULL)
         return NULL;
 
-    /* Enable trust chain verification. */
-    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    /* Enable trust chain verification. */
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+    /* Use the default root CA store, shared with every other SSL_CTX. */
+    store = get_trust_store();
+    if (store == NULL) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set1_cert_store(ctx, store);
+
+    /* Cache sessions so that later connections to a server can resume. */
+    if (sess_cache_enable(ctx) == 0) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/*
+ * Cached BIO pairs
+ * ----------------
+ *
+ * Besides the APP_CONN, every connection here allocates a BIO pair and its two
+ * buffers. With use_conn_cache(), a cached structure also keeps its
+ * connection's BIO pair if that is an ordinary one (not APP_CONN_THREADED, not
+ * unpaired by APP_CONN_IDLE_SHRINK) and was not shut down. It is emptied and
+ * handed to the next connection made from the structure, buffers and all.
+ * Structures released on a handshake worker, which never makes connections,
+ * are freed rather than cached.
+ */
+static __thread unsigned long conn_num_bio_reused;
+
+/*
+ * Takes the BIO pair kept by conn's structure, if any. Returns 0 if there is
+ * none.
+ */
+static int conn_take_bio_pair(APP_CONN *conn, BIO **internal_bio,
+                              BIO **net_bio)
+{
+    CONN_SLOT *slot = (CONN_SLOT *)conn;
+
+    if (slot->internal_bio == NULL)
+        return 0;
+
+    *internal_bio       = slot->internal_bio;
+    *net_bio            = slot->net_bio;
+    slot->internal_bio  = NULL;
+    slot->net_bio       = NULL;
+    ++conn_num_bio_reused;
+    return 1;
+}
+
+/*
+ * Keeps a finished connection's BIO pair with its structure if the pair can
+ * be reused, and frees it otherwise. The pair must have no other users.
+ */
+static void conn_keep_bio_pair(APP_CONN *conn, BIO *internal_bio,
+                               BIO *net_bio)
+{
+    CONN_SLOT *slot = (CONN_SLOT *)conn;
+
+    BIO_reset(internal_bio);
+    BIO_reset(net_bio);
+    BIO_ctrl_reset_read_request(internal_bio);
+    BIO_ctrl_reset_read_request(net_bio);
+    BIO_clear_retry_flags(internal_bio);
+    BIO_clear_retry_flags(net_bio);
+
+    /* Only a joined pair which was not shut down can take a full buffer. */
+    if (slot->internal_bio != NULL
+        || BIO_ctrl_get_write_guarantee(internal_bio)
+           != (size_t)BIO_get_write_buf_size(internal_bio, 0)
+        || BIO_ctrl_get_write_guarantee(net_bio)
+           != (size_t)BIO_get_write_buf_size(net_bio, 0)) {
+        BIO_free(internal_bio);
+        BIO_free(net_bio);
+        return;
+    }
+
+    slot->internal_bio  = internal_bio;
+    slot->net_bio       = net_bio;
+}
+
+/*
+ * The application wants to know how many connections the calling thread made
+ * with a cached BIO pair. This is 0 without use_conn_cache().
+ */
+void get_conn_bio_pair_stats(unsigned long *num_bio_reused)
+{
+    *num_bio_reused = conn_num_bio_reused;
+}
+
+/*
+ * Lock-free ring BIO pair
+ * -----------------------
+ *
+ * A BIO pair from BIO_new_bio_pair() may not be used from two threads at once.
+ * An application wanting one thread to move data to and from the network
+ * (write_net_rx, read_net_tx and friends) while another thread calls tx() and
+ * rx() on the same connection can instead have new_conn_ex() join the SSL
+ * object to the network with a pair of the BIOs below. Each direction is a
+ * single-producer/single-consumer ring, so as long as each BIO of the pair is
+ * only used by one thread, no locking is needed.
+ */
+#define RING_SIZE   (32 * 1024) /* must be a power of two */
+
+typedef struct spsc_ring_st {
+    /* Each index is only advanced by one side; keep them on separate lines. */
+    _Alignas(64) atomic_size_t head; /* advanced by the consumer */
+    _Alignas(64) atomic_size_t tail; /* advanced by the producer */
+    _Alignas(64) unsigned char buf[RING_SIZE];
+} SPSC_RING;
+
+typedef struct ring_pair_st {
+    SPSC_RING to_ssl, to_net;
+    atomic_int refs;
+} RING_PAIR;
+
+/* State of one BIO of the pair. */
+typedef struct ring_end_st {
+    RING_PAIR *pair;
+    SPSC_RING *rd, *wr;
+} RING_END;
+
+static BIO_METHOD *ring_method;
+static CRYPTO_ONCE ring_method_once = CRYPTO_ONCE_STATIC_INIT;
+
+static size_t ring_used(SPSC_RING *r)
+{
+    return atomic_load_explicit(&r->tail, memory_order_acquire)
+        - atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+/*
+ * Returns the next contiguous region the producer may fill.
+ */
+static size_t ring_write_region(SPSC_RING *r, unsigned char **p)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t off = tail & (RING_SIZE - 1), free = RING_SIZE - (tail - head);
+
+    *p = r->buf + off;
+    return free < RING_SIZE - off ? free : RING_SIZE - off;
+}
+
+/*
+ * Returns the next contiguous region the consumer may drain.
+ */
+static size_t ring_read_region(SPSC_RING *r, unsigned char **p)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t off = head & (RING_SIZE - 1), used = tail - head;
+
+    *p = r->buf + off;
+    return used < RING_SIZE - off ? used : RING_SIZE - off;
+}
+
+static void ring_produce(SPSC_RING *r, size_t len)
+{
+    atomic_fetch_add_explicit(&r->tail, len, memory_order_release);
+}
+
+static void ring_consume(SPSC_RING *r, size_t len)
+{
+    atomic_fetch_add_explicit(&r->head, len, memory_order_release);
+}
+
+static int ring_bio_write(BIO *b, const char *data, size_t len,
+                          size_t *written)
+{
+    RING_END *e = BIO_get_data(b);
+    unsigned char *p;
+    size_t n, total = 0;
+
+    BIO_clear_retry_flags(b);
+
+    /* At most two regions, as the ring may wrap. */
+    while (total < len && (n = ring_write_region(e->wr, &p)) > 0) {
+        if (n > len - total)
+            n = len - total;
+        memcpy(p, data + total, n);
+        ring_produce(e->wr, n);
+        total += n;
+    }
+
+    if (total == 0) {
+        BIO_set_retry_write(b);
+        return 0;
+    }
+
+    *written = total;
+    return 1;
+}
+
+static int ring_bio_read(BIO *b, char *data, size_t len, size_t *readbytes)
+{
+    RING_END *e = BIO_get_data(b);
+    unsigned char *p;
+    size_t n, total = 0;
+
+    BIO_clear_retry_flags(b);
+
+    while (total < len && (n = ring_read_region(e->rd, &p)) > 0) {
+        if (n > len - total)
+            n = len - total;
+        memcpy(data + total, p, n);
+        ring_consume(e->rd, n);
+        total += n;
+    }
+
+    if (total == 0) {
+        BIO_set_retry_read(b);
+        return 0;
+    }
+
+    *readbytes = total;
+    return 1;
+}
+
+static long ring_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+    RING_END *e = BIO_get_data(b);
+    size_t n;
+
+    switch (cmd) {
+        case BIO_CTRL_PENDING:
+            return ring_used(e->rd);
+        case BIO_CTRL_WPENDING:
+            return ring_used(e->wr);
+        case BIO_C_GET_WRITE_GUARANTEE:
+            return RING_SIZE - ring_used(e->wr);
+        case BIO_CTRL_FLUSH:
+            return 1;
+
+        /* Support BIO_nwrite0/BIO_nread0 and friends, as a BIO pair does. */
+        case BIO_C_NWRITE0:
+            return ring_write_region(e->wr, (unsigned char **)ptr);
+        case BIO_C_NWRITE:
+            n = ring_write_region(e->wr, (unsigned char **)ptr);
+            if ((size_t)num < n)
+                n = num;
+            ring_produce(e->wr, n);
+            return n;
+        case BIO_C_NREAD0:
+            return ring_read_region(e->rd, (unsigned char **)ptr);
+        case BIO_C_NREAD:
+            n = ring_read_region(e->rd, (unsigned char **)ptr);
+            if ((size_t)num < n)
+                n = num;
+            ring_consume(e->rd, n);
+            return n;
+        default:
+            return 0;
+    }
+}
+
+static int ring_bio_destroy(BIO *b)
+{
+    RING_END *e = BIO_get_data(b);
+
+    if (e == NULL)
+        return 1;
+
+    if (atomic_fetch_sub(&e->pair->refs, 1) == 1)
+        free(e->pair);
+    free(e);
+    BIO_set_data(b, NULL);
+    return 1;
+}
+
+static void ring_method_init(void)
+{
+    BIO_METHOD *m;
+
+    m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "spsc ring");
+    if (m == NULL)
+        return;
+
+    BIO_meth_set_write_ex(m, ring_bio_write);
+    BIO_meth_set_read_ex(m, ring_bio_read);
+    BIO_meth_set_ctrl(m, ring_bio_ctrl);
+    BIO_meth_set_destroy(m, ring_bio_destroy);
+    ring_method = m;
+}
+
+static BIO *ring_bio_new(RING_PAIR *pair, SPSC_RING *rd, SPSC_RING *wr)
+{
+    RING_END *e;
+    BIO *b;
+
+    e = malloc(sizeof(RING_END));
+    if (e == NULL)
+        return NULL;
+
+    b = BIO_new(ring_method);
+    if (b == NULL) {
+        free(e);
+        return NULL;
+    }
+
+    e->pair = pair;
+    e->rd   = rd;
+    e->wr   = wr;
+    atomic_fetch_add(&pair->refs, 1);
+    BIO_set_data(b, e);
+    BIO_set_init(b, 1);
+    return b;
+}
+
+/*
+ * Like BIO_new_bio_pair, but the two BIOs may be used from different threads.
+ */
+static int new_ring_bio_pair(BIO **bio1, BIO **bio2)
+{
+    RING_PAIR *pair;
+
+    if (!CRYPTO_THREAD_run_once(&ring_method_once, ring_method_init)
+        || ring_method == NULL)
+        return 0;
+
+    pair = aligned_alloc(64, sizeof(RING_PAIR));
+    if (pair == NULL)
+        return 0;
+
+    atomic_init(&pair->to_ssl.head, 0);
+    atomic_init(&pair->to_ssl.tail, 0);
+    atomic_init(&pair->to_net.head, 0);
+    atomic_init(&pair->to_net.tail, 0);
+    atomic_init(&pair->refs, 1);
+
+    *bio1 = ring_bio_new(pair, &pair->to_ssl, &pair->to_net);
+    *bio2 = ring_bio_new(pair, &pair->to_net, &pair->to_ssl);
+
+    /* Drop our own reference; from here on the BIOs own the pair. */
+    if (atomic_fetch_sub(&pair->refs, 1) == 1)
+        free(pair);
+
+    if (*bio1 == NULL || *bio2 == NULL) {
+        BIO_free(*bio1);
+        BIO_free(*bio2);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Handshake offload
+ * -----------------
+ *
+ * Because libssl never touches the network in this model, the handshake of a
+ * connection need not run on the thread moving its bytes. With
+ * enable_handshake_offload(), each connection created from the SSL_CTX is
+ * assigned one of a pool of worker threads and joined to the network with a
+ * ring BIO pair. Until its handshake is over, tx() and rx() never call into
+ * libssl themselves. They hand the connection to its worker whenever the
+ * network has brought something the handshake was waiting for, and return -2.
+ * The worker runs SSL_do_handshake() until it wants the network again, then
+ * calls the function set with set_conn_handshake_notify(), and the application
+ * carries on as after any other -2. Meanwhile write_net_rx(), read_net_tx()
+ * and friends keep working on the application's thread, since each end of the
+ * ring pair is only used by one thread at a time. Once the handshake is
+ * complete the connection is back on the application's thread for good, and
+ * tx() and rx() work as usual.
+ *
+ * A connection only ever uses its own worker, so its handshake stays on one
+ * CPU's caches, and a burst of new connections no longer holds up the
+ * established connections on the application's thread. Offloaded connections
+ * send no early data and cannot be combined with APP_CONN_ASYNC.
+ */
+#define HS_OFFLOAD_MAX_WORKERS  64
+
+/* States of an offloaded handshake. */
+#define HS_OFFLOAD_WAIT     0   /* waiting for the network */
+#define HS_OFFLOAD_BUSY     1   /* queued for or running on its worker */
+#define HS_OFFLOAD_DONE     2   /* complete; back on the application's thread */
+#define HS_OFFLOAD_FAILED   3
+
+typedef struct hs_worker_st {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct hs_offload_st *head, *tail;
+} HS_WORKER;
+
+typedef struct hs_offload_st {
+    struct hs_offload_st *next;
+    APP_CONN *conn;
+    HS_WORKER *worker;
+    int state, orphaned;
+    int want;                   /* SSL_get_error() of the last attempt */
+    void (*notify)(void *arg);
+    void *notify_arg;
+} HS_OFFLOAD;
+
+/* The worker pool, which only ever grows. */
+static pthread_mutex_t hs_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static HS_WORKER hs_workers[HS_OFFLOAD_MAX_WORKERS];
+static int hs_num_workers;
+static unsigned int hs_next_worker;
+
+/* SSL_CTX marker for enable_handshake_offload(). */
+static int hs_offload_idx = -1;
+static CRYPTO_ONCE hs_offload_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void hs_offload_init(void)
+{
+    hs_offload_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+static int hs_offload_enabled(SSL_CTX *ctx)
+{
+    return hs_offload_idx >= 0
+        && SSL_CTX_get_ex_data(ctx, hs_offload_idx) != NULL;
+}
+
+/*
+ * Frees everything teardown() does. cache is 0 on threads which never make
+ * connections, such as the handshake workers: nothing would ever take the
+ * structure back out of their connection cache.
+ */
+static void conn_free(APP_CONN *conn, int cache)
+{
+    BIO *internal_bio = NULL;
+
+    /* An ordinary BIO pair may be kept for the next connection. */
+    if (cache && conn_cache_enabled && !conn->shrunk
+        && BIO_method_type(conn->net_bio) == BIO_TYPE_BIO) {
+        internal_bio = SSL_get_rbio(conn->ssl);
+        BIO_up_ref(internal_bio);
+    }
+
+    /* The SSL BIO owns the SSL object, but the pool may want it back. */
+    SSL_shutdown(conn->ssl);
+    BIO_set_close(conn->ssl_bio, BIO_NOCLOSE);
+    BIO_free_all(conn->ssl_bio);
+    if (!ssl_pool_give(conn->ssl))
+        SSL_free(conn->ssl);
+
+    if (internal_bio != NULL)
+        conn_keep_bio_pair(conn, internal_bio, conn->net_bio);
+    else
+        BIO_free_all(conn->net_bio);
+
+    free(conn->early_buf);
+    free(conn->offload);
+    if (cache)
+        conn_release(conn);
+    else
+        conn_slot_free((CONN_SLOT *)conn);
+}
+
+/*
+ * Returns whether the worker could get further with the handshake than it did
+ * last time, given what the network has brought since. Only called while the
+ * handshake is waiting, i.e. with no worker using the SSL object.
+ */
+static int hs_offload_ready(HS_OFFLOAD *o)
+{
+    BIO *internal_bio = SSL_get_rbio(o->conn->ssl);
+    VERIFY_JOB *job;
+    int ready;
+
+    switch (o->want) {
+        case SSL_ERROR_WANT_READ:
+            return BIO_ctrl_pending(internal_bio) > 0;
+        case SSL_ERROR_WANT_WRITE:
+            return BIO_ctrl_get_write_guarantee(internal_bio) > 0;
+        case SSL_ERROR_WANT_RETRY_VERIFY:
+            job = verify_job_get(o->conn->ssl);
+            if (job == NULL)
+                return 1;
+
+            pthread_mutex_lock(&verify_pool_lock);
+            ready = job->state != VERIFY_JOB_BUSY;
+            pthread_mutex_unlock(&verify_pool_lock);
+            return ready;
+        default:
+            return 1;   /* not started yet */
+    }
+}
+
+/* Runs the handshake of o as far as it goes without the network. */
+static void hs_offload_run(HS_OFFLOAD *o)
+{
+    int rc;
+
+    rc = SSL_do_handshake(o->conn->ssl);
+    if (rc == 1) {
+        o->want = SSL_ERROR_NONE;
+        return;
+    }
+
+    o->want = SSL_get_error(o->conn->ssl, rc);
+
+    /* Errors stay on this thread's queue; nobody would read them. */
+    ERR_clear_error();
+}
+
+static void *hs_worker_main(void *arg)
+{
+    HS_WORKER *w = arg;
+    HS_OFFLOAD *o;
+    int orphaned;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (w->head == NULL)
+            pthread_cond_wait(&w->cond, &w->lock);
+
+        o = w->head;
+        w->head = o->next;
+        if (w->head == NULL)
+            w->tail = NULL;
+        orphaned = o->orphaned;
+        pthread_mutex_unlock(&w->lock);
+
+        if (!orphaned)
+            hs_offload_run(o);
+
+        pthread_mutex_lock(&w->lock);
+        orphaned = o->orphaned;
+        if (!orphaned) {
+            switch (o->want) {
+                case SSL_ERROR_NONE:
+                    o->state = HS_OFFLOAD_DONE;
+                    break;
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:
+                case SSL_ERROR_WANT_RETRY_VERIFY:
+                    o->state = HS_OFFLOAD_WAIT;
+                    break;
+                default:
+                    o->state = HS_OFFLOAD_FAILED;
+            }
+            if (o->notify != NULL)
+                o->notify(o->notify_arg);
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        if (orphaned)
+            conn_free(o->conn, 0);
+    }
+
+    return NULL;
+}
+
+/*
+ * Called by tx() and rx() before going near libssl. Returns 1 if the
+ * handshake is over and they may carry on, 0 if it is still on or has just
+ * been handed to the worker, and -1 if it failed there.
+ */
+static int hs_offload_check(APP_CONN *conn)
+{
+    HS_OFFLOAD *o = conn->offload;
+    HS_WORKER *w;
+    int state;
+
+    if (o == NULL)
+        return 1;
+
+    w = o->worker;
+    pthread_mutex_lock(&w->lock);
+    state = o->state;
+    if (state == HS_OFFLOAD_WAIT && hs_offload_ready(o)) {
+        o->state    = HS_OFFLOAD_BUSY;
+        o->next     = NULL;
+        if (w->tail != NULL)
+            w->tail->next = o;
+        else
+            w->head = o;
+        w->tail = o;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    switch (state) {
+        case HS_OFFLOAD_DONE:
+            /* The worker is done with it, so the connection is ours again. */
+            free(o);
+            conn->offload = NULL;
+            return 1;
+        case HS_OFFLOAD_FAILED:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Returns the events an offloaded handshake waits for: none while it is on
+ * its worker or waiting for a verification worker, else those the worker's
+ * last attempt stopped for. Returns -1 if the handshake is not offloaded or is
+ * over, when the SSL object can be asked directly.
+ */
+static int hs_offload_pending(APP_CONN *conn)
+{
+    HS_OFFLOAD *o = conn->offload;
+    int events = -1;
+
+    if (o == NULL)
+        return -1;
+
+    pthread_mutex_lock(&o->worker->lock);
+    if (o->state == HS_OFFLOAD_BUSY) {
+        events = 0;
+    } else if (o->state == HS_OFFLOAD_WAIT) {
+        switch (o->want) {
+            case SSL_ERROR_WANT_READ:
+                events = POLLIN | POLLERR;
+                break;
+            case SSL_ERROR_WANT_RETRY_VERIFY:
+                events = 0;
+                break;
+            default:
+                /* Blocked on writing, or not started: flush and kick it. */
+                events = POLLOUT | POLLERR;
+        }
+    }
+    pthread_mutex_unlock(&o->worker->lock);
+
+    return events;
+}
+
+/*
+ * Sets up the handshake of a new connection to run on the next worker in
+ * turn.
+ */
+static int hs_offload_attach(APP_CONN *conn)
+{
+    HS_OFFLOAD *o;
+
+    o = calloc(1, sizeof(HS_OFFLOAD));
+    if (o == NULL)
+        return 0;
+
+    o->conn     = conn;
+    o->state    = HS_OFFLOAD_WAIT;
+    o->want     = SSL_ERROR_NONE;
+
+    pthread_mutex_lock(&hs_pool_lock);
+    o->worker = &hs_workers[hs_next_worker++ % hs_num_workers];
+    pthread_mutex_unlock(&hs_pool_lock);
+
+    conn->offload = o;
+    return 1;
+}
+
+/*
+ * The application wants the handshakes of connections created from an SSL_CTX
+ * run on worker threads rather than in tx() and rx(). The workers are shared
+ * by all SSL_CTX; there are as many as the largest num_workers asked for so
+ * far, up to HS_OFFLOAD_MAX_WORKERS. This must be called before the first
+ * new_conn() on the SSL_CTX.
+ */
+int enable_handshake_offload(SSL_CTX *ctx, int num_workers)
+{
+    pthread_t thread;
+    HS_WORKER *w;
+    int n;
+
+    if (!CRYPTO_THREAD_run_once(&hs_offload_once, hs_offload_init)
+        || hs_offload_idx < 0)
+        return 0;
+
+    pthread_mutex_lock(&hs_pool_lock);
+    while (hs_num_workers < num_workers
+           && hs_num_workers < HS_OFFLOAD_MAX_WORKERS) {
+        w = &hs_workers[hs_num_workers];
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&thread, NULL, hs_worker_main, w) != 0)
+            break;
+        pthread_detach(thread);
+        ++hs_num_workers;
+    }
+    n = hs_num_workers;
+    pthread_mutex_unlock(&hs_pool_lock);
+
+    return n > 0 && SSL_CTX_set_ex_data(ctx, hs_offload_idx, ctx);
+}
+
+/*
+ * The application wants to know when a worker has taken the handshake of a
+ * connection as far as it can, so that it can call tx() or rx() again. As with
+ * set_conn_verify_notify(), notify(arg) is called on the worker's thread with a
+ * lock held, so it should do no more than wake up the application's own
+ * thread. Does nothing for connections whose handshake is not offloaded.
+ */
+int set_conn_handshake_notify(APP_CONN *conn, void (*notify)(void *arg),
+                              void *arg)
+{
+    HS_OFFLOAD *o = conn->offload;
+
+    if (o == NULL)
+        return 1;
+
+    pthread_mutex_lock(&o->worker->lock);
+    o->notify       = notify;
+    o->notify_arg   = arg;
+    pthread_mutex_unlock(&o->worker->lock);
+    return 1;
+}
+
+/*
+ * Flags for new_conn_ex.
+ *
+ * APP_CONN_THREADED: tx() and rx() will be called on a different thread from
+ * the functions moving data to and from the network.
+ */
+#define APP_CONN_THREADED   1
+
+/*
+ * APP_CONN_IDLE_SHRINK: hold as little memory as possible while the connection
+ * is idle. libssl frees its record buffers whenever they are empty
+ * (SSL_MODE_RELEASE_BUFFERS), and once nothing is buffered in either direction
+ * the BIO pair is taken apart and its buffers freed, to be allocated again
+ * when data next arrives from the network or tx() is called. The ring BIO pair
+ * of APP_CONN_THREADED is left alone.
+ */
+#define APP_CONN_IDLE_SHRINK 2
+
+/*
+ * APP_CONN_ASYNC: run libssl's work in async jobs (SSL_MODE_ASYNC), so that an
+ * engine or provider doing crypto asynchronously pauses the job rather than
+ * blocking the caller. While an operation is in flight, tx() and rx() return
+ * -2 and get_conn_pending_tx() and get_conn_pending_rx() ask for no network
+ * events; the application waits for the fds from get_conn_async_fds() to
+ * become readable instead, then repeats the same call to resume the job. If
+ * libcrypto has no async job to run it in (SSL_ERROR_WANT_ASYNC_JOB), there
+ * is nothing to wait for, and the call fails with -1.
+ */
+#define APP_CONN_ASYNC      4
+
+/*
+ * Frees the BIO pair's buffers if the connection is idle: the handshake is
+ * done and nothing is waiting in the pair or inside libssl.
+ */
+static void conn_shrink(APP_CONN *conn)
+{
+    BIO *internal_bio = SSL_get_rbio(conn->ssl);
+
+    if (!conn->shrink || conn->shrunk
+        || conn->early_state != EARLY_DATA_NONE
+        || !SSL_is_init_finished(conn->ssl)
+        || SSL_has_pending(conn->ssl)
+        || BIO_ctrl_pending(internal_bio) > 0
+        || BIO_ctrl_pending(conn->net_bio) > 0)
+        return;
+
+    conn->bio_size = BIO_get_write_buf_size(conn->net_bio, 0);
+    BIO_destroy_bio_pair(conn->net_bio);
+
+    /* Resizing an unpaired BIO frees its buffer until it is paired again. */
+    BIO_set_write_buf_size(internal_bio, 1);
+    BIO_set_write_buf_size(conn->net_bio, 1);
+    conn->shrunk = 1;
+
+    /*
+     * SSL_MODE_RELEASE_BUFFERS only frees the write buffer after a write, but
+     * post-handshake messages such as session tickets also allocate one.
+     */
+    SSL_free_buffers(conn->ssl);
+}
+
+/* Reassembles the BIO pair freed by conn_shrink(). */
+static int conn_unshrink(APP_CONN *conn)
+{
+    BIO *internal_bio = SSL_get_rbio(conn->ssl);
+
+    if (!conn->shrunk)
+        return 1;
+
+    if (BIO_set_write_buf_size(internal_bio, conn->bio_size) <= 0
+        || BIO_set_write_buf_size(conn->net_bio, conn->bio_size) <= 0
+        || BIO_make_bio_pair(internal_bio, conn->net_bio) <= 0)
+        return 0;
+
+    conn->shrunk = 0;
+    return 1;
+}
+
+/*
+ * The application wants to create a new outgoing connection using a given
+ * SSL_CTX.
+ *
+ * hostname is a string like "example.com" used for certificate validation,
+ * and port the server's port, like "443". Sessions are filed under
+ * hostname:port. new_conn() is new_conn_ex() without flags for a server on
+ * port 443.
+ */
+APP_CONN *new_conn_ex(SSL_CTX *ctx, const char *bare_hostname,
+                      const char *port, int flags)
+{
+    BIO *ssl_bio, *internal_bio, *net_bio;
+    APP_CONN *conn;
+    SSL *ssl;
+    SSL_SESSION *sess;
+    char key[300];
+    int rc;
+
+    conn = conn_alloc();
+    if (conn == NULL)
+        return NULL;
+
+    ssl = conn->ssl = ssl_pool_take(ctx);
+    if (ssl == NULL) {
+        conn_release(conn);
+        return NULL;
+    }
+
+    SSL_set_connect_state(ssl); /* cannot fail */
+
+    if (hs_offload_enabled(ctx)) {
+        if ((flags & APP_CONN_ASYNC) || !hs_offload_attach(conn)) {
+            SSL_free(ssl);
+            conn_release(conn);
+            return NULL;
+        }
+
+        /* The worker and the application share the network BIOs. */
+        flags |= APP_CONN_THREADED;
+    }
+
+    if (flags & APP_CONN_IDLE_SHRINK) {
+        SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+        conn->shrink = !(flags & APP_CONN_THREADED);
+    }
+
+    if (flags & APP_CONN_ASYNC)
+        SSL_set_mode(ssl, SSL_MODE_ASYNC);
+
+    if (flags & APP_CONN_THREADED)
+        rc = new_ring_bio_pair(&internal_bio, &net_bio);
+    else if (conn_take_bio_pair(conn, &internal_bio, &net_bio))
+        rc = 1;
+    else
+        rc = BIO_new_bio_pair(&internal_bio, 0, &net_bio, 0);
+
+    if (rc <= 0) {
+        SSL_free(ssl);
+        free(conn->offload);
+        conn_release(conn);
+        return NULL;
+    }
+
+    SSL_set_bio(ssl, internal_bio, internal_bio);
+
+    if (SSL_set1_host(ssl, bare_hostname) <= 0) {
+        SSL_free(ssl);
+        BIO_free(net_bio);
+        free(conn->offload);
+        conn_release(conn);
+        return NULL;
+    }
+
+    if (SSL_set_tlsext_host_name(ssl, bare_hostname) <= 0) {
+        SSL_free(ssl);
+        BIO_free(net_bio);
+        free(conn->offload);
+        conn_release(conn);
+        return NULL;
+    }
+
+    /* Offer the session we last got from this server, if any. */
+    snprintf(key, sizeof(key), "%s:%s", bare_hostname, port);
+    if (sess_cache_attach(ssl, key) == 0) {
+        SSL_free(ssl);
+        BIO_free(net_bio);
+        free(conn->offload);
+        conn_release(conn);
+        return NULL;
+    }
+
+    ssl_bio = BIO_new(BIO_f_ssl());
+    if (ssl_bio == NULL) {
+        SSL_free(ssl);
+        BIO_free(net_bio);
+        free(conn->offload);
+        conn_release(conn);
+        return NULL;
+    }
+
+    if (BIO_set_ssl(ssl_bio, ssl, BIO_CLOSE) <= 0) {
+        SSL_free(ssl);
+        BIO_free(ssl_bio);
+        BIO_free(net_bio);
+        free(conn->offload);
+        conn_release(conn);
+        return NULL;
+    }
+
+    /* A resumed session may let the first tx() go out as early data. */
+    sess = SSL_get0_session(ssl);
+    if (sess != NULL && SSL_SESSION_get_max_early_data(sess) > 0
+        && conn->offload == NULL)
+        conn->early_state = EARLY_DATA_TRY;
+
+    conn->ssl_bio   = ssl_bio;
+    conn->net_bio   = net_bio;
+    return conn;
+}
+
+APP_CONN *new_conn(SSL_CTX *ctx, const char *bare_hostname)
+{
+    return new_conn_ex(ctx, bare_hostname, "443", 0);
+}
+
+/*
+ * 0-RTT early data
+ * ----------------
+ *
+ * If new_conn() resumed a session which allows it, the first tx() sends the
+ * application's data as TLS 1.3 early data along with the ClientHello rather
+ * than waiting a round trip for the handshake to complete. A copy is kept
+ * until the handshake is done: the server may reject early data, in which
+ * case it is sent again as ordinary application data before anything else
+ * is written or read.
+ */
+static int tx_early(APP_CONN *conn, const void *buf, int buf_len)
+{
+    SSL_SESSION *sess = SSL_get0_session(conn->ssl);
+    size_t max_early = SSL_SESSION_get_max_early_data(sess), written;
+
+    if ((size_t)buf_len > max_early)
+        buf_len = max_early;
+
+    /* We must be able to replay whatever we send. */
+    if ((size_t)buf_len > conn->early_cap) {
+        void *p = realloc(conn->early_buf, buf_len);
+
+        if (p == NULL) {
+            conn->early_state = EARLY_DATA_NONE;
+            return SSL_write(conn->ssl, buf, buf_len);
+        }
+
+        conn->early_buf = p;
+        conn->early_cap = buf_len;
+    }
+
+    if (SSL_write_early_data(conn->ssl, buf, buf_len, &written) <= 0)
+        return 0;
+
+    memcpy(conn->early_buf, buf, written);
+    conn->early_len     = written;
+    conn->early_state   = EARLY_DATA_SENT;
+    return written;
+}
+
+/*
+ * Completes the handshake once early data has been sent and replays the early
+ * data if the server rejected it. Returns 1 when done, otherwise the return
+ * value of the libssl call which could not complete, for SSL_get_error.
+ */
+static int finish_early_data(APP_CONN *conn)
+{
+    int l;
+
+    if (conn->early_state == EARLY_DATA_TRY) {
+        /* The handshake is starting without us having sent anything. */
+        conn->early_state = EARLY_DATA_NONE;
+        return 1;
+    }
+
+    if (conn->early_state == EARLY_DATA_SENT) {
+        l = SSL_do_handshake(conn->ssl);
+        if (l <= 0)
+            return l;
+
+        if (SSL_get_early_data_status(conn->ssl) == SSL_EARLY_DATA_ACCEPTED) {
+            conn->early_state = EARLY_DATA_NONE;
+        } else {
+            conn->early_state   = EARLY_DATA_REPLAY;
+            conn->early_off     = 0;
+        }
+    }
+
+    while (conn->early_state == EARLY_DATA_REPLAY
+           && conn->early_off < conn->early_len) {
+        l = SSL_write(conn->ssl, conn->early_buf + conn->early_off,
+                      conn->early_len - conn->early_off);
+        if (l <= 0)
+            return l;
+
+        conn->early_off += l;
+    }
+
+    free(conn->early_buf);
+    conn->early_buf     = NULL;
+    conn->early_cap     = 0;
+    conn->early_state   = EARLY_DATA_NONE;
+    return 1;
+}
+
+/*
+ * Non-blocking transmission.
+ *
+ * Returns -1 on error. Returns -2 if the function would block (corresponds to
+ * EWOULDBLOCK).
+ */
+int tx(APP_CONN *conn, const void *buf, int buf_len)
+{
+    int rc, l;
+
+    if ((rc = hs_offload_check(conn)) <= 0)
+        return rc == 0 ? -2 : -1;
+
+    if (!conn_unshrink(conn))
+        return -1;
+
+    if (conn->early_state == EARLY_DATA_TRY)
+        l = tx_early(conn, buf, buf_len);
+    else if ((l = finish_early_data(conn)) > 0)
+        l = BIO_write(conn->ssl_bio, buf, buf_len);
+
+    if (l <= 0) {
+        rc = SSL_get_error(conn->ssl, l);
+        switch (rc) {
+            case SSL_ERROR_WANT_READ:
+                conn->tx_need_rx = 1;
+            case SSL_ERROR_WANT_CONNECT:
+            case SSL_ERROR_WANT_WRITE:
+            case SSL_ERROR_WANT_RETRY_VERIFY:
+            case SSL_ERROR_WANT_ASYNC:
+                return -2;
+            default:
+                return -1;
+        }
+    } else {
+        conn->tx_need_rx = 0;
+    }
+
+    return l;
+}
+
+/*
+ * Non-blocking reception.
+ *
+ * Returns -1 on error. Returns -2 if the function would block (corresponds to
+ * EWOULDBLOCK).
+ */
+int rx(APP_CONN *conn, void *buf, int buf_len)
+{
+    int rc, l;
+
+    /* A shrunk connection has nothing to read until data arrives. */
+    if (conn->shrunk)
+        return -2;
+
+    if ((rc = hs_offload_check(conn)) <= 0)
+        return rc == 0 ? -2 : -1;
+
+    if ((l = finish_early_data(conn)) > 0)
+        l = BIO_read(conn->ssl_bio, buf, buf_len);
+
+    if (l <= 0) {
+        rc = SSL_get_error(conn->ssl, l);
+        switch (rc) {
+            case SSL_ERROR_WANT_WRITE:
+                conn->rx_need_tx = 1;
+            case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_RETRY_VERIFY:
+            case SSL_ERROR_WANT_ASYNC:
+                conn_shrink(conn);
+                return -2;
+            default:
+                return -1;
+        }
+    } else {
+        conn->rx_need_tx = 0;
+    }
+
+    conn_shrink(conn);
+    return l;
+}
+
+/*
+ * Called to get data which has been enqueued for transmission to the network
+ * by OpenSSL.
+ */
+int read_net_tx(APP_CONN *conn, void *buf, int buf_len)
+{
+    int l;
+
+    if (conn->shrunk)
+        return -1;
+
+    l = BIO_read(conn->net_bio, buf, buf_len);
+    conn_shrink(conn);
+    return l;
+}
+
+/*
+ * Called to feed data which has been received from the network to OpenSSL.
+ */
+int write_net_rx(APP_CONN *conn, const void *buf, int buf_len)
+{
+    if (!conn_unshrink(conn))
+        return -1;
+
+    return BIO_write(conn->net_bio, buf, buf_len);
+}
+
+/*
+ * Determine how much data can be written to the network RX BIO.
+ */
+size_t net_rx_space(APP_CONN *conn)
+{
+    if (conn->shrunk)
+        return conn->bio_size;
+
+    return BIO_ctrl_get_write_guarantee(conn->net_bio);
+}
+
+/*
+ * Determine how much data is currently queued for transmission in the network
+ * TX BIO.
+ */
+size_t net_tx_avail(APP_CONN *conn)
+{
+    if (conn->shrunk)
+        return 0;
+
+    return BIO_ctrl_pending(conn->net_bio);
+}
+
+/*
+ * Zero-copy alternatives to write_net_rx and read_net_tx, which let the
+ * application read from the network straight into the network BIO's buffer
+ * and write to the network straight out of it.
+ *
+ * net_rx_reserve sets *buf to the next contiguous free region of the network
+ * RX buffer and returns its size, which may be less than net_rx_space if the
+ * free space wraps around. Once data has been placed there, net_rx_commit is
+ * called with the number of bytes actually written.
+ *
+ * net_tx_peek sets *buf to the next contiguous region of data queued for
+ * transmission and returns its size. Once some of it has been sent,
+ * net_tx_consume is called with the number of bytes sent.
+ *
+ * All four return a negative value or zero if there is no space or data.
+ */
+int net_rx_reserve(APP_CONN *conn, char **buf)
+{
+    if (!conn_unshrink(conn))
+        return -1;
+
+    return BIO_nwrite0(conn->net_bio, buf);
+}
+
+int net_rx_commit(APP_CONN *conn, int len)
+{
+    char *buf;
+
+    return BIO_nwrite(conn->net_bio, &buf, len);
+}
+
+int net_tx_peek(APP_CONN *conn, char **buf)
+{
+    if (conn->shrunk)
+        return 0;
+
+    return BIO_nread0(conn->net_bio, buf);
+}
+
+int net_tx_consume(APP_CONN *conn, int len)
+{
+    char *buf;
+
+    return BIO_nread(conn->net_bio, &buf, len);
+}
+
+/*
+ * The application wants to know what became of the data it passed to the
+ * first tx(). Returns SSL_EARLY_DATA_NOT_SENT if it was not sent as 0-RTT early
+ * data, SSL_EARLY_DATA_ACCEPTED if the server accepted it as such, or
+ * SSL_EARLY_DATA_REJECTED if the server rejected it and tx() or rx() resent it
+ * after the handshake. Only meaningful once the handshake is complete.
+ */
+int get_conn_early_data_status(APP_CONN *conn)
+{
+    return SSL_get_early_data_status(conn->ssl);
+}
+
+/*
+ * These functions returns zero or more of:
+ * 
+ *   POLLIN:    The SSL state machine is interested in socket readability events.
+ *
+ *   POLLOUT:   The SSL state machine is interested in socket writeability events.
+ *
+ *   POLLERR:   The SSL state machine is interested in socket error events.
+ *
+ * get_conn_pending_tx returns events which may cause SSL_write to make
+ * progress and get_conn_pending_rx returns events which may cause SSL_read
+ * to make progress.
+ */
+int get_conn_pending_tx(APP_CONN *conn)
+{
+    int events;
+
+    if ((events = hs_offload_pending(conn)) >= 0)
+        return events;
+
+    /*
+     * Nothing on the network can help until the verification or the
+     * asynchronous operation is done.
+     */
+    if (SSL_want_retry_verify(conn->ssl) || SSL_waiting_for_async(conn->ssl))
+        return 0;
+
+    return (conn->tx_need_rx ? POLLIN : 0) | POLLOUT | POLLERR;
+}
+
+int get_conn_pending_rx(APP_CONN *conn)
+{
+    int events;
+
+    if ((events = hs_offload_pending(conn)) >= 0)
+        return events;
+
+    if (SSL_want_retry_verify(conn->ssl) || SSL_waiting_for_async(conn->ssl))
+        return 0;
+
+    return (conn->rx_need_tx ? POLLOUT : 0) | POLLIN | POLLERR;
+}
+
+/*
+ * The application wants to know which fds to wait on, in addition to the
+ * network, while an operation of an APP_CONN_ASYNC connection is in flight.
+ * Returns the fds added since the last call in add and those removed in del,
+ * either of which may be NULL to just get the counts in *num_add and
+ * *num_del. The application waits for readability on the fds it was given
+ * and has not had taken away again. Returns 0 on error.
+ */
+int get_conn_async_fds(APP_CONN *conn, int *add, size_t *num_add,
+                       int *del, size_t *num_del)
+{
+    return SSL_get_changed_async_fds(conn->ssl, add, num_add, del, num_del);
+}
+
+/*
+ * The application wants to close the connection and free bookkeeping
+ * structures.
+ */
+void teardown(APP_CONN *conn)
+{
+    HS_OFFLOAD *o = conn->offload;
+
+    /* A handshake still on its worker is left for the worker to free. */
+    if (o != NULL) {
+        pthread_mutex_lock(&o->worker->lock);
+        if (o->state == HS_OFFLOAD_BUSY) {
+            o->orphaned = 1;
+            conn = NULL;
+        }
+        pthread_mutex_unlock(&o->worker->lock);
+    }
+
+    if (conn != NULL)
+        conn_free(conn, 1);
+}
+
+/*
+ * The application is shutting down and wants to free a previously
+ * created SSL_CTX.
+ */
+void teardown_ctx(SSL_CTX *ctx)
+{
+    ssl_pool_drain(ctx);
+    SSL_CTX_free(ctx);
+}
+
+/*
+ * ============================================================================
+ * Example driver for the above code. This is just to demonstrate that the code
+ * works and is not intended to be representative of a real application.
+ */
+#define DRV_REACTOR
+#define DRV_EARLY_DATA
+#define DRV_ASYNC
+#define DRV_CONNECT
+#define DRV_OFFLOAD
+#define DRV_URING
+#define DRV_SSL_POOL
+#define DRV_CONN_CACHE
+#define DRV_CONN_CACHE_BIO_PAIR
+#include "ddd-driver.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * The application owns the socket and moves bytes between it and the
+ * connection's network BIO itself. Encrypted data read from the BIO but not
+ * yet accepted by the socket is held in txq.
+ */
+typedef struct drv_io_st {
+    int fd, eof, err, zero_copy;
+    int txq_off, txq_len, txq_size;
+    char *txq;
+
+    /* Only used when driven from io_uring. */
+    struct uring_st *u;
+    int inflight, connected, recv_armed, send_armed, dirty;
+    int rxq_head, rxq_tail, rxq_off;
+
+    char txq_buf[2048];
+} DRV_IO;
+
+static void uring_release(DRV_CONN *dc);
+
+static APP_CONN *drv_conn_new(SSL_CTX *ctx, const DRV_TARGET *t, DRV_CONN *dc)
+{
+    APP_CONN *conn;
+    DRV_IO *io;
+
+    io = calloc(1, sizeof(DRV_IO));
+    if (io == NULL)
+        return NULL;
+
+    io->txq         = io->txq_buf;
+    io->txq_size    = sizeof(io->txq_buf);
+    io->zero_copy   = t->opts->zero_copy;
+
+    io->fd = drv_connect(t);
+    if (io->fd < 0) {
+        free(io);
+        return NULL;
+    }
+
+    conn = new_conn_ex(ctx, t->hostname, t->port,
+                       (t->opts->idle_shrink ? APP_CONN_IDLE_SHRINK : 0)
+                       | (t->opts->async ? APP_CONN_ASYNC : 0));
+    if (conn == NULL) {
+        close(io->fd);
+        free(io);
+        return NULL;
+    }
+
+    dc->io = io;
+    return conn;
+}
+
+static int drv_conn_fd(DRV_CONN *dc)
+{
+    DRV_IO *io = dc->io;
+
+    return io->fd;
+}
+
+/*
+ * Zero-copy pump (-z): data moves directly between the socket and the BIO
+ * pair's buffers, so txq is not needed either; unsent data simply stays in the
+ * BIO until the socket takes it.
+ */
+static int drv_conn_pump_zc(DRV_CONN *dc)
+{
+    DRV_IO *io = dc->io;
+    char *p;
+    int n, l, moved = 0;
+
+    while (!io->eof && (n = net_rx_reserve(dc->conn, &p)) > 0) {
+        l = read(io->fd, p, n);
+        if (l == 0) {
+            io->eof = 1;
+        } else if (l < 0) {
+            if (errno == EAGAIN)
+                break;
+            return -1;
+        } else {
+            net_rx_commit(dc->conn, l);
+            moved = 1;
+        }
+    }
+
+    while ((n = net_tx_peek(dc->conn, &p)) > 0) {
+        l = write(io->fd, p, n);
+        if (l < 0) {
+            if (errno == EAGAIN)
+                break;
+            return -1;
+        }
+
+        net_tx_consume(dc->conn, l);
+        moved = 1;
+    }
+
+    return moved ? 1 : (io->eof ? -1 : 0);
+}
+
+static int drv_conn_pump(DRV_CONN *dc)
+{
+    DRV_IO *io = dc->io;
+    char buf[2048];
+    size_t space;
+    int l, moved = 0;
+
+    if (io->zero_copy)
+        return drv_conn_pump_zc(dc);
+
+    /* Network to OpenSSL; space is checked first so writes cannot be short. */
+    while (!io->eof && (space = net_rx_space(dc->conn)) > 0) {
+        l = read(io->fd, buf, space > sizeof(buf) ? sizeof(buf) : space);
+        if (l == 0) {
+            io->eof = 1;
+        } else if (l < 0) {
+            if (errno == EAGAIN)
+                break;
+            return -1;
+        } else {
+            write_net_rx(dc->conn, buf, l);
+            moved = 1;
+        }
+    }
+
+    /* OpenSSL to network. */
+    for (;;) {
+        if (io->txq_off == io->txq_len) {
+            l = read_net_tx(dc->conn, io->txq, io->txq_size);
+            if (l <= 0)
+                break;
+            io->txq_off = 0;
+            io->txq_len = l;
+        }
+
+        l = write(io->fd, io->txq + io->txq_off, io->txq_len - io->txq_off);
+        if (l < 0) {
+            if (errno == EAGAIN)
+                break;
+            return -1;
+        }
+
+        io->txq_off += l;
+        moved = 1;
+    }
+
+    return moved ? 1 : (io->eof ? -1 : 0);
+}
+
+static int drv_conn_events(DRV_CONN *dc, int pending)
+{
+    DRV_IO *io = dc->io;
+    int events = pending & (POLLIN | POLLERR);
+
+    if (net_rx_space(dc->conn) == 0)
+        events &= ~POLLIN;
+    if (io->txq_off < io->txq_len || net_tx_avail(dc->conn) > 0)
+        events |= POLLOUT;
+
+    return events;
+}
+
+static void drv_conn_free(DRV_CONN *dc)
+{
+    DRV_IO *io = dc->io;
+
+    teardown(dc->conn);
+    if (io->u != NULL) {
+        uring_release(dc);
+        return;
+    }
+
+    close(io->fd);
+    free(io);
+}
+
+/*
+ * io_uring event loop
+ * -------------------
+ *
+ * Because libssl does no I/O of its own in this model, the application is free
+ * to move the encrypted bytes however it likes. With -U, each event loop uses
+ * io_uring instead of epoll: every connection has a multishot recv
+ * outstanding which fills buffers from a ring registered with the kernel, and
+ * received data is fed to write_net_rx() straight from those buffers.
+ * Whatever read_net_tx() yields is sent from a registered per-connection
+ * buffer. All sends and receives queued during an iteration are submitted
+ * together with the wait for completions in a single io_uring_enter().
+ *
+ * liburing is not assumed to be available, so the rings are set up by hand.
+ */
+#define URING_BUF_SIZE  4096
+#define URING_TXQ_SIZE  4096
+
+enum {
+    URING_OP_CONNECT, URING_OP_RECV, URING_OP_SEND
+};
+
+typedef struct uring_st {
+    int fd;
+
+    /* Submission and completion queues. */
+    unsigned sq_entries, sq_mask, sq_tail, to_submit;
+    unsigned *sq_khead, *sq_ktail, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned cq_mask, *cq_khead, *cq_ktail;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+
+    /* Receive buffers provided to the kernel; bid indexes all three arrays. */
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    unsigned num_bufs;
+    unsigned short br_tail;
+    char *bufs;
+    int *buf_next, *buf_len;
+
+    /* Registered send buffers, URING_TXQ_SIZE bytes per connection. */
+    char *txqs;
+
+    /* Connections with completions not yet acted upon. */
+    DRV_CONN **dirty;
+    size_t num_dirty, num_zombies;
+} URING;
+
+static int uring_enter(URING *u, unsigned min_complete, int timeout)
+{
+    struct io_uring_getevents_arg arg = {0};
+    struct __kernel_timespec ts = {0};
+    unsigned flags = 0;
+    int rc;
+
+    __atomic_store_n(u->sq_ktail, u->sq_tail, __ATOMIC_RELEASE);
+
+    if (min_complete > 0) {
+        ts.tv_sec   = timeout / 1000;
+        ts.tv_nsec  = (timeout % 1000) * 1000000L;
+        arg.ts      = (uintptr_t)&ts;
+        flags       = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+
+    rc = syscall(__NR_io_uring_enter, u->fd, u->to_submit, min_complete, flags,
+                 min_complete > 0 ? &arg : NULL,
+                 min_complete > 0 ? sizeof(arg) : 0);
+    if (rc > 0)
+        u->to_submit -= rc;
+
+    return rc;
+}
+
+static struct io_uring_sqe *uring_get_sqe(URING *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    /* If the submission queue is full, hand what we have to the kernel now. */
+    if (u->sq_tail - __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE)
+        == u->sq_entries)
+        uring_enter(u, 0, 0);
+
+    idx = u->sq_tail & u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    ++u->sq_tail;
+    ++u->to_submit;
+    return sqe;
+}
+
+/*
+ * Hands a receive buffer (back) to the kernel.
+ */
+static void uring_recycle(URING *u, int bid)
+{
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->num_bufs - 1)];
+
+    b->addr = (uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len  = URING_BUF_SIZE;
+    b->bid  = bid;
+    __atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_cleanup(URING *u)
+{
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_len);
+    if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED
+        && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_len);
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_len);
+    if (u->br != NULL && u->br != MAP_FAILED)
+        munmap(u->br, u->br_len);
+    free(u->bufs);
+    free(u->buf_next);
+    free(u->buf_len);
+    free(u->txqs);
+    free(u->dirty);
+}
+
+static int uring_init(URING *u, size_t num_conns)
+{
+    struct io_uring_params p = {0};
+    struct io_uring_buf_reg reg = {0};
+    struct iovec iov;
+    unsigned entries = 64, i;
+    char *sq, *cq;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    while (entries < num_conns && entries < 4096)
+        entries <<= 1;
+
+    p.flags         = IORING_SETUP_CQSIZE;
+    p.cq_entries    = entries * 4;
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        goto err;
+
+    if ((p.features & IORING_FEAT_EXT_ARG) == 0) {
+        errno = ENOSYS;
+        goto err;
+    }
+
+    u->sq_ring_len  = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_len  = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len     = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_len > u->sq_ring_len)
+            u->sq_ring_len = u->cq_ring_len;
+        u->cq_ring_len = u->sq_ring_len;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto err;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_ring = u->sq_ring;
+    else
+        u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED)
+        goto err;
+
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto err;
+
+    sq = u->sq_ring;
+    cq = u->cq_ring;
+    u->sq_entries   = p.sq_entries;
+    u->sq_mask      = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_khead     = (unsigned *)(sq + p.sq_off.head);
+    u->sq_ktail     = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_array     = (unsigned *)(sq + p.sq_off.array);
+    u->sq_tail      = *u->sq_ktail;
+    u->cq_mask      = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cq_khead     = (unsigned *)(cq + p.cq_off.head);
+    u->cq_ktail     = (unsigned *)(cq + p.cq_off.tail);
+    u->cqes         = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* Provide a few receive buffers per connection. */
+    u->num_bufs = 64;
+    while (u->num_bufs < 2 * num_conns && u->num_bufs < 16384)
+        u->num_bufs <<= 1;
+
+    u->br_len = u->num_bufs * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED)
+        goto err;
+
+    reg.ring_addr       = (uintptr_t)u->br;
+    reg.ring_entries    = u->num_bufs;
+    reg.bgid            = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+        goto err;
+
+    u->bufs     = malloc((size_t)u->num_bufs * URING_BUF_SIZE);
+    u->buf_next = calloc(u->num_bufs, sizeof(int));
+    u->buf_len  = calloc(u->num_bufs, sizeof(int));
+    u->txqs     = malloc((num_conns > 0 ? num_conns : 1) * URING_TXQ_SIZE);
+    u->dirty    = calloc(num_conns > 0 ? num_conns : 1, sizeof(DRV_CONN *));
+    if (u->bufs == NULL || u->buf_next == NULL || u->buf_len == NULL
+        || u->txqs == NULL || u->dirty == NULL)
+        goto err;
+
+    for (i = 0; i < u->num_bufs; ++i)
+        uring_recycle(u, i);
+
+    iov.iov_base    = u->txqs;
+    iov.iov_len     = (num_conns > 0 ? num_conns : 1) * URING_TXQ_SIZE;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+                &iov, 1) < 0)
+        goto err;
+
+    return 1;
+
+err:
+    fprintf(stderr, "cannot set up io_uring: %d\n", errno);
+    uring_cleanup(u);
+    return 0;
+}
+
+static void uring_mark_dirty(URING *u, DRV_CONN *dc)
+{
+    DRV_IO *io = dc->io;
+
+    if (!io->dirty) {
+        io->dirty = 1;
+        u->dirty[u->num_dirty++] = dc;
+    }
+}
+
+/*
+ * Feeds received data queued on a connection to OpenSSL, as far as the BIO
+ * pair has space for it. Returns 1 if anything was fed.
+ */
+static int uring_feed(URING *u, DRV_CONN *dc)
+{
+    DRV_IO *io = dc->io;
+    size_t space;
+    int bid, l, fed = 0;
+
+    while ((bid = io->rxq_head) >= 0
+           && (space = net_rx_space(dc->conn)) > 0) {
+        l = u->buf_len[bid] - io->rxq_off;
+        if ((size_t)l > space)
+            l = space;
+
+        write_net_rx(dc->conn,
+                     u->bufs + (size_t)bid * URING_BUF_SIZE + io->rxq_off, l);
+        io->rxq_off += l;
+        fed = 1;
+
+        if (io->rxq_off == u->buf_len[bid]) {
+            io->rxq_head = u->buf_next[bid];
+            if (io->rxq_head < 0)
+                io->rxq_tail = -1;
+            io->rxq_off = 0;
+            uring_recycle(u, bid);
+        }
+    }
+
+    return fed;
+}
+
+/*
+ * Frees what is left of a finished connection once the kernel no longer
+ * refers to it.
+ */
+static void uring_reap(URING *u, DRV_CONN *dc)
+{
+    DRV_IO *io = dc->io;
+
+    close(io->fd);
+    free(io);
+    dc->io = NULL;
+}
+
+/*
+ * Called via drv_conn_free when a connection is finished. Operations still in
+ * flight are cancelled and the connection lingers until they complete.
+ */
+static void uring_release(DRV_CONN *dc)
+{
+    DRV_IO *io = dc->io;
+    URING *u = io->u;
+    struct io_uring_sqe *sqe;
+    int bid;
+
+    while ((bid = io->rxq_head) >= 0) {
+        io->rxq_head = u->buf_next[bid];
+        uring_recycle(u, bid);
+    }
+
+    if (io->inflight == 0) {
+        uring_reap(u, dc);
+        return;
+    }
+
+    sqe = uring_get_sqe(u);
+    sqe->opcode         = IORING_OP_ASYNC_CANCEL;
+    sqe->fd             = io->fd;
+    sqe->cancel_flags   = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data      = 0;
+    ++u->num_zombies;
+}
+
+static void uring_complete(URING *u, const struct io_uring_cqe *cqe)
+{
+    DRV_CONN *dc = (DRV_CONN *)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+    DRV_IO *io;
+    int bid;
+
+    if (dc == NULL)
+        return; /* cancellation request */
+
+    io = dc->io;
+    switch (cqe->user_data & 3) {
+        case URING_OP_CONNECT:
+            --io->inflight;
+            if (cqe->res < 0)
+                io->err = 1;
+            else
+                io->connected = 1;
+            break;
+
+        case URING_OP_RECV:
+            if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+                --io->inflight;
+                io->recv_armed = 0;
+            }
+
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe->res <= 0 || dc->state == DRV_DONE) {
+                    uring_recycle(u, bid);
+                } else {
+                    u->buf_len[bid]     = cqe->res;
+                    u->buf_next[bid]    = -1;
+                    if (io->rxq_tail >= 0)
+                        u->buf_next[io->rxq_tail] = bid;
+                    else
+                        io->rxq_head = bid;
+                    io->rxq_tail = bid;
+                }
+            } else if (cqe->res == 0) {
+                io->eof = 1;
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                /* Out of buffers just means we must re-arm later. */
+                io->err = 1;
+            }
+            break;
 
-    /* Load default root CA store. */
-    if (SSL_CTX_set_default_verify_paths(ctx) == 0) {
-        SSL_CTX_free(ctx);
-        return NULL;
+        case URING_OP_SEND:
+            --io->inflight;
+            io->send_armed = 0;
+            if (cqe->res < 0)
+                io->err = 1;
+            else
+                io->txq_off += cqe->res;
+            break;
     }
 
-    return ctx;
+    if (dc->state == DRV_DONE) {
+        if (io->inflight == 0) {
+            uring_reap(u, dc);
+            --u->num_zombies;
+        }
+        return;
+    }
+
+    uring_mark_dirty(u, dc);
 }
 
 /*
- * The application wants to create a new outgoing connection using a given
- * SSL_CTX.
- *
- * hostname is a string like "example.com" used for certificate validation.
+ * Lets a connection with new completions make as much progress as it can and
+ * queues whatever I/O it needs next.
  */
-APP_CONN *new_conn(SSL_CTX *ctx, const char *bare_hostname)
+static void uring_service(DRV_LOOP *lp, URING *u, DRV_CONN *dc)
 {
-    BIO *ssl_bio, *internal_bio, *net_bio;
-    APP_CONN *conn;
-    SSL *ssl;
+    DRV_IO *io = dc->io;
+    struct io_uring_sqe *sqe;
+    int l, fed;
 
-    conn = calloc(1, sizeof(APP_CONN));
-    if (conn == NULL)
-        return NULL;
-
-    ssl = conn->ssl = SSL_new(ctx);
-    if (ssl == NULL) {
-        free(conn);
-        return NULL;
+    if (io->err) {
+        drv_finish(lp, dc, 0);
+        return;
     }
 
-    SSL_set_connect_state(ssl); /* cannot fail */
+    if (!io->connected)
+        return;
 
-    if (BIO_new_bio_pair(&internal_bio, 0, &net_bio, 0) <= 0) {
-        SSL_free(ssl);
-        free(conn);
-        return NULL;
+    do {
+        fed = uring_feed(u, dc);
+        drv_advance(lp, dc);
+        if (dc->state == DRV_DONE)
+            return;
+    } while (fed);
+
+    if (io->eof && io->rxq_head < 0) {
+        drv_finish(lp, dc, dc->state == DRV_RX && dc->rx_total > 0);
+        return;
     }
 
-    SSL_set_bio(ssl, internal_bio, internal_bio);
+    if (!io->send_armed) {
+        if (io->txq_off == io->txq_len) {
+            l = read_net_tx(dc->conn, io->txq, io->txq_size);
+            if (l > 0) {
+                io->txq_off = 0;
+                io->txq_len = l;
+            }
+        }
 
-    if (SSL_set1_host(ssl, bare_hostname) <= 0) {
-        SSL_free(ssl);
-        free(conn);
-        return NULL;
+        if (io->txq_off < io->txq_len) {
+            sqe = uring_get_sqe(u);
+            sqe->opcode     = IORING_OP_WRITE_FIXED;
+            sqe->fd         = io->fd;
+            sqe->addr       = (uintptr_t)(io->txq + io->txq_off);
+            sqe->len        = io->txq_len - io->txq_off;
+            sqe->buf_index  = 0;
+            sqe->user_data  = (uintptr_t)dc | URING_OP_SEND;
+            io->send_armed  = 1;
+            ++io->inflight;
+        }
     }
 
-    if (SSL_set_tlsext_host_name(ssl, bare_hostname) <= 0) {
-        SSL_free(ssl);
-        free(conn);
-        return NULL;
+    /* Only re-arm once everything received so far has been consumed. */
+    if (!io->recv_armed && !io->eof && io->rxq_head < 0) {
+        sqe = uring_get_sqe(u);
+        sqe->opcode     = IORING_OP_RECV;
+        sqe->fd         = io->fd;
+        sqe->ioprio     = IORING_RECV_MULTISHOT;
+        sqe->flags      = IOSQE_BUFFER_SELECT;
+        sqe->buf_group  = 0;
+        sqe->user_data  = (uintptr_t)dc | URING_OP_RECV;
+        io->recv_armed  = 1;
+        ++io->inflight;
     }
+}
 
-    ssl_bio = BIO_new(BIO_f_ssl());
-    if (ssl_bio == NULL) {
-        SSL_free(ssl);
-        free(conn);
+static APP_CONN *uring_conn_new(DRV_LOOP *lp, URING *u, DRV_CONN *dc, size_t i)
+{
+    const DRV_TARGET *t = lp->t;
+    struct io_uring_sqe *sqe;
+    APP_CONN *conn;
+    DRV_IO *io;
+
+    io = calloc(1, sizeof(DRV_IO));
+    if (io == NULL)
+        return NULL;
+
+    io->u           = u;
+    io->txq         = u->txqs + i * URING_TXQ_SIZE;
+    io->txq_size    = URING_TXQ_SIZE;
+    io->rxq_head    = -1;
+    io->rxq_tail    = -1;
+
+    /* io_uring waits for readiness itself, so the socket stays blocking. */
+    io->fd = socket(t->ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (io->fd < 0) {
+        free(io);
         return NULL;
     }
 
-    if (BIO_set_ssl(ssl_bio, ssl, BIO_CLOSE) <= 0) {
-        SSL_free(ssl);
-        BIO_free(ssl_bio);
+    /* No APP_CONN_ASYNC: drv_getopt() rejects -a with -U. */
+    conn = new_conn_ex(lp->ctx, t->hostname, t->port,
+                       t->opts->idle_shrink ? APP_CONN_IDLE_SHRINK : 0);
+    if (conn == NULL) {
+        close(io->fd);
+        free(io);
         return NULL;
     }
 
-    conn->ssl_bio   = ssl_bio;
-    conn->net_bio   = net_bio;
+    sqe = uring_get_sqe(u);
+    sqe->opcode     = IORING_OP_CONNECT;
+    sqe->fd         = io->fd;
+    sqe->addr       = (uintptr_t)t->ai->ai_addr;
+    sqe->off        = t->ai->ai_addrlen;
+    sqe->user_data  = (uintptr_t)dc | URING_OP_CONNECT;
+    ++io->inflight;
+
+    dc->io = io;
     return conn;
 }
 
-/*
- * Non-blocking transmission.
- *
- * Returns -1 on error. Returns -2 if the function would block (corresponds to
- * EWOULDBLOCK).
- */
-int tx(APP_CONN *conn, const void *buf, int buf_len)
+static int uring_run(DRV_LOOP *lp, URING *u)
 {
-    int rc, l;
+    unsigned head, tail;
+    size_t i, n;
+    int rc;
 
-    l = BIO_write(conn->ssl_bio, buf, buf_len);
-    if (l <= 0) {
-        rc = SSL_get_error(conn->ssl, l);
-        switch (rc) {
-            case SSL_ERROR_WANT_READ:
-                conn->tx_need_rx = 1;
-            case SSL_ERROR_WANT_CONNECT:
-            case SSL_ERROR_WANT_WRITE:
-                return -2;
-            default:
-                return -1;
+    while (lp->num_active > 0 || u->num_zombies > 0) {
+        for (i = 0; i < u->num_dirty; ++i) {
+            DRV_CONN *dc = u->dirty[i];
+
+            ((DRV_IO *)dc->io)->dirty = 0;
+            uring_service(lp, u, dc);
         }
-    } else {
-        conn->tx_need_rx = 0;
+        u->num_dirty = 0;
+
+        if (lp->num_active == 0 && u->num_zombies == 0)
+            break;
+
+        rc = uring_enter(u, 1, lp->timeout);
+        if (rc < 0 && errno != ETIME && errno != EINTR)
+            return 0;
+        ++lp->wakeups;
+
+        head = *u->cq_khead;
+        tail = __atomic_load_n(u->cq_ktail, __ATOMIC_ACQUIRE);
+        for (n = 0; head != tail; ++head, ++n)
+            uring_complete(u, &u->cqes[head & u->cq_mask]);
+        __atomic_store_n(u->cq_khead, head, __ATOMIC_RELEASE);
+
+        if (n == 0 && rc < 0 && errno == ETIME)
+            return 0;
     }
 
-    return l;
+    return 1;
 }
 
-/*
- * Non-blocking reception.
- *
- * Returns -1 on error. Returns -2 if the function would block (corresponds to
- * EWOULDBLOCK).
- */
-int rx(APP_CONN *conn, void *buf, int buf_len)
+static void *drv_uring_loop_main(void *arg)
 {
-    int rc, l;
+    DRV_LOOP *lp = arg;
+    URING u;
+    DRV_CONN *dc;
+    size_t i;
+    int rc;
 
-    l = BIO_read(conn->ssl_bio, buf, buf_len);
-    if (l <= 0) {
-        rc = SSL_get_error(conn->ssl, l);
-        switch (rc) {
-            case SSL_ERROR_WANT_WRITE:
-                conn->rx_need_tx = 1;
-            case SSL_ERROR_WANT_READ:
-                return -2;
-            default:
-                return -1;
+    lp->res     = 0;
+    lp->epfd    = -1;
+
+    if (lp->cpu >= 0)
+        drv_pin_cpu(lp->cpu);
+
+    if (lp->shard) {
+        lp->ctx = drv_create_ctx(lp->t->opts);
+        if (lp->ctx == NULL) {
+            fprintf(stderr, "cannot create SSL context\n");
+            return NULL;
         }
-    } else {
-        conn->rx_need_tx = 0;
     }
 
-    return l;
-}
+    if (uring_init(&u, lp->num_conns) == 0)
+        goto out_ctx;
 
-/*
- * Called to get data which has been enqueued for transmission to the network
- * by OpenSSL.
- */
-int read_net_tx(APP_CONN *conn, void *buf, int buf_len)
-{
-    return BIO_read(conn->net_bio, buf, buf_len);
-}
+    lp->conns = calloc(lp->num_conns, sizeof(DRV_CONN));
+    if (lp->conns == NULL)
+        goto out;
 
-/*
- * Called to feed data which has been received from the network to OpenSSL.
- */
-int write_net_rx(APP_CONN *conn, const void *buf, int buf_len)
-{
-    return BIO_write(conn->net_bio, buf, buf_len);
+    for (i = 0; i < lp->num_conns; ++i) {
+        dc = &lp->conns[i];
+        dc->state   = DRV_DONE;
+        dc->fd      = -1;
+
+        dc->conn = uring_conn_new(lp, &u, dc, i);
+        if (dc->conn == NULL) {
+            fprintf(stderr, "cannot establish connection\n");
+            goto out;
+        }
+
+        dc->state = DRV_TX;
+        ++lp->num_active;
+    }
+
+    rc = uring_run(lp, &u);
+    if (rc == 0)
+        fprintf(stderr, "timeout with %zu connections outstanding\n",
+                lp->num_active);
+
+    lp->res = (rc == 1 && lp->num_failed == 0);
+out:
+    if (lp->conns != NULL) {
+        for (i = 0; i < lp->num_conns; ++i)
+            if (lp->conns[i].state != DRV_DONE)
+                drv_finish(lp, &lp->conns[i], 0);
+    }
+
+    /* Closing the ring cancels anything still in flight. */
+    uring_cleanup(&u);
+
+    if (lp->conns != NULL) {
+        for (i = 0; i < lp->num_conns; ++i)
+            if (lp->conns[i].io != NULL)
+                uring_reap(&u, &lp->conns[i]);
+        free(lp->conns);
+        lp->conns = NULL;
+    }
+out_ctx:
+    if (lp->shard) {
+        drv_ctx_stats(lp->ctx, &lp->stats);
+        teardown_ctx(lp->ctx);
+    }
+    return NULL;
 }
 
 /*
- * Determine how much data can be written to the network RX BIO.
+ * Split driver (-T)
+ * -----------------
+ *
+ * Runs the single connection with its network I/O on a thread of its own,
+ * pipelining socket I/O with record processing. The network thread only calls
+ * the functions moving data to and from the network and the main thread only
+ * calls tx() and rx(). The two share the connection without a lock through the
+ * ring BIO pair requested with APP_CONN_THREADED.
+ *
+ * A thread about to sleep announces it in its sleeping flag and tries once
+ * more before waiting on its eventfd, so the other thread only needs to make
+ * a syscall to wake it when it is actually asleep.
  */
-size_t net_rx_space(APP_CONN *conn)
+#include <sys/eventfd.h>
+
+typedef struct split_st {
+    APP_CONN *conn;
+    int fd, net_efd, tls_efd, timeout, zero_copy;
+    atomic_int net_sleeping, tls_sleeping;
+    atomic_int eof, err, done;
+} SPLIT;
+
+static void split_wake(atomic_int *sleeping, int efd)
 {
-    return BIO_ctrl_get_write_guarantee(conn->net_bio);
+    uint64_t one = 1;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(sleeping, 0))
+        write(efd, &one, sizeof(one));
 }
 
-/*
- * Determine how much data is currently queued for transmission in the network
- * TX BIO.
- */
-size_t net_tx_avail(APP_CONN *conn)
+static void split_announce(atomic_int *sleeping)
 {
-    return BIO_ctrl_pending(conn->net_bio);
+    atomic_store(sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
 }
 
-/*
- * These functions returns zero or more of:
- * 
- *   POLLIN:    The SSL state machine is interested in socket readability events.
- *
- *   POLLOUT:   The SSL state machine is interested in socket writeability events.
- *
- *   POLLERR:   The SSL state machine is interested in socket error events.
- *
- * get_conn_pending_tx returns events which may cause SSL_write to make
- * progress and get_conn_pending_rx returns events which may cause SSL_read
- * to make progress.
- */
-int get_conn_pending_tx(APP_CONN *conn)
+static int split_sleep(int fd, int events, int efd, int timeout)
 {
-    return (conn->tx_need_rx ? POLLIN : 0) | POLLOUT | POLLERR;
+    struct pollfd pfd[2] = {0};
+    uint64_t v;
+    int n = 0;
+
+    if (events != 0) {
+        pfd[n].fd       = fd;
+        pfd[n++].events = events;
+    }
+    pfd[n].fd       = efd;
+    pfd[n++].events = POLLIN;
+
+    if (poll(pfd, n, timeout) <= 0)
+        return 0;
+
+    if (pfd[n - 1].revents & POLLIN)
+        read(efd, &v, sizeof(v));
+    return 1;
 }
 
-int get_conn_pending_rx(APP_CONN *conn)
+static void *split_net_main(void *arg)
 {
-    return (conn->rx_need_tx ? POLLOUT : 0) | POLLIN | POLLERR;
+    SPLIT *sp = arg;
+    DRV_IO io = {0};
+    DRV_CONN dc = {0};
+    int rc, events, announced = 0;
+
+    io.fd           = sp->fd;
+    io.txq          = io.txq_buf;
+    io.txq_size     = sizeof(io.txq_buf);
+    io.zero_copy    = sp->zero_copy;
+    dc.conn         = sp->conn;
+    dc.io           = &io;
+
+    while (!atomic_load(&sp->done)) {
+        rc = drv_conn_pump(&dc);
+        if (rc > 0) {
+            split_wake(&sp->tls_sleeping, sp->tls_efd);
+            continue;
+        }
+
+        if (io.eof && !atomic_load(&sp->eof)) {
+            atomic_store(&sp->eof, 1);
+            split_wake(&sp->tls_sleeping, sp->tls_efd);
+        } else if (rc < 0 && !io.eof) {
+            atomic_store(&sp->err, 1);
+            split_wake(&sp->tls_sleeping, sp->tls_efd);
+            break;
+        }
+
+        if (!announced) {
+            split_announce(&sp->net_sleeping);
+            announced = 1;
+            continue;
+        }
+
+        events = io.eof ? 0 : drv_conn_events(&dc, POLLIN | POLLERR);
+        if (io.txq_off < io.txq_len)
+            events |= POLLOUT;
+        if (!split_sleep(sp->fd, events, sp->net_efd, sp->timeout)) {
+            atomic_store(&sp->err, 1);
+            split_wake(&sp->tls_sleeping, sp->tls_efd);
+            break;
+        }
+
+        atomic_store(&sp->net_sleeping, 0);
+        announced = 0;
+    }
+
+    return NULL;
 }
 
 /*
- * The application wants to close the connection and free bookkeeping
- * structures.
+ * Waits for the network thread after tx() or rx() returned -2. Returns 0 on
+ * timeout or error, and 1 when it is worth calling tx() or rx() again.
  */
-void teardown(APP_CONN *conn)
+static int split_wait(SPLIT *sp, int *announced)
 {
-    BIO_free_all(conn->ssl_bio);
-    BIO_free_all(conn->net_bio);
-    free(conn);
+    split_wake(&sp->net_sleeping, sp->net_efd);
+
+    if (atomic_load(&sp->err))
+        return 0;
+
+    if (!*announced) {
+        split_announce(&sp->tls_sleeping);
+        *announced = 1;
+        return 1;
+    }
+
+    *announced = 0;
+    if (!split_sleep(-1, 0, sp->tls_efd, sp->timeout))
+        return 0;
+
+    atomic_store(&sp->tls_sleeping, 0);
+    return 1;
 }
 
-/*
- * The application is shutting down and wants to free a previously
- * created SSL_CTX.
- */
-void teardown_ctx(SSL_CTX *ctx)
+static int run_split(APP_CONN *conn, int fd, const char *tx_p, int tx_len,
+                     int zero_copy, int timeout)
 {
-    SSL_CTX_free(ctx);
+    SPLIT sp = {0};
+    pthread_t net_thread;
+    struct timespec t0, t1;
+    char buf[16384];
+    size_t total = 0, shown = 0;
+    int l, eof, announced = 0, res = 0;
+    uint64_t one = 1;
+    double wall;
+
+    sp.conn         = conn;
+    sp.fd           = fd;
+    sp.timeout      = timeout;
+    sp.zero_copy    = zero_copy;
+    sp.net_efd      = eventfd(0, EFD_CLOEXEC);
+    sp.tls_efd      = eventfd(0, EFD_CLOEXEC);
+    if (sp.net_efd < 0 || sp.tls_efd < 0) {
+        fprintf(stderr, "cannot create eventfd\n");
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (pthread_create(&net_thread, NULL, split_net_main, &sp) != 0) {
+        fprintf(stderr, "cannot create thread\n");
+        goto out;
+    }
+
+    /* TX */
+    while (tx_len != 0) {
+        l = tx(conn, tx_p, tx_len);
+        if (l > 0) {
+            tx_p += l;
+            tx_len -= l;
+            split_wake(&sp.net_sleeping, sp.net_efd);
+        } else if (l == -1 || !split_wait(&sp, &announced)) {
+            fprintf(stderr, "tx error\n");
+            goto join;
+        }
+    }
+
+    /* RX, until the peer closes the connection. */
+    for (;;) {
+        /* Anything received before EOF was signalled will be read below. */
+        eof = atomic_load(&sp.eof);
+
+        l = rx(conn, buf, sizeof(buf));
+        if (l > 0) {
+            split_wake(&sp.net_sleeping, sp.net_efd);
+            if (shown < 2048) {
+                fwrite(buf, 1, l < 2048 - shown ? l : 2048 - shown, stdout);
+                shown += l < 2048 - shown ? l : 2048 - shown;
+            }
+            total += l;
+        } else if (l == -1 || eof) {
+            break;
+        } else if (!split_wait(&sp, &announced)) {
+            fprintf(stderr, "rx error\n");
+            goto join;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    wall = timespec_diff(&t0, &t1);
+    fprintf(stderr, "split: %zu bytes in %.3f s; %.2f MB/s\n",
+            total, wall, total / wall / 1e6);
+    res = (total > 0);
+
+join:
+    atomic_store(&sp.done, 1);
+    write(sp.net_efd, &one, sizeof(one));
+    pthread_join(net_thread, NULL);
+out:
+    if (sp.net_efd >= 0)
+        close(sp.net_efd);
+    if (sp.tls_efd >= 0)
+        close(sp.tls_efd);
+    return res;
 }
 
 /*
- * ============================================================================
- * Example driver for the above code. This is just to demonstrate that the code
- * works and is not intended to be representative of a real application.
+ * Waits for the events on fd and moves data between it and conn. Returns 1 if
+ * the caller should try again, 0 on EOF and -1 on error or timeout.
  */
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/signal.h>
-#include <netdb.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <errno.h>
-
 static int pump(APP_CONN *conn, int fd, int events, int timeout)
 {
-    int l, l2;
+    int l, l2, moved = 0;
     char buf[2048];
     size_t wspace;
     struct pollfd pfd = {0};
@@ -279,7 +2388,10 @@ static int pump(APP_CONN *conn, int fd, int events, int timeout)
     if (pfd.revents & POLLIN) {
         while ((wspace = net_rx_space(conn)) > 0) {
             l = read(fd, buf, wspace > sizeof(buf) ? sizeof(buf) : wspace);
-            if (l <= 0) {
+            if (l == 0)
+                /* EOF; let rx() drain what was moved before reporting it. */
+                return moved;
+            if (l < 0) {
                 switch (errno) {
                     case EAGAIN:
                         goto stop;
@@ -292,6 +2404,7 @@ static int pump(APP_CONN *conn, int fd, int events, int timeout)
             l2 = write_net_rx(conn, buf, l);
             if (l2 < l)
                 fprintf(stderr, "short write %d %d\n", l2, l);
+            moved = 1;
         } stop:;
     }
 
@@ -312,16 +2425,25 @@ static int pump(APP_CONN *conn, int fd, int events, int timeout)
 int main(int argc, char **argv)
 {
     int rc, fd = -1, res = 1;
-    const char tx_msg[] = "GET / HTTP/1.0\r\nHost: www.example.com\r\n\r\n";
+    char tx_msg[512];
     const char *tx_p = tx_msg;
     char rx_msg[2048], *rx_p = rx_msg;
-    int l, tx_len = sizeof(tx_msg)-1, rx_len = sizeof(rx_msg);
+    int l, tx_len, rx_len = sizeof(rx_msg);
     int timeout = 2000 /* ms */;
     APP_CONN *conn = NULL;
     struct addrinfo hints = {0}, *result = NULL;
-    SSL_CTX *ctx;
+    SSL_CTX *ctx = NULL;
+    DRV_OPTS opts;
+    DRV_TARGET t;
+
+    if (drv_getopt(argc, argv, &opts) == 0)
+        return 1;
 
-    ctx = create_ssl_ctx();
+    tx_len = snprintf(tx_msg, sizeof(tx_msg),
+                      "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                      opts.path, opts.hostname);
+
+    ctx = drv_create_ctx(&opts);
     if (ctx == NULL) {
         fprintf(stderr, "cannot create SSL context\n");
         goto fail;
@@ -330,14 +2452,57 @@ int main(int argc, char **argv)
     hints.ai_family     = AF_INET;
     hints.ai_socktype   = SOCK_STREAM;
     hints.ai_flags      = AI_PASSIVE;
-    rc = getaddrinfo("www.example.com", "443", &hints, &result);
-    if (rc < 0) {
+    rc = getaddrinfo(opts.hostname, opts.port, &hints, &result);
+    if (rc != 0) {
         fprintf(stderr, "cannot resolve\n");
         goto fail;
     }
 
     signal(SIGPIPE, SIG_IGN);
 
+    t.opts      = &opts;
+    t.hostname  = opts.hostname;
+    t.port      = opts.port;
+    t.ai        = result;
+    t.tx_msg    = tx_msg;
+    t.tx_len    = tx_len;
+
+    if (opts.num_handshakes > 0) {
+        if (drv_bench_handshake(ctx, &t, opts.num_handshakes))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.bulk_size > 0) {
+        if (drv_bench_bulk(ctx, &t, opts.bulk_size))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_pingpongs > 0) {
+        if (drv_bench_pingpong(ctx, &t, opts.num_pingpongs))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_idle > 0) {
+        if (drv_bench_idle(ctx, &t, opts.num_idle))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.startup) {
+        if (drv_bench_startup(ctx, &t))
+            res = 0;
+        goto fail;
+    }
+
+    if (opts.num_conns > 0) {
+        if (drv_run_many(ctx, &t, &opts))
+            res = 0;
+        goto fail;
+    }
+
     fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (fd < 0) {
         fprintf(stderr, "cannot create socket\n");
@@ -356,12 +2521,21 @@ int main(int argc, char **argv)
         goto fail;
     }
 
-    conn = new_conn(ctx, "www.example.com");
+    /* No APP_CONN_ASYNC: drv_getopt() rejects -a without -n. */
+    conn = new_conn_ex(ctx, opts.hostname, opts.port,
+                       (opts.split ? APP_CONN_THREADED : 0)
+                       | (opts.idle_shrink ? APP_CONN_IDLE_SHRINK : 0));
     if (conn == NULL) {
         fprintf(stderr, "cannot establish connection\n");
         goto fail;
     }
 
+    if (opts.split) {
+        if (run_split(conn, fd, tx_p, tx_len, opts.zero_copy, timeout))
+            res = 0;
+        goto fail;
+    }
+
     /* TX */
     while (tx_len != 0) {
         l = tx(conn, tx_p, tx_len);
@@ -370,6 +2544,7 @@ int main(int argc, char **argv)
             tx_len -= l;
         } else if (l == -1) {
             fprintf(stderr, "tx error\n");
+            goto fail;
         } else if (l == -2) {
             if (pump(conn, fd, get_conn_pending_tx(conn), timeout) != 1) {
                 fprintf(stderr, "pump error\n");
@@ -387,7 +2562,10 @@ int main(int argc, char **argv)
         } else if (l == -1) {
             break;
         } else if (l == -2) {
-            if (pump(conn, fd, get_conn_pending_rx(conn), timeout) != 1) {
+            rc = pump(conn, fd, get_conn_pending_rx(conn), timeout);
+            if (rc == 0)
+                break; /* the response ends when the peer closes */
+            if (rc < 0) {
                 fprintf(stderr, "pump error\n");
                 goto fail;
             }
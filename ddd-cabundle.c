@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
+
+/*
+ * CA Bundle Compiler
+ * ==================
+ *
+ * Compiles PEM CA certificates into the bundle format accepted by the demos'
+ * use_ca_bundle(), so that a process can start trusting them without parsing
+ * any of them up front:
+ *
+ *   ddd-cabundle out.cab [file.pem ...]
+ *
+ * Without input files, the default CA file is compiled (SSL_CERT_FILE if set,
+ * otherwise OpenSSL's default, as used by SSL_CTX_set_default_verify_paths()).
+ * Duplicate certificates are dropped.
+ *
+ * The bundle, all integers little-endian:
+ *
+ *   offset 0   "DDDCAB1\n"
+ *          8   number of certificates, n
+ *         12   reserved, 0
+ *         16   n index entries of 12 bytes, sorted by hash: the subject name
+ *              hash (X509_NAME_hash_ex(), as used by c_rehash), then the offset
+ *              from the start of the file and the length of the certificate
+ *   16 + 12n   the certificates, DER encoded
+ */
+#define CA_BUNDLE_MAGIC     "DDDCAB1\n"
+#define CA_BUNDLE_HDR_LEN   16
+#define CA_BUNDLE_ENT_LEN   12
+
+typedef struct cab_cert_st {
+    uint32_t hash;
+    int der_len;
+    unsigned char *der;
+} CAB_CERT;
+
+typedef struct cab_st {
+    CAB_CERT *certs;
+    size_t num, cap;
+} CAB;
+
+static int cab_cmp(const void *a, const void *b)
+{
+    const CAB_CERT *x = a, *y = b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if (x->der_len != y->der_len)
+        return x->der_len < y->der_len ? -1 : 1;
+    return memcmp(x->der, y->der, x->der_len);
+}
+
+static int cab_add(CAB *cab, X509 *x)
+{
+    CAB_CERT *c;
+    int ok;
+
+    if (cab->num == cab->cap) {
+        size_t cap = cab->cap ? cab->cap * 2 : 256;
+        void *p = realloc(cab->certs, cap * sizeof(CAB_CERT));
+
+        if (p == NULL)
+            return 0;
+
+        cab->certs  = p;
+        cab->cap    = cap;
+    }
+
+    c = &cab->certs[cab->num];
+    c->hash = X509_NAME_hash_ex(X509_get_subject_name(x), NULL, NULL, &ok);
+    if (!ok)
+        return 0;
+
+    c->der      = NULL;
+    c->der_len  = i2d_X509(x, &c->der);
+    if (c->der_len <= 0)
+        return 0;
+
+    ++cab->num;
+    return 1;
+}
+
+static int cab_read_pem(CAB *cab, const char *path)
+{
+    BIO *in;
+    X509 *x;
+    int n = 0;
+
+    in = BIO_new_file(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 0;
+    }
+
+    while ((x = PEM_read_bio_X509(in, NULL, NULL, NULL)) != NULL) {
+        if (!cab_add(cab, x)) {
+            X509_free(x);
+            BIO_free(in);
+            return 0;
+        }
+        X509_free(x);
+        ++n;
+    }
+
+    /* Running out of certificates is how the loop above ends. */
+    ERR_clear_error();
+    BIO_free(in);
+
+    if (n == 0) {
+        fprintf(stderr, "no certificates in %s\n", path);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int cab_write(CAB *cab, const char *path)
+{
+    unsigned char hdr[CA_BUNDLE_HDR_LEN], ent[CA_BUNDLE_ENT_LEN];
+    size_t i, n = 0, off, len;
+    FILE *f;
+
+    /* Sort by hash and drop exact duplicates. */
+    qsort(cab->certs, cab->num, sizeof(CAB_CERT), cab_cmp);
+    for (i = 0; i < cab->num; ++i) {
+        if (n > 0 && cab_cmp(&cab->certs[n - 1], &cab->certs[i]) == 0) {
+            OPENSSL_free(cab->certs[i].der);
+            continue;
+        }
+        cab->certs[n++] = cab->certs[i];
+    }
+    cab->num = n;
+
+    off = CA_BUNDLE_HDR_LEN + cab->num * CA_BUNDLE_ENT_LEN;
+    for (i = 0; i < cab->num; ++i)
+        off += cab->certs[i].der_len;
+    len = off;
+    if (len > UINT32_MAX) {
+        fprintf(stderr, "too many certificates\n");
+        return 0;
+    }
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "cannot create %s\n", path);
+        return 0;
+    }
+
+    memcpy(hdr, CA_BUNDLE_MAGIC, 8);
+    put_le32(hdr + 8, cab->num);
+    put_le32(hdr + 12, 0);
+    fwrite(hdr, sizeof(hdr), 1, f);
+
+    off = CA_BUNDLE_HDR_LEN + cab->num * CA_BUNDLE_ENT_LEN;
+    for (i = 0; i < cab->num; ++i) {
+        put_le32(ent, cab->certs[i].hash);
+        put_le32(ent + 4, off);
+        put_le32(ent + 8, cab->certs[i].der_len);
+        fwrite(ent, sizeof(ent), 1, f);
+        off += cab->certs[i].der_len;
+    }
+
+    for (i = 0; i < cab->num; ++i)
+        fwrite(cab->certs[i].der, cab->certs[i].der_len, 1, f);
+
+    if (ferror(f) | fclose(f)) {
+        fprintf(stderr, "cannot write %s\n", path);
+        return 0;
+    }
+
+    fprintf(stderr, "%s: %zu certificates, %zu bytes\n", path, cab->num, len);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    CAB cab = {0};
+    const char *def;
+    size_t i;
+    int j, res = 1;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s out.cab [file.pem ...]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc == 2) {
+        def = getenv(X509_get_default_cert_file_env());
+        if (def == NULL)
+            def = X509_get_default_cert_file();
+        if (!cab_read_pem(&cab, def))
+            goto out;
+    }
+
+    for (j = 2; j < argc; ++j)
+        if (!cab_read_pem(&cab, argv[j]))
+            goto out;
+
+    if (cab_write(&cab, argv[1]))
+        res = 0;
+
+out:
+    for (i = 0; i < cab.num; ++i)
+        OPENSSL_free(cab.certs[i].der);
+    free(cab.certs);
+    return res;
+}
@@ -0,0 +1,1700 @@
+/*
+ * Shared Demo Code
+ * ================
+ *
+ * libssl code which is the same in every demo, kept here once rather than in
+ * each of them. Unlike ddd-driver.h, this is part of how the demos use libssl
+ * on the application's behalf; each demo includes it ahead of its own
+ * functions.
+ *
+ * Some of it is only built for the demos which use it, selected by macros the
+ * demo defines before including this file:
+ *
+ *   DDD_ASYNC_VERIFY   Asynchronous verification, for the nonblocking demos.
+ *                      The demo's APP_CONN, which must have an ssl member,
+ *                      has to be defined first.
+ *   DDD_ASYNC_JOBS     The demo runs connections in async jobs
+ *                      (APP_CONN_ASYNC), which the SSL object pool must not
+ *                      recycle while they have wait fds.
+ *   DDD_SSL_POOL       The SSL object pool.
+ *   DDD_CONN_CACHE     The per-thread connection cache, for the nonblocking
+ *                      demos, whose APP_CONN has to be defined first.
+ *   DDD_CONN_CACHE_BIO_PAIR
+ *                      Cached structures also keep a BIO pair, which the
+ *                      demo takes and keeps itself.
+ */
+#ifndef DDD_COMMON_H
+# define DDD_COMMON_H
+
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <stdint.h>
+# include <stdlib.h>
+# include <string.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <time.h>
+# include <openssl/ssl.h>
+
+/*
+ * Session cache
+ * -------------
+ *
+ * libssl's client-side session cache is not keyed by server, so the
+ * application keeps its own, attached to each SSL_CTX returned by
+ * create_ssl_ctx(). Sessions are captured by the new session callback, filed
+ * under the hostname:port of the connection they came from and offered again
+ * by the next new_conn() to the same server. TLS 1.3 tickets are only used
+ * once, newest first. The least recently used sessions are evicted once the
+ * cache uses more than SESS_CACHE_MAX_BYTES.
+ */
+#define SESS_CACHE_MAX_BYTES    (256 * 1024)
+#define SESS_CACHE_BUCKETS      256
+
+typedef struct sess_entry_st {
+    struct sess_entry_st *lru_prev, *lru_next, *hash_next;
+    SSL_SESSION *sess;
+    size_t size;
+    char key[];
+} SESS_ENTRY;
+
+typedef struct sess_cache_st {
+    CRYPTO_RWLOCK *lock;
+    SESS_ENTRY *buckets[SESS_CACHE_BUCKETS];
+    SESS_ENTRY *lru_head, *lru_tail; /* most recently used first */
+    size_t num_bytes;
+    unsigned long num_full, num_resumed;
+    unsigned long num_early_accepted, num_early_rejected;
+} SESS_CACHE;
+
+/* Per-SSL state: the key the connection's sessions are filed under. */
+typedef struct sess_conn_st {
+    int counted;
+    char key[];
+} SESS_CONN;
+
+static int sess_cache_idx = -1, sess_conn_idx = -1;
+static CRYPTO_ONCE sess_idx_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void sess_entry_free(SESS_ENTRY *e)
+{
+    SSL_SESSION_free(e->sess);
+    free(e);
+}
+
+static void sess_cache_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                            int idx, long argl, void *argp)
+{
+    SESS_CACHE *cache = ptr;
+    SESS_ENTRY *e, *next;
+
+    if (cache == NULL)
+        return;
+
+    for (e = cache->lru_head; e != NULL; e = next) {
+        next = e->lru_next;
+        sess_entry_free(e);
+    }
+    CRYPTO_THREAD_lock_free(cache->lock);
+    free(cache);
+}
+
+static void sess_conn_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                           int idx, long argl, void *argp)
+{
+    free(ptr);
+}
+
+static void sess_idx_init(void)
+{
+    sess_cache_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                              sess_cache_free);
+    sess_conn_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, sess_conn_free);
+}
+
+/* Unlinks an entry from both the hash chain and the LRU list. */
+static void sess_cache_unlink(SESS_CACHE *cache, SESS_ENTRY *e)
+{
+    SESS_ENTRY **pe;
+
+    pe = &cache->buckets[OPENSSL_LH_strhash(e->key) % SESS_CACHE_BUCKETS];
+    while (*pe != e)
+        pe = &(*pe)->hash_next;
+    *pe = e->hash_next;
+
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+
+    cache->num_bytes -= e->size;
+}
+
+static SESS_ENTRY *sess_cache_find(SESS_CACHE *cache, const char *key)
+{
+    SESS_ENTRY *e;
+
+    e = cache->buckets[OPENSSL_LH_strhash(key) % SESS_CACHE_BUCKETS];
+    while (e != NULL && strcmp(e->key, key) != 0)
+        e = e->hash_next;
+
+    return e;
+}
+
+/*
+ * Called by libssl whenever the server gives us a session (in TLS 1.3, a
+ * ticket). Returning 1 means we keep the reference to sess.
+ */
+static int sess_cache_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    SESS_CACHE *cache;
+    SESS_CONN *sc;
+    SESS_ENTRY *e, *old;
+    size_t key_len, h;
+    int enc_len;
+
+    cache   = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), sess_cache_idx);
+    sc      = SSL_get_ex_data(ssl, sess_conn_idx);
+    if (cache == NULL || sc == NULL || !SSL_SESSION_is_resumable(sess))
+        return 0;
+
+    enc_len = i2d_SSL_SESSION(sess, NULL);
+    if (enc_len <= 0)
+        return 0;
+
+    key_len = strlen(sc->key) + 1;
+    e = malloc(sizeof(SESS_ENTRY) + key_len);
+    if (e == NULL)
+        return 0;
+
+    memcpy(e->key, sc->key, key_len);
+    e->sess     = sess;
+    e->size     = sizeof(SESS_ENTRY) + key_len + enc_len;
+    e->lru_prev = NULL;
+
+    CRYPTO_THREAD_write_lock(cache->lock);
+
+    /*
+     * A TLS 1.3 server sends several single-use tickets, so keep all of them
+     * for concurrent connections to use. Older sessions are reusable and only
+     * the newest one for each server is kept.
+     */
+    old = NULL;
+    if (SSL_SESSION_get_protocol_version(sess) < TLS1_3_VERSION) {
+        old = sess_cache_find(cache, e->key);
+        if (old != NULL)
+            sess_cache_unlink(cache, old);
+    }
+
+    h = OPENSSL_LH_strhash(e->key) % SESS_CACHE_BUCKETS;
+    e->hash_next = cache->buckets[h];
+    cache->buckets[h] = e;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = e;
+    else
+        cache->lru_tail = e;
+    cache->lru_head = e;
+    cache->num_bytes += e->size;
+
+    /* Evict least recently used sessions until we are within budget. */
+    while (cache->num_bytes > SESS_CACHE_MAX_BYTES && cache->lru_tail != e) {
+        SESS_ENTRY *victim = cache->lru_tail;
+
+        sess_cache_unlink(cache, victim);
+        sess_entry_free(victim);
+    }
+
+    CRYPTO_THREAD_unlock(cache->lock);
+
+    if (old != NULL)
+        sess_entry_free(old);
+    return 1;
+}
+
+/*
+ * Counts each connection's handshake as full or resumed once it completes.
+ */
+static void sess_cache_info_cb(const SSL *ssl, int where, int ret)
+{
+    SESS_CACHE *cache;
+    SESS_CONN *sc;
+
+    /*
+     * When sending early data libssl also reports the handshake as done once
+     * the ClientHello is out, so wait until it really is.
+     */
+    if ((where & SSL_CB_HANDSHAKE_DONE) == 0 || !SSL_is_init_finished(ssl))
+        return;
+
+    cache   = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), sess_cache_idx);
+    sc      = SSL_get_ex_data(ssl, sess_conn_idx);
+    if (cache == NULL || sc == NULL || sc->counted)
+        return;
+
+    sc->counted = 1;
+    CRYPTO_THREAD_write_lock(cache->lock);
+    if (SSL_session_reused((SSL *)ssl))
+        ++cache->num_resumed;
+    else
+        ++cache->num_full;
+    switch (SSL_get_early_data_status(ssl)) {
+        case SSL_EARLY_DATA_ACCEPTED:
+            ++cache->num_early_accepted;
+            break;
+        case SSL_EARLY_DATA_REJECTED:
+            ++cache->num_early_rejected;
+            break;
+    }
+    CRYPTO_THREAD_unlock(cache->lock);
+}
+
+/*
+ * Sets up session caching on a new SSL_CTX.
+ */
+static int sess_cache_enable(SSL_CTX *ctx)
+{
+    SESS_CACHE *cache;
+
+    if (!CRYPTO_THREAD_run_once(&sess_idx_once, sess_idx_init)
+        || sess_cache_idx < 0 || sess_conn_idx < 0)
+        return 0;
+
+    cache = calloc(1, sizeof(SESS_CACHE));
+    if (cache == NULL)
+        return 0;
+
+    cache->lock = CRYPTO_THREAD_lock_new();
+    if (cache->lock == NULL || !SSL_CTX_set_ex_data(ctx, sess_cache_idx, cache)) {
+        CRYPTO_THREAD_lock_free(cache->lock);
+        free(cache);
+        return 0;
+    }
+
+    /* libssl should hand sessions to us rather than keep them itself. */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+                                        | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, sess_cache_new_cb);
+    SSL_CTX_set_info_callback(ctx, sess_cache_info_cb);
+    return 1;
+}
+
+/*
+ * Files the sessions of a new connection under key, and offers the server the
+ * session we last got from it, if any.
+ */
+static int sess_cache_attach(SSL *ssl, const char *key)
+{
+    SESS_CACHE *cache;
+    SESS_CONN *sc;
+    SESS_ENTRY *e;
+    SSL_SESSION *sess = NULL;
+    size_t key_len = strlen(key) + 1;
+    int ok = 1;
+
+    cache = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), sess_cache_idx);
+    if (cache == NULL)
+        return 1;
+
+    sc = malloc(sizeof(SESS_CONN) + key_len);
+    if (sc == NULL)
+        return 0;
+
+    sc->counted = 0;
+    memcpy(sc->key, key, key_len);
+    if (!SSL_set_ex_data(ssl, sess_conn_idx, sc)) {
+        free(sc);
+        return 0;
+    }
+
+    CRYPTO_THREAD_write_lock(cache->lock);
+    e = sess_cache_find(cache, key);
+    if (e != NULL) {
+        sess = e->sess;
+        if (SSL_SESSION_get_protocol_version(sess) >= TLS1_3_VERSION) {
+            /* Tickets are single use; the server will send us a new one. */
+            sess_cache_unlink(cache, e);
+            e->sess = NULL;
+            free(e);
+        } else {
+            SSL_SESSION_up_ref(sess);
+
+            /* Move to the front of the LRU list. */
+            if (e != cache->lru_head) {
+                e->lru_prev->lru_next = e->lru_next;
+                if (e->lru_next != NULL)
+                    e->lru_next->lru_prev = e->lru_prev;
+                else
+                    cache->lru_tail = e->lru_prev;
+                e->lru_prev = NULL;
+                e->lru_next = cache->lru_head;
+                cache->lru_head->lru_prev = e;
+                cache->lru_head = e;
+            }
+        }
+    }
+    CRYPTO_THREAD_unlock(cache->lock);
+
+    if (sess != NULL) {
+        ok = SSL_set_session(ssl, sess);
+        SSL_SESSION_free(sess);
+    }
+
+    return ok;
+}
+
+/*
+ * The application wants to know how many handshakes on connections created
+ * from an SSL_CTX were full handshakes and how many resumed a session.
+ */
+void get_sess_cache_stats(SSL_CTX *ctx, unsigned long *num_full,
+                          unsigned long *num_resumed)
+{
+    SESS_CACHE *cache = SSL_CTX_get_ex_data(ctx, sess_cache_idx);
+
+    *num_full = *num_resumed = 0;
+    if (cache == NULL)
+        return;
+
+    CRYPTO_THREAD_read_lock(cache->lock);
+    *num_full       = cache->num_full;
+    *num_resumed    = cache->num_resumed;
+    CRYPTO_THREAD_unlock(cache->lock);
+}
+
+/*
+ * The application wants to know how many connections created from an SSL_CTX
+ * had their 0-RTT early data accepted by the server and how many rejected.
+ */
+void get_early_data_stats(SSL_CTX *ctx, unsigned long *num_accepted,
+                          unsigned long *num_rejected)
+{
+    SESS_CACHE *cache = SSL_CTX_get_ex_data(ctx, sess_cache_idx);
+
+    *num_accepted = *num_rejected = 0;
+    if (cache == NULL)
+        return;
+
+    CRYPTO_THREAD_read_lock(cache->lock);
+    *num_accepted   = cache->num_early_accepted;
+    *num_rejected   = cache->num_early_rejected;
+    CRYPTO_THREAD_unlock(cache->lock);
+}
+
+/*
+ * Verification cache
+ * ------------------
+ *
+ * Every full handshake has libssl build and verify the server's chain from
+ * scratch, even if the same server presented the same chain a moment ago.
+ * enable_verify_cache() gives an SSL_CTX a cache of the chains which passed,
+ * keyed by a SHA-256 digest over the certificates the server sent, the
+ * hostname they were checked against (SSL_set1_host()) and the current period
+ * of VERIFY_CACHE_TTL seconds. A chain found there is accepted without
+ * building or checking it again. An entry lasts until its period ends or the
+ * first certificate of the verified chain expires, whichever is sooner; the
+ * least recently used entries are evicted beyond VERIFY_CACHE_MAX.
+ *
+ * Only successes are cached. A hit neither runs the verify callback nor sets
+ * SSL_get0_verified_chain().
+ */
+#define VERIFY_CACHE_MAX        1024
+#define VERIFY_CACHE_BUCKETS    256
+#define VERIFY_CACHE_TTL        300 /* seconds */
+#define VERIFY_KEY_LEN          32  /* SHA-256 */
+
+typedef struct verify_entry_st {
+    struct verify_entry_st *lru_prev, *lru_next, *hash_next;
+    unsigned char key[VERIFY_KEY_LEN];
+    time_t expires;
+} VERIFY_ENTRY;
+
+typedef struct verify_cache_st {
+    CRYPTO_RWLOCK *lock;
+    EVP_MD *sha256;
+    VERIFY_ENTRY *buckets[VERIFY_CACHE_BUCKETS];
+    VERIFY_ENTRY *lru_head, *lru_tail; /* most recently used first */
+    size_t num_entries;
+    unsigned long num_hits, num_misses;
+} VERIFY_CACHE;
+
+static int verify_cache_idx = -1;
+static CRYPTO_ONCE verify_idx_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void verify_cache_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                              int idx, long argl, void *argp)
+{
+    VERIFY_CACHE *cache = ptr;
+    VERIFY_ENTRY *e, *next;
+
+    if (cache == NULL)
+        return;
+
+    for (e = cache->lru_head; e != NULL; e = next) {
+        next = e->lru_next;
+        free(e);
+    }
+    EVP_MD_free(cache->sha256);
+    CRYPTO_THREAD_lock_free(cache->lock);
+    free(cache);
+}
+
+static void verify_idx_init(void)
+{
+    verify_cache_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                                verify_cache_free);
+}
+
+/* Keys are digests already, so their first bytes hash well enough. */
+static size_t verify_cache_bucket(const unsigned char *key)
+{
+    return ((size_t)key[0] << 8 | key[1]) % VERIFY_CACHE_BUCKETS;
+}
+
+/* Unlinks an entry from both the hash chain and the LRU list. */
+static void verify_cache_unlink(VERIFY_CACHE *cache, VERIFY_ENTRY *e)
+{
+    VERIFY_ENTRY **pe;
+
+    pe = &cache->buckets[verify_cache_bucket(e->key)];
+    while (*pe != e)
+        pe = &(*pe)->hash_next;
+    *pe = e->hash_next;
+
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+
+    --cache->num_entries;
+}
+
+/* Puts an unlinked entry at the front of the LRU list. */
+static void verify_cache_link(VERIFY_CACHE *cache, VERIFY_ENTRY *e)
+{
+    size_t h = verify_cache_bucket(e->key);
+
+    e->hash_next = cache->buckets[h];
+    cache->buckets[h] = e;
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = e;
+    else
+        cache->lru_tail = e;
+    cache->lru_head = e;
+
+    ++cache->num_entries;
+}
+
+static VERIFY_ENTRY *verify_cache_find(VERIFY_CACHE *cache,
+                                       const unsigned char *key)
+{
+    VERIFY_ENTRY *e;
+
+    e = cache->buckets[verify_cache_bucket(key)];
+    while (e != NULL && memcmp(e->key, key, VERIFY_KEY_LEN) != 0)
+        e = e->hash_next;
+
+    return e;
+}
+
+/*
+ * Computes the key of the chain the server sent, which libssl passes as the
+ * untrusted certificates with the server's own first.
+ */
+static int verify_cache_key(VERIFY_CACHE *cache, X509_STORE_CTX *ctx,
+                            time_t now, unsigned char *key)
+{
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_untrusted(ctx);
+    SSL *ssl;
+    EVP_MD_CTX *md_ctx;
+    const char *host;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    uint64_t period = now / VERIFY_CACHE_TTL;
+    int i, ok = 0;
+
+    ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    if (ssl == NULL || chain == NULL)
+        return 0;
+
+    host = X509_VERIFY_PARAM_get0_host(SSL_get0_param(ssl), 0);
+    if (host == NULL)
+        host = "";
+
+    md_ctx = EVP_MD_CTX_new();
+    if (md_ctx == NULL
+        || !EVP_DigestInit_ex(md_ctx, cache->sha256, NULL)
+        || !EVP_DigestUpdate(md_ctx, host, strlen(host) + 1)
+        || !EVP_DigestUpdate(md_ctx, &period, sizeof(period)))
+        goto out;
+
+    for (i = 0; i < sk_X509_num(chain); ++i)
+        if (!X509_digest(sk_X509_value(chain, i), cache->sha256, md, &md_len)
+            || !EVP_DigestUpdate(md_ctx, md, md_len))
+            goto out;
+
+    ok = EVP_DigestFinal_ex(md_ctx, key, NULL);
+
+out:
+    EVP_MD_CTX_free(md_ctx);
+    return ok;
+}
+
+/*
+ * Returns when the verified chain of ctx stops being good: the end of the
+ * current period or the earliest notAfter in it.
+ */
+static time_t verify_cache_expiry(X509_STORE_CTX *ctx, time_t now)
+{
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
+    time_t expires = (now / VERIFY_CACHE_TTL + 1) * VERIFY_CACHE_TTL;
+    int i, days, secs;
+
+    for (i = 0; i < sk_X509_num(chain); ++i) {
+        if (!ASN1_TIME_diff(&days, &secs, NULL,
+                            X509_get0_notAfter(sk_X509_value(chain, i))))
+            return now;
+        if (now + days * 86400L + secs < expires)
+            expires = now + days * 86400L + secs;
+    }
+
+    return expires;
+}
+
+/*
+ * Looks up the chain being verified by ctx, leaving its key in key and setting
+ * *have_key if it could be computed. Returns 1 if the chain is known good.
+ */
+static int verify_cache_lookup(VERIFY_CACHE *cache, X509_STORE_CTX *ctx,
+                               time_t now, unsigned char *key, int *have_key)
+{
+    VERIFY_ENTRY *e, *stale = NULL;
+    int hit = 0;
+
+    *have_key = verify_cache_key(cache, ctx, now, key);
+
+    CRYPTO_THREAD_write_lock(cache->lock);
+    e = *have_key ? verify_cache_find(cache, key) : NULL;
+    if (e != NULL && e->expires <= now) {
+        verify_cache_unlink(cache, e);
+        stale = e;
+    } else if (e != NULL) {
+        verify_cache_unlink(cache, e);
+        verify_cache_link(cache, e);
+        hit = 1;
+    }
+    if (hit)
+        ++cache->num_hits;
+    else
+        ++cache->num_misses;
+    CRYPTO_THREAD_unlock(cache->lock);
+
+    free(stale);
+    return hit;
+}
+
+/* Remembers that the chain with the given key is good until expires. */
+static void verify_cache_add(VERIFY_CACHE *cache, const unsigned char *key,
+                             time_t expires)
+{
+    VERIFY_ENTRY *e, *stale;
+
+    e = malloc(sizeof(VERIFY_ENTRY));
+    if (e == NULL)
+        return;
+
+    memcpy(e->key, key, VERIFY_KEY_LEN);
+    e->expires = expires;
+
+    CRYPTO_THREAD_write_lock(cache->lock);
+
+    /* Another connection may have verified the same chain meanwhile. */
+    stale = verify_cache_find(cache, key);
+    if (stale != NULL)
+        verify_cache_unlink(cache, stale);
+    verify_cache_link(cache, e);
+
+    /* Evict least recently used entries until we are within budget. */
+    while (cache->num_entries > VERIFY_CACHE_MAX) {
+        VERIFY_ENTRY *victim = cache->lru_tail;
+
+        verify_cache_unlink(cache, victim);
+        free(victim);
+    }
+
+    CRYPTO_THREAD_unlock(cache->lock);
+
+    free(stale);
+}
+
+/*
+ * Called by libssl in place of X509_verify_cert() to verify the server's
+ * chain. Returns 1 if it is trusted.
+ */
+static int verify_cache_cb(X509_STORE_CTX *ctx, void *arg)
+{
+    VERIFY_CACHE *cache = arg;
+    unsigned char key[VERIFY_KEY_LEN];
+    time_t now = time(NULL);
+    int have_key, ok;
+
+    /* The error of ctx is still X509_V_OK, which libssl takes as the result. */
+    if (verify_cache_lookup(cache, ctx, now, key, &have_key))
+        return 1;
+
+    ok = X509_verify_cert(ctx);
+    if (ok > 0 && have_key && X509_STORE_CTX_get_error(ctx) == X509_V_OK)
+        verify_cache_add(cache, key, verify_cache_expiry(ctx, now));
+
+    return ok;
+}
+
+# ifdef DDD_ASYNC_VERIFY
+static int async_verify_enabled(SSL_CTX *ctx);
+# endif
+
+/*
+ * The application wants connections created from an SSL_CTX to accept a chain
+ * which was verified recently for the same hostname without verifying it
+ * again. This must be called before the first new_conn() on the SSL_CTX.
+ */
+int enable_verify_cache(SSL_CTX *ctx)
+{
+    VERIFY_CACHE *cache;
+
+    if (!CRYPTO_THREAD_run_once(&verify_idx_once, verify_idx_init)
+        || verify_cache_idx < 0)
+        return 0;
+
+    if (SSL_CTX_get_ex_data(ctx, verify_cache_idx) != NULL)
+        return 1;
+
+    cache = calloc(1, sizeof(VERIFY_CACHE));
+    if (cache == NULL)
+        return 0;
+
+    cache->lock     = CRYPTO_THREAD_lock_new();
+    cache->sha256   = EVP_MD_fetch(NULL, "SHA256", NULL);
+    if (cache->lock == NULL || cache->sha256 == NULL
+        || !SSL_CTX_set_ex_data(ctx, verify_cache_idx, cache)) {
+        EVP_MD_free(cache->sha256);
+        CRYPTO_THREAD_lock_free(cache->lock);
+        free(cache);
+        return 0;
+    }
+
+# ifdef DDD_ASYNC_VERIFY
+    /* Asynchronous verification consults the cache itself. */
+    if (async_verify_enabled(ctx))
+        return 1;
+# endif
+    SSL_CTX_set_cert_verify_callback(ctx, verify_cache_cb, cache);
+    return 1;
+}
+
+/*
+ * The application wants to know how many verifications of server chains on
+ * connections created from an SSL_CTX were answered by the verification cache
+ * and how many were done in full.
+ */
+void get_verify_cache_stats(SSL_CTX *ctx, unsigned long *num_hits,
+                            unsigned long *num_misses)
+{
+    VERIFY_CACHE *cache;
+
+    *num_hits = *num_misses = 0;
+    if (verify_cache_idx < 0)
+        return;
+
+    cache = SSL_CTX_get_ex_data(ctx, verify_cache_idx);
+    if (cache == NULL)
+        return;
+
+    CRYPTO_THREAD_read_lock(cache->lock);
+    *num_hits   = cache->num_hits;
+    *num_misses = cache->num_misses;
+    CRYPTO_THREAD_unlock(cache->lock);
+}
+
+/*
+ * Compiled CA bundle
+ * ------------------
+ *
+ * Parsing hundreds of PEM certificates dominates the startup time of a
+ * short-lived process. The application can instead have create_ssl_ctx()
+ * trust a bundle compiled by ddd-cabundle (which documents the format): the
+ * certificates in DER, indexed by subject name hash. The file is mapped
+ * rather than read, and a certificate is only decoded when chain building
+ * first asks the store for an issuer with its subject name, after which it is
+ * added to the store and found there by later lookups.
+ */
+#define CA_BUNDLE_MAGIC     "DDDCAB1\n"
+#define CA_BUNDLE_HDR_LEN   16
+#define CA_BUNDLE_ENT_LEN   12
+
+static const unsigned char *ca_bundle;
+static size_t ca_bundle_len;
+static uint32_t ca_bundle_count;
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * The application wants create_ssl_ctx() to trust the certificates in a bundle
+ * compiled by ddd-cabundle instead of loading the default verify paths. This
+ * must be called before the first create_ssl_ctx(). Returns 1 on success or 0
+ * if the file cannot be mapped or is not a bundle.
+ */
+int use_ca_bundle(const char *path)
+{
+    struct stat st;
+    void *map;
+    uint32_t count;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) < 0 || st.st_size < CA_BUNDLE_HDR_LEN) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    count = get_le32((const unsigned char *)map + 8);
+    if (memcmp(map, CA_BUNDLE_MAGIC, 8) != 0
+        || (st.st_size - CA_BUNDLE_HDR_LEN) / CA_BUNDLE_ENT_LEN < count) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    ca_bundle       = map;
+    ca_bundle_len   = st.st_size;
+    ca_bundle_count = count;
+    return 1;
+}
+
+/*
+ * Decodes the bundle's certificates with the subject name name and adds them
+ * to store.
+ */
+static void ca_bundle_load(X509_STORE *store, const X509_NAME *name)
+{
+    const unsigned char *ent, *der;
+    uint32_t hash, lo = 0, hi = ca_bundle_count, mid, off, len;
+    X509 *x;
+    int ok;
+
+    hash = X509_NAME_hash_ex(name, NULL, NULL, &ok);
+    if (!ok)
+        return;
+
+    /* Find the first entry with the hash; there may be several. */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (get_le32(ca_bundle + CA_BUNDLE_HDR_LEN
+                     + (size_t)mid * CA_BUNDLE_ENT_LEN) < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < ca_bundle_count; ++lo) {
+        ent = ca_bundle + CA_BUNDLE_HDR_LEN + (size_t)lo * CA_BUNDLE_ENT_LEN;
+        if (get_le32(ent) != hash)
+            break;
+
+        off = get_le32(ent + 4);
+        len = get_le32(ent + 8);
+        if (off > ca_bundle_len || len > ca_bundle_len - off)
+            continue;
+
+        der = ca_bundle + off;
+        x = d2i_X509(NULL, &der, len);
+        if (x == NULL)
+            continue;
+
+        /* Different names can share a hash. */
+        if (X509_NAME_cmp(X509_get_subject_name(x), name) == 0)
+            X509_STORE_add_cert(store, x);
+        X509_free(x);
+    }
+}
+
+/*
+ * Chain building asks the store for the issuer of each certificate. Look in
+ * what the store already holds first, and if that fails in the bundle.
+ */
+static int ca_bundle_get_issuer(X509 **issuer, X509_STORE_CTX *ctx, X509 *x)
+{
+    int rc;
+
+    rc = X509_STORE_CTX_get1_issuer(issuer, ctx, x);
+    if (rc != 0)
+        return rc;
+
+    ca_bundle_load(X509_STORE_CTX_get0_store(ctx), X509_get_issuer_name(x));
+    return X509_STORE_CTX_get1_issuer(issuer, ctx, x);
+}
+
+/* The same for lookups of all certificates with a subject name. */
+static STACK_OF(X509) *ca_bundle_lookup_certs(X509_STORE_CTX *ctx,
+                                              const X509_NAME *name)
+{
+    STACK_OF(X509) *certs;
+
+    certs = X509_STORE_CTX_get1_certs(ctx, name);
+    if (certs != NULL && sk_X509_num(certs) > 0)
+        return certs;
+
+    sk_X509_pop_free(certs, X509_free);
+    ca_bundle_load(X509_STORE_CTX_get0_store(ctx), name);
+    return X509_STORE_CTX_get1_certs(ctx, name);
+}
+
+/*
+ * Trust store
+ * -----------
+ *
+ * Parsing the system's root CA certificates is expensive and gives the same
+ * result for every SSL_CTX, so the store is loaded once, by the first call to
+ * create_ssl_ctx(), and shared by all of them: SSL_CTX_set1_cert_store() takes
+ * a reference rather than a copy. Nothing is added to the store afterwards
+ * except what libcrypto itself caches, under the store's lock, when it looks
+ * up certificates in a CA directory or, if use_ca_bundle() was called,
+ * decodes them from the bundle. It lives until the process exits.
+ */
+static X509_STORE *trust_store;
+static CRYPTO_ONCE trust_store_once = CRYPTO_ONCE_STATIC_INIT;
+
+/*
+ * Background loading
+ * ------------------
+ *
+ * No certificate is verified before the first handshake gets as far as the
+ * server's Certificate message, so the application can let loading the
+ * default paths overlap with name resolution, connecting and the ClientHello:
+ * the store is then loaded by a background thread started by the first
+ * create_ssl_ctx(), and a verification which starts before it is finished
+ * waits for the remainder.
+ */
+static int trust_store_background, trust_store_loaded;
+static pthread_mutex_t trust_store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trust_store_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * The application wants create_ssl_ctx() to return without waiting for the
+ * default root CA store to be loaded. This must be called before the first
+ * create_ssl_ctx(), and has no effect with use_ca_bundle(), which has nothing
+ * to load up front.
+ */
+void use_background_trust_store(void)
+{
+    trust_store_background = 1;
+}
+
+static void *trust_store_load_main(void *arg)
+{
+    /* On failure the store stays empty and verification fails. */
+    X509_STORE_set_default_paths(arg);
+
+    pthread_mutex_lock(&trust_store_lock);
+    trust_store_loaded = 1;
+    pthread_cond_broadcast(&trust_store_cond);
+    pthread_mutex_unlock(&trust_store_lock);
+    return NULL;
+}
+
+static void trust_store_wait(void)
+{
+    pthread_mutex_lock(&trust_store_lock);
+    while (!trust_store_loaded)
+        pthread_cond_wait(&trust_store_cond, &trust_store_lock);
+    pthread_mutex_unlock(&trust_store_lock);
+}
+
+/* Chain building only gets at the store through these two. */
+static int trust_store_get_issuer(X509 **issuer, X509_STORE_CTX *ctx, X509 *x)
+{
+    trust_store_wait();
+    return X509_STORE_CTX_get1_issuer(issuer, ctx, x);
+}
+
+static STACK_OF(X509) *trust_store_lookup_certs(X509_STORE_CTX *ctx,
+                                                const X509_NAME *name)
+{
+    trust_store_wait();
+    return X509_STORE_CTX_get1_certs(ctx, name);
+}
+
+static void trust_store_init(void)
+{
+    X509_STORE *store;
+    pthread_t thread;
+
+    store = X509_STORE_new();
+    if (store == NULL)
+        return;
+
+    if (ca_bundle != NULL) {
+        X509_STORE_set_get_issuer(store, ca_bundle_get_issuer);
+        X509_STORE_set_lookup_certs(store, ca_bundle_lookup_certs);
+    } else if (trust_store_background) {
+        X509_STORE_set_get_issuer(store, trust_store_get_issuer);
+        X509_STORE_set_lookup_certs(store, trust_store_lookup_certs);
+        /* Background loading only saves time; without a thread, load here. */
+        if (pthread_create(&thread, NULL, trust_store_load_main, store) != 0)
+            trust_store_load_main(store);
+        else
+            pthread_detach(thread);
+    } else if (X509_STORE_set_default_paths(store) == 0) {
+        X509_STORE_free(store);
+        return;
+    }
+
+    trust_store = store;
+}
+
+static X509_STORE *get_trust_store(void)
+{
+    if (!CRYPTO_THREAD_run_once(&trust_store_once, trust_store_init))
+        return NULL;
+
+    return trust_store;
+}
+
+/*
+ * Write pipelining
+ * ----------------
+ *
+ * Where the negotiated cipher has an implementation which can encrypt several
+ * records at once (one flagged EVP_CIPH_FLAG_PIPELINE, such as an engine
+ * driving a crypto accelerator), libssl can cut a write of several records'
+ * worth into full-sized records and hand them to the cipher together. With any
+ * other cipher it carries on one record at a time, so enabling this is
+ * harmless where nothing supports it.
+ *
+ * The stitched AES-CBC-HMAC-SHA ciphers of TLS 1.2 have a multi-block path of
+ * their own, which libssl takes for writes of four records or more whether or
+ * not pipelining was enabled, provided encrypt-then-MAC was not negotiated.
+ */
+
+/*
+ * The application wants large tx() calls on connections created from an
+ * SSL_CTX to be encrypted up to max_pipelines records at a time. This also
+ * turns on read-ahead. Must be called before the first new_conn() on the
+ * SSL_CTX.
+ */
+int enable_write_pipelining(SSL_CTX *ctx, unsigned int max_pipelines)
+{
+    if (max_pipelines < 2)
+        return 1;
+
+    /* The split send fragment already defaults to a full record. */
+    return SSL_CTX_set_max_pipelines(ctx, max_pipelines);
+}
+
+# ifdef DDD_ASYNC_VERIFY
+/*
+ * Asynchronous verification
+ * -------------------------
+ *
+ * Verifying the server's chain is the most expensive step of a full handshake
+ * on the client, and otherwise runs inside whichever tx() or rx() drives the
+ * handshake there, holding up every other connection on the same event loop.
+ * With enable_async_verify(), the verify callback instead hands a copy of the
+ * chain and the verification parameters to a pool of worker threads, shared
+ * by all SSL_CTX, and suspends the handshake with SSL_set_retry_verify().
+ * Until the result is in, tx() and rx() return -2 and get_conn_pending_tx()
+ * and get_conn_pending_rx() return no events. The worker then calls the
+ * function set with set_conn_verify_notify(), and the next tx() or rx() picks
+ * up the result where libssl asks for it again. The verification cache, if
+ * enabled, is consulted before a chain is handed to a worker and told about
+ * the chains found good.
+ */
+#define ASYNC_VERIFY_MAX_WORKERS    64
+
+/* States of a connection's verification job. */
+#define VERIFY_JOB_IDLE     0   /* nothing outstanding */
+#define VERIFY_JOB_BUSY     1   /* queued for or running on a worker */
+#define VERIFY_JOB_DONE     2   /* result waiting to be picked up */
+
+typedef struct verify_job_st {
+    struct verify_job_st *next;
+    int state, orphaned;
+    void (*notify)(void *arg);
+    void *notify_arg;
+
+    /* Inputs, released by the worker once done with. */
+    X509_STORE *store;
+    STACK_OF(X509) *chain;      /* as sent by the server, its own first */
+    X509_VERIFY_PARAM *param;
+
+    /* Outputs. */
+    int ok, error;
+    time_t expires;             /* if ok */
+
+    unsigned char key[VERIFY_KEY_LEN];
+    int have_key;
+} VERIFY_JOB;
+
+/* The worker pool and its queue, protected by verify_pool_lock. */
+static pthread_mutex_t verify_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t verify_pool_cond = PTHREAD_COND_INITIALIZER;
+static VERIFY_JOB *verify_queue_head, *verify_queue_tail;
+static int verify_pool_workers;
+
+/* SSL_CTX marker for enable_async_verify(), and each SSL's job. */
+static int async_verify_idx = -1, verify_job_idx = -1;
+static CRYPTO_ONCE async_verify_once = CRYPTO_ONCE_STATIC_INIT;
+
+static void verify_job_release(VERIFY_JOB *job)
+{
+    X509_STORE_free(job->store);
+    sk_X509_pop_free(job->chain, X509_free);
+    X509_VERIFY_PARAM_free(job->param);
+    job->store  = NULL;
+    job->chain  = NULL;
+    job->param  = NULL;
+}
+
+/*
+ * Called when the SSL is freed. A job still on a worker is left for the
+ * worker to free.
+ */
+static void verify_job_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                            int idx, long argl, void *argp)
+{
+    VERIFY_JOB *job = ptr;
+
+    if (job == NULL)
+        return;
+
+    pthread_mutex_lock(&verify_pool_lock);
+    if (job->state == VERIFY_JOB_BUSY) {
+        job->orphaned = 1;
+        job = NULL;
+    }
+    pthread_mutex_unlock(&verify_pool_lock);
+
+    free(job);
+}
+
+static void async_verify_init(void)
+{
+    async_verify_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    verify_job_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, verify_job_free);
+}
+
+static int async_verify_enabled(SSL_CTX *ctx)
+{
+    return async_verify_idx >= 0
+        && SSL_CTX_get_ex_data(ctx, async_verify_idx) != NULL;
+}
+
+/* Returns the verification job of ssl, creating it if need be. */
+static VERIFY_JOB *verify_job_get(SSL *ssl)
+{
+    VERIFY_JOB *job;
+
+    if (!CRYPTO_THREAD_run_once(&async_verify_once, async_verify_init)
+        || verify_job_idx < 0)
+        return NULL;
+
+    job = SSL_get_ex_data(ssl, verify_job_idx);
+    if (job != NULL)
+        return job;
+
+    job = calloc(1, sizeof(VERIFY_JOB));
+    if (job == NULL)
+        return NULL;
+
+    if (!SSL_set_ex_data(ssl, verify_job_idx, job)) {
+        free(job);
+        return NULL;
+    }
+
+    return job;
+}
+
+/* Verifies a job's chain, as X509_verify_cert() would have inside libssl. */
+static void verify_job_run(VERIFY_JOB *job)
+{
+    X509_STORE_CTX *ctx;
+    time_t now = time(NULL);
+
+    job->ok     = 0;
+    job->error  = X509_V_ERR_UNSPECIFIED;
+
+    ctx = X509_STORE_CTX_new();
+    if (ctx == NULL
+        || !X509_STORE_CTX_init(ctx, job->store, sk_X509_value(job->chain, 0),
+                                job->chain))
+        goto out;
+
+    X509_STORE_CTX_set0_param(ctx, job->param);
+    job->param = NULL;
+
+    job->ok     = X509_verify_cert(ctx);
+    job->error  = X509_STORE_CTX_get_error(ctx);
+    if (job->ok > 0 && job->error == X509_V_OK)
+        job->expires = verify_cache_expiry(ctx, now);
+
+out:
+    X509_STORE_CTX_free(ctx);
+}
+
+static void *verify_worker_main(void *arg)
+{
+    VERIFY_JOB *job;
+    int orphaned;
+
+    for (;;) {
+        pthread_mutex_lock(&verify_pool_lock);
+        while (verify_queue_head == NULL)
+            pthread_cond_wait(&verify_pool_cond, &verify_pool_lock);
+
+        job = verify_queue_head;
+        verify_queue_head = job->next;
+        if (verify_queue_head == NULL)
+            verify_queue_tail = NULL;
+        orphaned = job->orphaned;
+        pthread_mutex_unlock(&verify_pool_lock);
+
+        if (!orphaned)
+            verify_job_run(job);
+        verify_job_release(job);
+
+        pthread_mutex_lock(&verify_pool_lock);
+        orphaned = job->orphaned;
+        if (!orphaned) {
+            job->state = VERIFY_JOB_DONE;
+            if (job->notify != NULL)
+                job->notify(job->notify_arg);
+        }
+        pthread_mutex_unlock(&verify_pool_lock);
+
+        if (orphaned)
+            free(job);
+    }
+
+    return NULL;
+}
+
+/*
+ * Takes what a worker needs to verify the chain of ctx on its own and queues
+ * the job. Returns 0 if it could not, in which case the chain is verified
+ * inline.
+ */
+static int verify_job_submit(VERIFY_JOB *job, X509_STORE_CTX *ctx)
+{
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_untrusted(ctx);
+
+    if (chain == NULL || sk_X509_num(chain) == 0
+        || !X509_STORE_up_ref(X509_STORE_CTX_get0_store(ctx)))
+        return 0;
+
+    job->store  = X509_STORE_CTX_get0_store(ctx);
+    job->chain  = X509_chain_up_ref(chain);
+    job->param  = X509_VERIFY_PARAM_new();
+    if (job->chain == NULL || job->param == NULL
+        || !X509_VERIFY_PARAM_set1(job->param, X509_STORE_CTX_get0_param(ctx))) {
+        verify_job_release(job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&verify_pool_lock);
+    job->state  = VERIFY_JOB_BUSY;
+    job->next   = NULL;
+    if (verify_queue_tail != NULL)
+        verify_queue_tail->next = job;
+    else
+        verify_queue_head = job;
+    verify_queue_tail = job;
+    pthread_cond_signal(&verify_pool_cond);
+    pthread_mutex_unlock(&verify_pool_lock);
+    return 1;
+}
+
+/*
+ * Called by libssl in place of X509_verify_cert() to verify the server's
+ * chain, and again each time the handshake is retried after we suspended it.
+ * Returns 1 if the chain is trusted or the handshake is suspended.
+ */
+static int async_verify_cb(X509_STORE_CTX *ctx, void *arg)
+{
+    SSL *ssl;
+    VERIFY_CACHE *cache = NULL;
+    VERIFY_JOB *job;
+    int state;
+
+    ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    if (ssl == NULL || (job = verify_job_get(ssl)) == NULL)
+        return X509_verify_cert(ctx);
+
+    if (verify_cache_idx >= 0)
+        cache = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), verify_cache_idx);
+
+    /* A finished job goes back to idle under the lock the worker takes. */
+    pthread_mutex_lock(&verify_pool_lock);
+    state = job->state;
+    if (state == VERIFY_JOB_DONE)
+        job->state = VERIFY_JOB_IDLE;
+    pthread_mutex_unlock(&verify_pool_lock);
+
+    switch (state) {
+        case VERIFY_JOB_BUSY:
+            SSL_set_retry_verify(ssl);
+            return 1;
+
+        case VERIFY_JOB_DONE:
+            X509_STORE_CTX_set_error(ctx, job->error);
+            if (cache != NULL && job->have_key && job->ok > 0
+                && job->error == X509_V_OK)
+                verify_cache_add(cache, job->key, job->expires);
+            return job->ok;
+    }
+
+    if (cache != NULL
+        && verify_cache_lookup(cache, ctx, time(NULL), job->key, &job->have_key))
+        return 1;
+
+    if (!verify_job_submit(job, ctx))
+        return X509_verify_cert(ctx);
+
+    SSL_set_retry_verify(ssl);
+    return 1;
+}
+
+/*
+ * The application wants the server chains of connections created from an
+ * SSL_CTX verified on worker threads rather than in tx() and rx(). The workers
+ * are shared by all SSL_CTX; there are as many as the largest num_workers
+ * asked for so far, up to ASYNC_VERIFY_MAX_WORKERS. This must be called before
+ * the first new_conn() on the SSL_CTX.
+ */
+int enable_async_verify(SSL_CTX *ctx, int num_workers)
+{
+    pthread_t thread;
+    int n;
+
+    if (!CRYPTO_THREAD_run_once(&async_verify_once, async_verify_init)
+        || async_verify_idx < 0 || verify_job_idx < 0)
+        return 0;
+
+    pthread_mutex_lock(&verify_pool_lock);
+    while (verify_pool_workers < num_workers
+           && verify_pool_workers < ASYNC_VERIFY_MAX_WORKERS) {
+        if (pthread_create(&thread, NULL, verify_worker_main, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        ++verify_pool_workers;
+    }
+    n = verify_pool_workers;
+    pthread_mutex_unlock(&verify_pool_lock);
+
+    if (n == 0 || !SSL_CTX_set_ex_data(ctx, async_verify_idx, ctx))
+        return 0;
+
+    SSL_CTX_set_cert_verify_callback(ctx, async_verify_cb, NULL);
+    return 1;
+}
+
+/*
+ * The application wants to know when a worker has finished verifying the
+ * server's chain for a connection, so that it can call tx() or rx() again.
+ * notify(arg) is called on the worker's thread with a lock held, so it should
+ * do no more than wake up the application's own thread, and must not call any
+ * of the functions here.
+ */
+int set_conn_verify_notify(APP_CONN *conn, void (*notify)(void *arg),
+                           void *arg)
+{
+    VERIFY_JOB *job = verify_job_get(conn->ssl);
+
+    if (job == NULL)
+        return 0;
+
+    pthread_mutex_lock(&verify_pool_lock);
+    job->notify     = notify;
+    job->notify_arg = arg;
+    pthread_mutex_unlock(&verify_pool_lock);
+    return 1;
+}
+# endif
+
+# ifdef DDD_SSL_POOL
+/*
+ * SSL object pool
+ * ---------------
+ *
+ * SSL_new() copies much of the SSL_CTX's configuration into the new object and
+ * SSL_free() takes it all apart again, which shows with many short-lived
+ * connections. With enable_ssl_pool(), teardown() instead resets the SSL
+ * object of a connection whose handshake completed with SSL_clear() and keeps
+ * it on its SSL_CTX, and new_conn() takes objects from there before making new
+ * ones. The pool holds up to SSL_POOL_MAX objects; anything beyond that, and
+ * connections which did not get through their handshake or, in a demo which
+ * defines DDD_ASYNC_JOBS, waited on asynchronous operations, are freed as
+ * usual.
+ *
+ * SSL_clear() keeps whatever it considers configuration, so the pool also puts
+ * the options and modes back to the SSL_CTX's, drops the session and the BIOs
+ * and forgets the connection's session cache entry and, with DDD_ASYNC_VERIFY,
+ * its verification job. libssl keeps the read buffer across SSL_clear().
+ */
+#define SSL_POOL_MAX    256
+
+typedef struct ssl_pool_st {
+    pthread_mutex_t lock;
+    size_t num;
+    unsigned long num_new, num_reused;
+    SSL *ssl[SSL_POOL_MAX];
+} SSL_POOL;
+
+static int ssl_pool_idx = -1;
+static CRYPTO_ONCE ssl_pool_once = CRYPTO_ONCE_STATIC_INIT;
+
+/*
+ * Called when the SSL_CTX is freed. As every pooled object holds a reference
+ * to its SSL_CTX, the pool is emptied by teardown_ctx() before that can happen.
+ */
+static void ssl_pool_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                          int idx, long argl, void *argp)
+{
+    SSL_POOL *pool = ptr;
+
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static void ssl_pool_init(void)
+{
+    ssl_pool_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, ssl_pool_free);
+}
+
+static SSL_POOL *ssl_pool_get0(SSL_CTX *ctx)
+{
+    return ssl_pool_idx >= 0 ? SSL_CTX_get_ex_data(ctx, ssl_pool_idx) : NULL;
+}
+
+/* Returns a pooled SSL object of ctx, or a new one. */
+static SSL *ssl_pool_take(SSL_CTX *ctx)
+{
+    SSL_POOL *pool = ssl_pool_get0(ctx);
+    SSL *ssl = NULL;
+
+    if (pool != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->num > 0) {
+            ssl = pool->ssl[--pool->num];
+            ++pool->num_reused;
+        } else {
+            ++pool->num_new;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return ssl != NULL ? ssl : SSL_new(ctx);
+}
+
+/*
+ * Resets ssl for another connection and puts it in its SSL_CTX's pool.
+ * Returns 0 if the caller is to free it instead.
+ */
+static int ssl_pool_give(SSL *ssl)
+{
+    SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+    SSL_POOL *pool = ssl_pool_get0(ctx);
+#  ifdef DDD_ASYNC_JOBS
+    size_t num_fds = 0;
+#  endif
+    int ok = 0;
+
+    if (pool == NULL || !SSL_is_init_finished(ssl))
+        return 0;
+
+#  ifdef DDD_ASYNC_JOBS
+    /*
+     * The wait fds of APP_CONN_ASYNC connections outlive SSL_clear(), and
+     * get_conn_async_fds() would never report them to the next connection.
+     * Without a wait context there are none, and the call fails.
+     */
+    if (SSL_get_all_async_fds(ssl, NULL, &num_fds) && num_fds > 0)
+        return 0;
+#  endif
+
+    if (!SSL_clear(ssl))
+        return 0;
+
+    SSL_set_session(ssl, NULL);
+    SSL_set_bio(ssl, NULL, NULL);
+    SSL_clear_options(ssl, ~(uint64_t)0);
+    SSL_set_options(ssl, SSL_CTX_get_options(ctx));
+    SSL_clear_mode(ssl, ~0L);
+    SSL_set_mode(ssl, SSL_CTX_get_mode(ctx));
+
+    if (sess_conn_idx >= 0) {
+        free(SSL_get_ex_data(ssl, sess_conn_idx));
+        SSL_set_ex_data(ssl, sess_conn_idx, NULL);
+    }
+
+#  ifdef DDD_ASYNC_VERIFY
+    if (verify_job_idx >= 0) {
+        verify_job_free(ssl, SSL_get_ex_data(ssl, verify_job_idx), NULL,
+                        verify_job_idx, 0, NULL);
+        SSL_set_ex_data(ssl, verify_job_idx, NULL);
+    }
+#  endif
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->num < SSL_POOL_MAX) {
+        pool->ssl[pool->num++] = ssl;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return ok;
+}
+
+/* Frees the pooled objects of ctx. */
+static void ssl_pool_drain(SSL_CTX *ctx)
+{
+    SSL_POOL *pool = ssl_pool_get0(ctx);
+    SSL *ssl;
+
+    if (pool == NULL)
+        return;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        ssl = pool->num > 0 ? pool->ssl[--pool->num] : NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (ssl == NULL)
+            break;
+        SSL_free(ssl);
+    }
+}
+
+/*
+ * The application wants connections created from an SSL_CTX to reuse the SSL
+ * objects of earlier connections on it. This must be called before the first
+ * new_conn() on the SSL_CTX.
+ */
+int enable_ssl_pool(SSL_CTX *ctx)
+{
+    SSL_POOL *pool;
+
+    if (!CRYPTO_THREAD_run_once(&ssl_pool_once, ssl_pool_init)
+        || ssl_pool_idx < 0)
+        return 0;
+
+    pool = calloc(1, sizeof(SSL_POOL));
+    if (pool == NULL)
+        return 0;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    if (!SSL_CTX_set_ex_data(ctx, ssl_pool_idx, pool)) {
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * The application wants to know how many connections created from an SSL_CTX
+ * got a new SSL object and how many reused a pooled one. Both are 0 without
+ * enable_ssl_pool().
+ */
+void get_ssl_pool_stats(SSL_CTX *ctx, unsigned long *num_new,
+                        unsigned long *num_reused)
+{
+    SSL_POOL *pool = ssl_pool_get0(ctx);
+
+    *num_new = *num_reused = 0;
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    *num_new    = pool->num_new;
+    *num_reused = pool->num_reused;
+    pthread_mutex_unlock(&pool->lock);
+}
+# endif
+
+# ifdef DDD_CONN_CACHE
+/*
+ * Per-thread connection cache
+ * ---------------------------
+ *
+ * Connection churn calls malloc() and free() for every APP_CONN, and with
+ * several event loops those calls contend for the same arenas. With
+ * use_conn_cache(), each thread keeps a free list of the APP_CONN structures
+ * its teardown() calls released, and new_conn() takes from the calling
+ * thread's list first, so neither takes a lock. A structure released on
+ * another thread than the one that made it simply joins the releasing
+ * thread's list. Each list holds up to CONN_CACHE_MAX structures and is freed
+ * when its thread exits.
+ *
+ * Whatever libssl made for the connection is freed with it as usual; with
+ * DDD_CONN_CACHE_BIO_PAIR, a structure can also keep a BIO pair for the demo
+ * to hand to the next connection made from it.
+ */
+#define CONN_CACHE_MAX  1024
+
+typedef struct conn_slot_st {
+    APP_CONN conn;                  /* first, so that an APP_CONN is a slot */
+    struct conn_slot_st *next;
+#  ifdef DDD_CONN_CACHE_BIO_PAIR
+    BIO *internal_bio, *net_bio;    /* a reusable BIO pair, or NULL */
+#  endif
+} CONN_SLOT;
+
+typedef struct conn_cache_st {
+    CONN_SLOT *head;
+    size_t num;
+    int state;                      /* 1 while the thread may cache */
+    unsigned long num_new, num_reused;
+} CONN_CACHE;
+
+static int conn_cache_enabled, conn_cache_key_ok;
+static pthread_key_t conn_cache_key;
+static CRYPTO_ONCE conn_cache_once = CRYPTO_ONCE_STATIC_INIT;
+static __thread CONN_CACHE conn_cache;
+
+static void conn_slot_free(CONN_SLOT *slot)
+{
+#  ifdef DDD_CONN_CACHE_BIO_PAIR
+    BIO_free(slot->internal_bio);
+    BIO_free(slot->net_bio);
+#  endif
+    free(slot);
+}
+
+/* Called when a thread which cached anything exits. */
+static void conn_cache_free(void *arg)
+{
+    CONN_CACHE *cache = arg;
+    CONN_SLOT *slot;
+
+    while ((slot = cache->head) != NULL) {
+        cache->head = slot->next;
+        conn_slot_free(slot);
+    }
+
+    cache->num      = 0;
+    cache->state    = -1;
+}
+
+static void conn_cache_init(void)
+{
+    conn_cache_key_ok = pthread_key_create(&conn_cache_key,
+                                           conn_cache_free) == 0;
+}
+
+/*
+ * Returns the calling thread's cache, or NULL if it may not cache, because
+ * the cache is off, or the thread is exiting, or could not be registered to
+ * free its cache when it does.
+ */
+static CONN_CACHE *conn_cache_get(void)
+{
+    CONN_CACHE *cache = &conn_cache;
+
+    if (!conn_cache_enabled)
+        return NULL;
+
+    if (cache->state == 0) {
+        cache->state = CRYPTO_THREAD_run_once(&conn_cache_once, conn_cache_init)
+                       && conn_cache_key_ok
+                       && pthread_setspecific(conn_cache_key, cache) == 0
+                       ? 1 : -1;
+    }
+
+    return cache->state == 1 ? cache : NULL;
+}
+
+/* Returns a zeroed APP_CONN, from the calling thread's cache if possible. */
+static APP_CONN *conn_alloc(void)
+{
+    CONN_CACHE *cache = conn_cache_get();
+    CONN_SLOT *slot;
+
+    if (cache == NULL || cache->head == NULL) {
+        if (cache != NULL)
+            ++cache->num_new;
+        return calloc(1, sizeof(CONN_SLOT));
+    }
+
+    slot        = cache->head;
+    cache->head = slot->next;
+    --cache->num;
+    ++cache->num_reused;
+
+    memset(&slot->conn, 0, sizeof(slot->conn));
+    return &slot->conn;
+}
+
+/* Returns conn to the calling thread's cache, or frees it. */
+static void conn_release(APP_CONN *conn)
+{
+    CONN_CACHE *cache = conn_cache_get();
+    CONN_SLOT *slot = (CONN_SLOT *)conn;
+
+    if (cache == NULL || cache->num >= CONN_CACHE_MAX) {
+        conn_slot_free(slot);
+        return;
+    }
+
+    slot->next  = cache->head;
+    cache->head = slot;
+    ++cache->num;
+}
+
+/*
+ * The application wants new_conn() and teardown() to recycle connections'
+ * bookkeeping structures through per-thread caches. This must be called
+ * before the first new_conn().
+ */
+void use_conn_cache(void)
+{
+    conn_cache_enabled = 1;
+}
+
+/*
+ * The application wants to know how many connections the calling thread made
+ * with a new structure and how many with a cached one. Both are 0 without
+ * use_conn_cache().
+ */
+void get_conn_cache_stats(unsigned long *num_new, unsigned long *num_reused)
+{
+    *num_new    = conn_cache.num_new;
+    *num_reused = conn_cache.num_reused;
+}
+# endif
+
+#endif
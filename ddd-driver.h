@@ -0,0 +1,2588 @@
+/*
+ * Shared Driver Code
+ * ==================
+ *
+ * Code shared by the example drivers of the demos. Nothing in here talks to
+ * libssl directly; it only uses the functions each demo exposes to the
+ * application (create_ssl_ctx, new_conn, tx, rx, ...), so the demos, with the
+ * code they share in ddd-common.h, remain the complete record of how an
+ * application interacts with libssl. The exceptions are the memory benchmark,
+ * which hooks libcrypto's allocator, and the delayed provider of -D, which
+ * stands in for asynchronous crypto hardware.
+ *
+ * The many-connection driver is only available to the nonblocking demos. Such
+ * a demo defines DRV_REACTOR before including this file and afterwards
+ * defines the drv_conn_* hooks declared below, which adapt its connection
+ * model (who owns the fd, who moves the bytes) to the reactor.
+ *
+ * Every demo also defines the drv_open, drv_send, drv_recv and drv_close
+ * hooks used by the benchmarks, which drive one connection at a time; the
+ * reactor provides them for the nonblocking demos in terms of their
+ * drv_conn_* hooks.
+ */
+#ifndef DDD_DRIVER_H
+# define DDD_DRIVER_H
+
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/signal.h>
+# include <sys/resource.h>
+# include <netdb.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <errno.h>
+# include <string.h>
+# include <stdlib.h>
+# include <time.h>
+# include <sched.h>
+# include <pthread.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+# include <stddef.h>
+# include <stdint.h>
+# include <malloc.h>
+# include <stdatomic.h>
+
+/*
+ * Driver options common to all demos:
+ *
+ *   -h host    Host to connect to (default www.example.com).
+ *   -p port    Port to connect to (default 443).
+ *   -u path    Path to request (default /).
+ *   -C file    Trust the CA certificates in this PEM file instead of the
+ *              system's, e.g. pki/ca.pem from "make pki" when targeting
+ *              ddd-server. This sets SSL_CERT_FILE, which the default verify
+ *              paths loaded by create_ssl_ctx() honour.
+ *   -b file    Trust the CA certificates in this bundle, compiled by
+ *              ddd-cabundle, instead (see use_ca_bundle()).
+ *   -l         Load the CA certificates on a background thread rather than
+ *              in the first create_ssl_ctx() (see use_background_trust_store()).
+ *   -V         Cache the results of chain verification on each SSL_CTX (see
+ *              enable_verify_cache()).
+ *   -k         Offload record encryption and decryption to kernel TLS where
+ *              possible (ddd-03 and ddd-04).
+ *   -m count   Encrypt up to this many records of a large tx() at a time where
+ *              the cipher supports it (see enable_write_pipelining()).
+ *   -Q         Reuse the SSL objects of finished connections for new ones (see
+ *              enable_ssl_pool(); ddd-03, ddd-04 and ddd-05).
+ *   -c         Recycle connection structures, and ddd-05's BIO pairs, through
+ *              per-thread caches (see use_conn_cache(); ddd-02, ddd-04 and
+ *              ddd-05).
+ *   -H count   Run the handshake benchmark (see below) with this many
+ *              connections per phase.
+ *   -B bytes   Run the bulk transfer benchmark (see below) with a payload of
+ *              this size.
+ *   -L count   Run the ping-pong latency benchmark (see below) with this many
+ *              round trips per message size.
+ *   -I conns   Run the idle connection memory benchmark (see below) with this
+ *              many connections.
+ *   -X         Run the startup benchmark (see below).
+ *   -D usecs   Load a provider whose SHA-256 takes this much longer to
+ *              finish, as if offloaded to slow hardware (see below).
+ *
+ * ddd-03 additionally accepts:
+ *
+ *   -f file    PUT the file to the path with tx_file() instead of GETting it.
+ *
+ * Nonblocking demos additionally accept:
+ *
+ *   -n conns   Run the many-connection driver with this many connections.
+ *   -P         Multiplex connections with poll() instead of epoll.
+ *   -t threads Spread the connections over this many event loops, one per
+ *              thread, each pinned to its own CPU.
+ *   -S         Give each event loop its own SSL_CTX shard instead of sharing
+ *              one SSL_CTX between all of them.
+ *   -s         Sweep the number of event loops from 1 up to the -t value.
+ *   -r rounds  Repeat each run this many times. Later rounds on a shared
+ *              SSL_CTX can resume the sessions cached by earlier ones.
+ *   -A workers Verify server chains on this many worker threads instead of
+ *              in the event loops (see enable_async_verify()); not with -U.
+ *   -a         Run libssl in async jobs (APP_CONN_ASYNC), so that the delay of
+ *              -D pauses a connection rather than its event loop (ddd-04 and
+ *              ddd-05 only); not with -P or -U.
+ *   -O workers Run handshakes on this many worker threads instead of in the
+ *              event loops (see enable_handshake_offload(); ddd-05 only); not
+ *              with -U or -a.
+ *   -U         Drive the connections from io_uring instead of epoll (only
+ *              where the demo defines DRV_URING).
+ *   -z         Move data between the network and libssl without copying it
+ *              through an application buffer (ddd-05 only).
+ *   -T         Without -n, do network I/O on a separate thread from tx() and
+ *              rx() (ddd-05 only).
+ *   -R         Free the record and BIO pair buffers of connections while they
+ *              are idle (ddd-05 only).
+ */
+typedef struct drv_opts_st {
+    const char *prog, *hostname, *port, *path, *file, *ca_bundle;
+    size_t num_conns, num_handshakes, num_pingpongs, num_idle;
+    unsigned long long bulk_size;
+    int num_threads, num_rounds, shard, sweep, use_poll, use_uring, zero_copy, split;
+    int ktls, idle_shrink, startup, background_ca, verify_cache, verify_workers;
+    int async, hs_workers, max_pipelines, ssl_pool, conn_cache;
+    unsigned long delay_us;
+} DRV_OPTS;
+
+/* When drv_getopt() was called, for the startup benchmark. */
+static struct timespec drv_start;
+
+/* Parses a byte count with an optional K, M or G suffix. */
+static unsigned long long drv_parse_size(const char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 0);
+
+    switch (*end) {
+        case 'G': case 'g':
+            n <<= 10;
+            /* fall through */
+        case 'M': case 'm':
+            n <<= 10;
+            /* fall through */
+        case 'K': case 'k':
+            n <<= 10;
+    }
+
+    return n;
+}
+
+static int drv_mem_hook(void);
+static int drv_delay_load(unsigned long usecs);
+
+static int drv_getopt(int argc, char **argv, DRV_OPTS *opts)
+{
+    int c;
+
+    clock_gettime(CLOCK_MONOTONIC, &drv_start);
+
+    opts->prog          = strrchr(argv[0], '/') != NULL
+                          ? strrchr(argv[0], '/') + 1 : argv[0];
+    opts->hostname      = "www.example.com";
+    opts->port          = "443";
+    opts->path          = "/";
+    opts->file          = NULL;
+    opts->ca_bundle     = NULL;
+    opts->num_conns     = 0;
+    opts->num_handshakes = 0;
+    opts->bulk_size     = 0;
+    opts->num_pingpongs = 0;
+    opts->num_idle      = 0;
+    opts->num_threads   = 1;
+    opts->num_rounds    = 1;
+    opts->shard         = 0;
+    opts->sweep         = 0;
+    opts->use_poll      = 0;
+    opts->use_uring     = 0;
+    opts->zero_copy     = 0;
+    opts->split         = 0;
+    opts->ktls          = 0;
+    opts->idle_shrink   = 0;
+    opts->startup       = 0;
+    opts->background_ca = 0;
+    opts->verify_cache  = 0;
+    opts->verify_workers = 0;
+    opts->async         = 0;
+    opts->hs_workers    = 0;
+    opts->max_pipelines = 0;
+    opts->ssl_pool      = 0;
+    opts->conn_cache    = 0;
+    opts->delay_us      = 0;
+
+    while ((c = getopt(argc, argv, "h:p:u:C:b:lVf:H:B:L:I:XD:m:Qcn:Pt:r:A:aO:SsUzTkR")) != -1) {
+        switch (c) {
+            case 'h':
+                opts->hostname = optarg;
+                break;
+            case 'p':
+                opts->port = optarg;
+                break;
+            case 'u':
+                opts->path = optarg;
+                break;
+            case 'C':
+                setenv("SSL_CERT_FILE", optarg, 1);
+                break;
+            case 'b':
+                opts->ca_bundle = optarg;
+                break;
+            case 'l':
+                opts->background_ca = 1;
+                break;
+            case 'V':
+                opts->verify_cache = 1;
+                break;
+            case 'f':
+                opts->file = optarg;
+                break;
+            case 'H':
+                opts->num_handshakes = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                opts->bulk_size = drv_parse_size(optarg);
+                break;
+            case 'L':
+                opts->num_pingpongs = strtoul(optarg, NULL, 0);
+                break;
+            case 'I':
+                opts->num_idle = strtoul(optarg, NULL, 0);
+                break;
+            case 'X':
+                opts->startup = 1;
+                break;
+            case 'D':
+                opts->delay_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                opts->max_pipelines = atoi(optarg);
+                break;
+            case 'Q':
+                opts->ssl_pool = 1;
+                break;
+            case 'c':
+                opts->conn_cache = 1;
+                break;
+            case 'n':
+                opts->num_conns = strtoul(optarg, NULL, 0);
+                break;
+            case 'P':
+                opts->use_poll = 1;
+                break;
+            case 't':
+                opts->num_threads = atoi(optarg);
+                if (opts->num_threads < 1)
+                    opts->num_threads = 1;
+                break;
+            case 'r':
+                opts->num_rounds = atoi(optarg);
+                if (opts->num_rounds < 1)
+                    opts->num_rounds = 1;
+                break;
+            case 'A':
+                opts->verify_workers = atoi(optarg);
+                break;
+            case 'a':
+                opts->async = 1;
+                break;
+            case 'O':
+                opts->hs_workers = atoi(optarg);
+                break;
+            case 'S':
+                opts->shard = 1;
+                break;
+            case 's':
+                opts->sweep = 1;
+                break;
+            case 'U':
+                opts->use_uring = 1;
+                break;
+            case 'z':
+                opts->zero_copy = 1;
+                break;
+            case 'T':
+                opts->split = 1;
+                break;
+            case 'k':
+                opts->ktls = 1;
+                break;
+            case 'R':
+                opts->idle_shrink = 1;
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-h host] [-p port] [-u path] [-C cafile | "
+                        "-b bundle] [-l] [-V] [-f file]\n"
+                        "       [-H count] [-B bytes] [-L count] [-I conns] "
+                        "[-X] [-D usecs] [-k] [-m count] [-Q] [-c] [-z] [-R]\n"
+                        "       [-T | -n conns [-P|-U] [-r rounds] "
+                        "[-t threads [-S] [-s]] [-A workers] [-a] [-O workers]]\n", argv[0]);
+                return 0;
+        }
+    }
+
+    /* The hooks must be in place before libcrypto allocates anything. */
+    if (opts->num_idle > 0 && !drv_mem_hook()) {
+        fprintf(stderr, "cannot hook libcrypto's allocator\n");
+        return 0;
+    }
+
+    if (opts->delay_us > 0 && !drv_delay_load(opts->delay_us)) {
+        fprintf(stderr, "cannot load the delayed provider\n");
+        return 0;
+    }
+
+    if (opts->ca_bundle != NULL && !use_ca_bundle(opts->ca_bundle)) {
+        fprintf(stderr, "cannot use CA bundle %s\n", opts->ca_bundle);
+        return 0;
+    }
+
+    if (opts->background_ca)
+        use_background_trust_store();
+
+# ifdef DRV_CONN_CACHE
+    if (opts->conn_cache)
+        use_conn_cache();
+# else
+    if (opts->conn_cache) {
+        fprintf(stderr, "-c is not supported by %s\n", opts->prog);
+        return 0;
+    }
+# endif
+
+    /* Only the epoll and poll reactors know to wait for the workers. */
+    if (opts->verify_workers > 0 && (opts->num_conns == 0 || opts->use_uring)) {
+        fprintf(stderr, "-A needs -n and cannot be used with -U\n");
+        return 0;
+    }
+
+    /* Likewise for the fds of paused async jobs. */
+# ifdef DRV_ASYNC
+    if (opts->async
+        && (opts->num_conns == 0 || opts->use_poll || opts->use_uring)) {
+        fprintf(stderr, "-a needs -n and cannot be used with -P or -U\n");
+        return 0;
+    }
+# else
+    if (opts->async) {
+        fprintf(stderr, "-a is not supported by %s\n", opts->prog);
+        return 0;
+    }
+# endif
+
+# ifndef DRV_SSL_POOL
+    if (opts->ssl_pool) {
+        fprintf(stderr, "-Q is not supported by %s\n", opts->prog);
+        return 0;
+    }
+# endif
+
+# ifdef DRV_OFFLOAD
+    if (opts->hs_workers > 0
+        && (opts->num_conns == 0 || opts->use_uring || opts->async)) {
+        fprintf(stderr, "-O needs -n and cannot be used with -U or -a\n");
+        return 0;
+    }
+# else
+    if (opts->hs_workers > 0) {
+        fprintf(stderr, "-O is not supported by %s\n", opts->prog);
+        return 0;
+    }
+# endif
+
+    return 1;
+}
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/*
+ * The target of a run: where to connect and what to send.
+ */
+typedef struct drv_target_st {
+    const DRV_OPTS *opts;
+    const char *hostname, *port;
+    const struct addrinfo *ai;
+    const char *tx_msg;
+    int tx_len;
+} DRV_TARGET;
+
+/*
+ * Handshake counters kept by an SSL_CTX's session and verification caches and
+ * its SSL object pool.
+ */
+typedef struct drv_ctx_stats_st {
+    unsigned long num_full, num_resumed;
+    unsigned long num_early_accepted, num_early_rejected;
+    unsigned long num_verify_hits, num_verify_misses;
+    unsigned long num_pool_new, num_pool_reused;
+} DRV_CTX_STATS;
+
+/*
+ * Reads the counters of ctx. Demos which send 0-RTT early data define
+ * DRV_EARLY_DATA and get_early_data_stats(), and demos which pool SSL objects
+ * define DRV_SSL_POOL and get_ssl_pool_stats().
+ */
+static void drv_ctx_stats(SSL_CTX *ctx, DRV_CTX_STATS *st)
+{
+    get_sess_cache_stats(ctx, &st->num_full, &st->num_resumed);
+# ifdef DRV_EARLY_DATA
+    get_early_data_stats(ctx, &st->num_early_accepted, &st->num_early_rejected);
+# else
+    st->num_early_accepted = st->num_early_rejected = 0;
+# endif
+    get_verify_cache_stats(ctx, &st->num_verify_hits, &st->num_verify_misses);
+# ifdef DRV_SSL_POOL
+    get_ssl_pool_stats(ctx, &st->num_pool_new, &st->num_pool_reused);
+# else
+    st->num_pool_new = st->num_pool_reused = 0;
+# endif
+}
+
+/* Counters of the calling thread's connection cache. */
+typedef struct drv_cache_stats_st {
+    unsigned long num_new, num_reused, num_bio_reused;
+} DRV_CACHE_STATS;
+
+/*
+ * Reads the counters of the calling thread. Demos which cache connection
+ * structures define DRV_CONN_CACHE and get_conn_cache_stats(), and those
+ * which also cache BIO pairs DRV_CONN_CACHE_BIO_PAIR and
+ * get_conn_bio_pair_stats().
+ */
+static void drv_cache_stats(DRV_CACHE_STATS *cs)
+{
+# ifdef DRV_CONN_CACHE
+    get_conn_cache_stats(&cs->num_new, &cs->num_reused);
+# else
+    cs->num_new = cs->num_reused = 0;
+# endif
+# ifdef DRV_CONN_CACHE_BIO_PAIR
+    get_conn_bio_pair_stats(&cs->num_bio_reused);
+# else
+    cs->num_bio_reused = 0;
+# endif
+}
+
+/* Subtracts the counters read earlier into cs0 from cs. */
+static void drv_cache_stats_since(DRV_CACHE_STATS *cs,
+                                  const DRV_CACHE_STATS *cs0)
+{
+    cs->num_new         -= cs0->num_new;
+    cs->num_reused      -= cs0->num_reused;
+    cs->num_bio_reused  -= cs0->num_bio_reused;
+}
+
+/* Creates an SSL_CTX set up as the options say. */
+static SSL_CTX *drv_create_ctx(const DRV_OPTS *opts)
+{
+    SSL_CTX *ctx = create_ssl_ctx();
+
+    if (ctx != NULL && opts->verify_cache && !enable_verify_cache(ctx)) {
+        teardown_ctx(ctx);
+        return NULL;
+    }
+
+    if (ctx != NULL && opts->max_pipelines > 0
+        && !enable_write_pipelining(ctx, opts->max_pipelines)) {
+        teardown_ctx(ctx);
+        return NULL;
+    }
+
+# ifdef DRV_SSL_POOL
+    if (ctx != NULL && opts->ssl_pool && !enable_ssl_pool(ctx)) {
+        teardown_ctx(ctx);
+        return NULL;
+    }
+# endif
+
+# ifdef DRV_REACTOR
+    if (ctx != NULL && opts->verify_workers > 0
+        && !enable_async_verify(ctx, opts->verify_workers)) {
+        teardown_ctx(ctx);
+        return NULL;
+    }
+# endif
+
+# ifdef DRV_OFFLOAD
+    if (ctx != NULL && opts->hs_workers > 0
+        && !enable_handshake_offload(ctx, opts->hs_workers)) {
+        teardown_ctx(ctx);
+        return NULL;
+    }
+# endif
+
+    return ctx;
+}
+
+/*
+ * Prints the verification cache and SSL object pool counters, if either was
+ * used at all.
+ */
+static void drv_print_ctx_stats(const DRV_CTX_STATS *st)
+{
+    if (st->num_verify_hits + st->num_verify_misses > 0)
+        fprintf(stderr, "; verify cache %lu hits, %lu misses",
+                st->num_verify_hits, st->num_verify_misses);
+    if (st->num_pool_new + st->num_pool_reused > 0)
+        fprintf(stderr, "; SSL pool %lu reused, %lu new",
+                st->num_pool_reused, st->num_pool_new);
+}
+
+/* Prints the connection cache counters, if the cache was used at all. */
+static void drv_print_cache_stats(const DRV_CACHE_STATS *cs)
+{
+    if (cs->num_new + cs->num_reused == 0)
+        return;
+
+    fprintf(stderr, "; conn cache %lu reused, %lu new",
+            cs->num_reused, cs->num_new);
+# ifdef DRV_CONN_CACHE_BIO_PAIR
+    fprintf(stderr, ", %lu BIO pairs reused", cs->num_bio_reused);
+# endif
+}
+
+static double drv_cpu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Single connections
+ * ------------------
+ *
+ * The benchmarks below use one connection at a time, through four hooks which
+ * every demo defines (the reactor below defines them for the nonblocking demos
+ * in terms of their drv_conn_* hooks):
+ *
+ * drv_open makes a connection to the target with new_conn() and returns it, or
+ * NULL. drv_send sends len bytes with tx(), waiting for the network as
+ * necessary, and returns 1 once all of them have been taken or 0 on error.
+ * drv_recv returns up to len bytes received with rx(), waiting as necessary,
+ * or 0 once the connection has ended, be it an error or the peer closing it.
+ * drv_close tears the connection down again.
+ *
+ * Waits for the network outside tx() and rx() are counted in x->waits and
+ * their duration summed in x->wait_time. The blocking demos wait inside tx()
+ * and rx() and never add to either.
+ */
+enum {
+    DRV_TS_START,       /* before new_conn() */
+    DRV_TS_HEADER,      /* tx() has taken t->tx_msg */
+    DRV_TS_SENT,        /* tx() has taken the body as well */
+    DRV_TS_FIRST_BYTE,  /* rx() has returned the first byte of the response */
+    DRV_TS_DONE,        /* the response has ended */
+    DRV_TS_MAX
+};
+
+typedef struct drv_xfer_st {
+    char *buf;
+    size_t buf_len;
+    unsigned long long body_len, tx_bytes, rx_bytes;
+    unsigned long waits;
+    double wait_time;
+    int sample;             /* sample the counters below at each stamp */
+    int cycles_fd;          /* perf_event fd counting CPU cycles, or -1 */
+    struct timespec ts[DRV_TS_MAX];
+    double cpu[DRV_TS_MAX];
+    unsigned long long cycles[DRV_TS_MAX], syscalls[DRV_TS_MAX];
+} DRV_XFER;
+
+typedef struct drv_link_st DRV_LINK;
+
+static DRV_LINK *drv_open(SSL_CTX *ctx, const DRV_TARGET *t);
+static int drv_send(DRV_LINK *lk, const void *buf, int len, DRV_XFER *x);
+static int drv_recv(DRV_LINK *lk, void *buf, int len, DRV_XFER *x);
+static void drv_close(DRV_LINK *lk);
+
+/*
+ * Returns the number of read() and write() family system calls the process has
+ * made so far, or 0 if the kernel does not keep count.
+ */
+static unsigned long long drv_syscalls_now(void)
+{
+    char buf[512], *p;
+    unsigned long long n = 0;
+    int fd, l;
+
+    fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    l = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (l <= 0)
+        return 0;
+
+    buf[l] = '\0';
+    if ((p = strstr(buf, "syscr:")) != NULL)
+        n += strtoull(p + 6, NULL, 10);
+    if ((p = strstr(buf, "syscw:")) != NULL)
+        n += strtoull(p + 6, NULL, 10);
+    return n;
+}
+
+static unsigned long long drv_cycles_now(int fd)
+{
+    unsigned long long n = 0;
+
+    if (fd >= 0 && read(fd, &n, sizeof(n)) != sizeof(n))
+        n = 0;
+    return n;
+}
+
+static void drv_stamp(DRV_XFER *x, int i)
+{
+    clock_gettime(CLOCK_MONOTONIC, &x->ts[i]);
+    if (!x->sample)
+        return;
+
+    x->cpu[i]       = drv_cpu_now();
+    x->cycles[i]    = drv_cycles_now(x->cycles_fd);
+    x->syscalls[i]  = drv_syscalls_now() + x->waits;
+}
+
+/*
+ * Makes one connection to the target, sends t->tx_msg followed by x->body_len
+ * bytes of body from x->buf, reads the response into x->buf until the peer
+ * closes the connection and tears the connection down again, calling drv_stamp
+ * at each of the points above. Both tx() and rx() are called with at most
+ * x->buf_len bytes at a time. Returns 1 on success.
+ */
+static int drv_once(SSL_CTX *ctx, const DRV_TARGET *t, DRV_XFER *x)
+{
+    DRV_LINK *lk;
+    int n, ok = 0;
+
+    x->tx_bytes     = x->rx_bytes = 0;
+    x->waits        = 0;
+    x->wait_time    = 0;
+
+    drv_stamp(x, DRV_TS_START);
+    lk = drv_open(ctx, t);
+    if (lk == NULL)
+        return 0;
+
+    if (!drv_send(lk, t->tx_msg, t->tx_len, x))
+        goto out;
+    drv_stamp(x, DRV_TS_HEADER);
+
+    while (x->tx_bytes < x->body_len) {
+        n = x->body_len - x->tx_bytes < x->buf_len
+            ? (int)(x->body_len - x->tx_bytes) : (int)x->buf_len;
+        if (!drv_send(lk, x->buf, n, x))
+            goto out;
+        x->tx_bytes += n;
+    }
+    drv_stamp(x, DRV_TS_SENT);
+
+    while ((n = drv_recv(lk, x->buf, x->buf_len, x)) > 0) {
+        if (x->rx_bytes == 0)
+            drv_stamp(x, DRV_TS_FIRST_BYTE);
+        x->rx_bytes += n;
+    }
+    drv_stamp(x, DRV_TS_DONE);
+
+    /* The response ends when the peer closes the connection. */
+    ok = x->rx_bytes > 0;
+out:
+    drv_close(lk);
+    return ok;
+}
+
+/*
+ * Handshake benchmark
+ * -------------------
+ *
+ * With -H count, the driver makes count connections one after the other
+ * instead, each a complete create_ssl_ctx()/new_conn()/tx()/rx()/teardown()/
+ * teardown_ctx() cycle, and then count more through one SSL_CTX whose session
+ * cache was warmed up by an extra connection, so that they resume. For each
+ * phase it reports handshakes/s, CPU time per handshake and latency
+ * percentiles measured from the start of new_conn() to tx() accepting the
+ * request, to the first byte of the response and to its end. Request a small
+ * path so that the exchange is dominated by the handshake. Note that with
+ * 0-RTT, tx() returns before the handshake is complete.
+ */
+static int drv_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double drv_percentile(const double *v, size_t n, double q)
+{
+    size_t i = (size_t)(q * n);
+
+    return v[i < n ? i : n - 1];
+}
+
+/*
+ * Runs one phase of the handshake benchmark. If ctx is NULL, every connection
+ * gets an SSL_CTX of its own.
+ */
+static int drv_bench_phase(SSL_CTX *ctx, const DRV_TARGET *t, size_t count,
+                           const char *name)
+{
+    static const int points[] = {
+        DRV_TS_SENT, DRV_TS_FIRST_BYTE, DRV_TS_DONE
+    };
+    static const char *const labels[] = {
+        "tx", "first byte", "total"
+    };
+    DRV_XFER x = {0};
+    DRV_CTX_STATS st0 = {0}, st = {0}, st1;
+    DRV_CACHE_STATS cs0, cs;
+    struct timespec t0, t1;
+    double *lat[3] = {NULL}, cpu0, cpu_ctx = 0, c, wall;
+    size_t i, n = 0, num_failed = 0;
+    SSL_CTX *own;
+    int j, ok, res = 0;
+    char buf[16384];
+
+    x.buf       = buf;
+    x.buf_len   = sizeof(buf);
+
+    for (j = 0; j < 3; ++j) {
+        lat[j] = malloc(count * sizeof(double));
+        if (lat[j] == NULL)
+            goto out;
+    }
+
+    if (ctx != NULL)
+        drv_ctx_stats(ctx, &st0);
+    drv_cache_stats(&cs0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    cpu0 = drv_cpu_now();
+
+    for (i = 0; i < count; ++i) {
+        own = ctx;
+        if (ctx == NULL) {
+            c = drv_cpu_now();
+            own = drv_create_ctx(t->opts);
+            cpu_ctx += drv_cpu_now() - c;
+            if (own == NULL) {
+                fprintf(stderr, "cannot create SSL context\n");
+                goto out;
+            }
+        }
+
+        ok = drv_once(own, t, &x);
+
+        if (ctx == NULL) {
+            drv_ctx_stats(own, &st1);
+            st.num_full             += st1.num_full;
+            st.num_resumed          += st1.num_resumed;
+            st.num_early_accepted   += st1.num_early_accepted;
+            st.num_early_rejected   += st1.num_early_rejected;
+            st.num_verify_hits      += st1.num_verify_hits;
+            st.num_verify_misses    += st1.num_verify_misses;
+            st.num_pool_new         += st1.num_pool_new;
+            st.num_pool_reused      += st1.num_pool_reused;
+
+            c = drv_cpu_now();
+            teardown_ctx(own);
+            cpu_ctx += drv_cpu_now() - c;
+        }
+
+        if (!ok) {
+            ++num_failed;
+            continue;
+        }
+
+        for (j = 0; j < 3; ++j)
+            lat[j][n] = timespec_diff(&x.ts[DRV_TS_START], &x.ts[points[j]]);
+        ++n;
+    }
+
+    c = drv_cpu_now() - cpu0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    wall = timespec_diff(&t0, &t1);
+
+    if (ctx != NULL) {
+        drv_ctx_stats(ctx, &st);
+        st.num_full             -= st0.num_full;
+        st.num_resumed          -= st0.num_resumed;
+        st.num_early_accepted   -= st0.num_early_accepted;
+        st.num_early_rejected   -= st0.num_early_rejected;
+        st.num_verify_hits      -= st0.num_verify_hits;
+        st.num_verify_misses    -= st0.num_verify_misses;
+        st.num_pool_new         -= st0.num_pool_new;
+        st.num_pool_reused      -= st0.num_pool_reused;
+    }
+
+    drv_cache_stats(&cs);
+    drv_cache_stats_since(&cs, &cs0);
+
+    fprintf(stderr,
+            "%s: %zu handshakes (%lu full, %lu resumed, %zu failed) in %.3f s; "
+            "%.0f handshakes/s, %.1f us CPU/handshake",
+            name, count, st.num_full, st.num_resumed, num_failed, wall,
+            n / wall, (c - cpu_ctx) * 1e6 / count);
+    if (ctx == NULL)
+        fprintf(stderr, " + %.1f us create_ssl_ctx/teardown_ctx",
+                cpu_ctx * 1e6 / count);
+    if (st.num_early_accepted + st.num_early_rejected > 0)
+        fprintf(stderr, "; 0-RTT %lu accepted, %lu rejected",
+                st.num_early_accepted, st.num_early_rejected);
+    drv_print_ctx_stats(&st);
+    drv_print_cache_stats(&cs);
+    fprintf(stderr, "\n");
+
+    if (n > 0) {
+        fprintf(stderr, "  %-12s %10s %10s %10s\n",
+                "latency/us", "p50", "p99", "p99.9");
+        for (j = 0; j < 3; ++j) {
+            qsort(lat[j], n, sizeof(double), drv_cmp_double);
+            fprintf(stderr, "  %-12s %10.1f %10.1f %10.1f\n", labels[j],
+                    drv_percentile(lat[j], n, 0.5) * 1e6,
+                    drv_percentile(lat[j], n, 0.99) * 1e6,
+                    drv_percentile(lat[j], n, 0.999) * 1e6);
+        }
+    }
+
+    res = (num_failed == 0);
+out:
+    for (j = 0; j < 3; ++j)
+        free(lat[j]);
+    return res;
+}
+
+/*
+ * Runs the handshake benchmark: count full handshakes, then count resumed ones
+ * on ctx.
+ */
+static int drv_bench_handshake(SSL_CTX *ctx, const DRV_TARGET *t,
+                               size_t count)
+{
+    DRV_XFER x = {0};
+    char buf[16384];
+    int res;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    res = drv_bench_phase(NULL, t, count, "full");
+
+    x.buf       = buf;
+    x.buf_len   = sizeof(buf);
+    if (!drv_once(ctx, t, &x)) {
+        fprintf(stderr, "warm-up connection failed\n");
+        return 0;
+    }
+
+    return drv_bench_phase(ctx, t, count, "resumed") && res;
+}
+
+/*
+ * Bulk transfer benchmark
+ * -----------------------
+ *
+ * With -B bytes, the driver streams a payload of that size through rx(), by
+ * GETting it, and through tx(), by PUTting it, once for each application
+ * buffer size from 1 KiB to 1 MiB, i.e. the most bytes passed to tx() or rx()
+ * at a time. Sizes may be given with a K, M or G suffix. For each run it
+ * reports MB/s, CPU cycles and CPU time per byte and system calls per MB,
+ * counting only the transfer itself and not the handshake before it. Cycles
+ * come from the CPU's performance counters where perf_event_open() allows it,
+ * kernel time included if permitted. System calls are the read() and write()
+ * family calls counted in /proc/self/io plus the driver's waits, so libssl's
+ * and the driver's socket I/O is counted but kTLS's sendmsg()/recvmsg() is not.
+ */
+# define DRV_BULK_MIN_BUF   1024
+# define DRV_BULK_MAX_BUF   (1024 * 1024)
+
+/*
+ * Opens a counter of the CPU cycles spent by this process, in the kernel as
+ * well if allowed. Returns -1 if there is no such counter.
+ */
+static int drv_open_cycles(int *user_only)
+{
+    struct perf_event_attr attr = {0};
+    int fd;
+
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv     = 1;
+    attr.inherit        = 1;
+
+    *user_only = 0;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        attr.exclude_kernel = 1;
+        *user_only          = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    return fd;
+}
+
+static void drv_bulk_report(const char *dir, const DRV_XFER *x, int from,
+                            int to, unsigned long long bytes, int syscalls)
+{
+    double wall, mb;
+
+    wall    = timespec_diff(&x->ts[from], &x->ts[to]);
+    mb      = bytes / 1e6;
+
+    fprintf(stderr, "  %-4s %8zu %10.2f", dir, x->buf_len,
+            wall > 0 ? mb / wall : 0);
+    if (x->cycles_fd >= 0)
+        fprintf(stderr, " %10.2f",
+                (double)(x->cycles[to] - x->cycles[from]) / bytes);
+    else
+        fprintf(stderr, " %10s", "-");
+    fprintf(stderr, " %10.3f", (x->cpu[to] - x->cpu[from]) * 1e9 / bytes);
+    if (syscalls)
+        fprintf(stderr, " %12.1f\n", (x->syscalls[to] - x->syscalls[from]) / mb);
+    else
+        fprintf(stderr, " %12s\n", "-");
+}
+
+/*
+ * Runs the bulk transfer benchmark with a payload of size bytes on ctx.
+ */
+static int drv_bench_bulk(SSL_CTX *ctx, const DRV_TARGET *t,
+                          unsigned long long size)
+{
+    DRV_TARGET bt = *t;
+    DRV_XFER x = {0};
+    char get[512], put[512];
+    int user_only, syscalls, res = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    x.buf = malloc(DRV_BULK_MAX_BUF);
+    if (x.buf == NULL)
+        return 0;
+
+    /* The body's content does not matter, but untouched pages would. */
+    memset(x.buf, 'x', DRV_BULK_MAX_BUF);
+
+    x.sample    = 1;
+    x.cycles_fd = drv_open_cycles(&user_only);
+    syscalls    = drv_syscalls_now() > 0;
+
+    snprintf(get, sizeof(get), "GET /%llu HTTP/1.0\r\nHost: %s\r\n\r\n",
+             size, t->hostname);
+    snprintf(put, sizeof(put),
+             "PUT /0 HTTP/1.0\r\nHost: %s\r\nContent-Length: %llu\r\n\r\n",
+             t->hostname, size);
+
+    fprintf(stderr, "bulk: %llu bytes\n  %-4s %8s %10s %10s %10s %12s\n",
+            size, "dir", "buf", "MB/s",
+            x.cycles_fd < 0 ? "cycles/B" : user_only ? "ucycles/B" : "cycles/B",
+            "ns CPU/B", "syscalls/MB");
+
+    for (x.buf_len = DRV_BULK_MIN_BUF; x.buf_len <= DRV_BULK_MAX_BUF;
+         x.buf_len <<= 2) {
+        /* Download: from the request being sent to the end of the response. */
+        bt.tx_msg   = get;
+        bt.tx_len   = strlen(get);
+        x.body_len  = 0;
+        if (drv_once(ctx, &bt, &x) && x.rx_bytes >= size) {
+            drv_bulk_report("rx", &x, DRV_TS_SENT, DRV_TS_DONE, x.rx_bytes,
+                            syscalls);
+        } else {
+            fprintf(stderr, "  rx   %8zu failed\n", x.buf_len);
+            res = 0;
+        }
+
+        /* Upload: from the request header being sent to the end of the body. */
+        bt.tx_msg   = put;
+        bt.tx_len   = strlen(put);
+        x.body_len  = size;
+        if (drv_once(ctx, &bt, &x) && x.tx_bytes == size) {
+            drv_bulk_report("tx", &x, DRV_TS_HEADER, DRV_TS_SENT, x.tx_bytes,
+                            syscalls);
+        } else {
+            fprintf(stderr, "  tx   %8zu failed\n", x.buf_len);
+            res = 0;
+        }
+    }
+
+    if (x.cycles_fd >= 0)
+        close(x.cycles_fd);
+    free(x.buf);
+    return res;
+}
+
+/*
+ * Ping-pong latency benchmark
+ * ---------------------------
+ *
+ * With -L count, the driver opens one connection for each message size from
+ * 16 B to 16 KiB, asks ddd-server to echo everything back (an ECHO request)
+ * and times count round trips over it, after a few untimed ones: drv_send() of
+ * one message, then drv_recv() until all of it is back. The latency of each
+ * round trip, the part of it spent waiting in poll() and the rest, spent in
+ * tx(), rx() and moving data to and from the socket, go into HDR histograms
+ * whose percentiles are written to stdout as one line of JSON. The blocking
+ * demos wait inside tx() and rx(), so all of their time counts as the latter.
+ */
+# define DRV_PINGPONG_WARMUP    100
+# define DRV_PINGPONG_MIN_MSG   16
+# define DRV_PINGPONG_MAX_MSG   16384
+
+/*
+ * A histogram of nanosecond values with logarithmic buckets, each split into
+ * DRV_HIST_SUB linear sub-buckets, so that values are recorded with a relative
+ * error below 2 / DRV_HIST_SUB in constant time and space.
+ */
+# define DRV_HIST_SUB_BITS  8
+# define DRV_HIST_SUB       (1 << DRV_HIST_SUB_BITS)
+# define DRV_HIST_SLOTS     ((64 - DRV_HIST_SUB_BITS + 2) * (DRV_HIST_SUB / 2))
+
+typedef struct drv_hist_st {
+    unsigned long long count, min, max, sum;
+    unsigned long long slots[DRV_HIST_SLOTS];
+} DRV_HIST;
+
+static size_t drv_hist_slot(unsigned long long v)
+{
+    int msb;
+
+    if (v < DRV_HIST_SUB)
+        return v;
+
+    msb = 63 - __builtin_clzll(v);
+    return (size_t)(msb - DRV_HIST_SUB_BITS + 2) * (DRV_HIST_SUB / 2)
+         + ((v >> (msb - DRV_HIST_SUB_BITS + 1)) - DRV_HIST_SUB / 2);
+}
+
+/* Returns the highest value which would be recorded in slot i. */
+static unsigned long long drv_hist_value(size_t i)
+{
+    size_t k = i / (DRV_HIST_SUB / 2);
+    int shift;
+
+    if (i < DRV_HIST_SUB)
+        return i;
+
+    shift = k - 1;
+    return ((i % (DRV_HIST_SUB / 2) + DRV_HIST_SUB / 2 + 1ULL) << shift) - 1;
+}
+
+static void drv_hist_record(DRV_HIST *h, unsigned long long v)
+{
+    if (h->count == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    ++h->count;
+    h->sum += v;
+    ++h->slots[drv_hist_slot(v)];
+}
+
+# ifdef DRV_REACTOR
+/* Adds the values recorded in src to dst, for merging event loops. */
+static void drv_hist_add(DRV_HIST *dst, const DRV_HIST *src)
+{
+    size_t i;
+
+    if (src->count == 0)
+        return;
+
+    if (dst->count == 0 || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count  += src->count;
+    dst->sum    += src->sum;
+    for (i = 0; i < DRV_HIST_SLOTS; ++i)
+        dst->slots[i] += src->slots[i];
+}
+# endif
+
+static unsigned long long drv_hist_percentile(const DRV_HIST *h, double q)
+{
+    unsigned long long want, seen = 0;
+    size_t i;
+
+    want = (unsigned long long)(q / 100 * h->count + 0.5);
+    if (want == 0)
+        want = 1;
+
+    for (i = 0; i < DRV_HIST_SLOTS; ++i) {
+        seen += h->slots[i];
+        if (seen >= want)
+            return drv_hist_value(i) < h->max ? drv_hist_value(i) : h->max;
+    }
+
+    return h->max;
+}
+
+static void drv_hist_json(FILE *f, const char *name, const DRV_HIST *h)
+{
+    static const double q[] = { 50, 90, 99, 99.9, 99.99 };
+    size_t i;
+
+    fprintf(f, "\"%s\":{\"count\":%llu,\"min\":%llu,\"mean\":%.0f", name,
+            h->count, h->min, h->count > 0 ? (double)h->sum / h->count : 0.0);
+    for (i = 0; i < sizeof(q) / sizeof(q[0]); ++i)
+        fprintf(f, ",\"p%g\":%llu", q[i], drv_hist_percentile(h, q[i]));
+    fprintf(f, ",\"max\":%llu}", h->max);
+}
+
+static unsigned long long drv_ns(double s)
+{
+    return (unsigned long long)(s * 1e9 + 0.5);
+}
+
+/*
+ * Times count round trips of len-byte messages over one connection.
+ */
+static int drv_pingpong(SSL_CTX *ctx, const DRV_TARGET *t, size_t count,
+                        int len, DRV_HIST *rtt, DRV_HIST *wait,
+                        DRV_HIST *call)
+{
+    static const char req[] = "ECHO / HTTP/1.0\r\n\r\n";
+    DRV_XFER x = {0};
+    DRV_LINK *lk;
+    struct timespec t0, t1;
+    char msg[DRV_PINGPONG_MAX_MSG], buf[DRV_PINGPONG_MAX_MSG];
+    double total;
+    size_t i;
+    int l, got, ok = 0;
+
+    memset(msg, 'x', len);
+
+    lk = drv_open(ctx, t);
+    if (lk == NULL)
+        return 0;
+
+    if (!drv_send(lk, req, sizeof(req) - 1, &x))
+        goto out;
+
+    for (i = 0; i < DRV_PINGPONG_WARMUP + count; ++i) {
+        x.wait_time = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        if (!drv_send(lk, msg, len, &x))
+            goto out;
+        for (got = 0; got < len; got += l)
+            if ((l = drv_recv(lk, buf, len - got, &x)) == 0)
+                goto out;
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (i < DRV_PINGPONG_WARMUP)
+            continue;
+
+        total = timespec_diff(&t0, &t1);
+        drv_hist_record(rtt, drv_ns(total));
+        drv_hist_record(wait, drv_ns(x.wait_time));
+        drv_hist_record(call, drv_ns(total - x.wait_time));
+    }
+
+    ok = 1;
+out:
+    drv_close(lk);
+    return ok;
+}
+
+/*
+ * Runs the ping-pong latency benchmark with count round trips per message
+ * size.
+ */
+static int drv_bench_pingpong(SSL_CTX *ctx, const DRV_TARGET *t, size_t count)
+{
+    DRV_HIST *h;
+    int len, res = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    h = malloc(3 * sizeof(DRV_HIST));
+    if (h == NULL)
+        return 0;
+
+    printf("{\"model\":\"%s\",\"iterations\":%zu,\"unit\":\"ns\",\"results\":[",
+           t->opts->prog, count);
+
+    for (len = DRV_PINGPONG_MIN_MSG; len <= DRV_PINGPONG_MAX_MSG; len <<= 2) {
+        memset(h, 0, 3 * sizeof(DRV_HIST));
+        if (!drv_pingpong(ctx, t, count, len, &h[0], &h[1], &h[2])) {
+            fprintf(stderr, "ping-pong with %d-byte messages failed\n", len);
+            res = 0;
+            break;
+        }
+
+        printf("%s{\"size\":%d,", len == DRV_PINGPONG_MIN_MSG ? "" : ",", len);
+        drv_hist_json(stdout, "rtt", &h[0]);
+        printf(",");
+        drv_hist_json(stdout, "poll", &h[1]);
+        printf(",");
+        drv_hist_json(stdout, "call", &h[2]);
+        printf("}");
+    }
+
+    printf("]}\n");
+    free(h);
+    return res;
+}
+
+/*
+ * Idle connection memory benchmark
+ * --------------------------------
+ *
+ * With -I conns, the driver opens that many connections, switches each to
+ * ddd-server's echo service and exchanges one small message over it, so that
+ * the handshake and the session tickets following it are dealt with, and then
+ * holds them all open and idle. What each connection occupies while idle is
+ * measured as what closing them all frees again, so that sessions kept by the
+ * SSL_CTX's cache are not counted against the connections.
+ *
+ * drv_mem_hook() replaces libcrypto's allocator so that every byte libssl and
+ * libcrypto allocate is counted exactly, and attributed to a component by the
+ * OpenSSL source file asking for it. The application's own allocations
+ * (APP_CONN, the session cache's per-connection key, the driver's state) do not
+ * go through the hooks: sizeof(APP_CONN) is shown for the demos which have one,
+ * and malloc's own count of bytes in use, its overhead included, and the growth
+ * of the resident set while opening the connections are shown alongside.
+ * Kernel socket buffers are in none of them.
+ */
+enum {
+    DRV_MEM_SSL,        /* the SSL object, its session, and the rest of libssl */
+    DRV_MEM_RECORD,     /* the record layer's read and write buffers */
+    DRV_MEM_BIO_PAIR,   /* the buffers of BIO_new_bio_pair() */
+    DRV_MEM_X509,       /* certificates and other ASN.1 objects */
+    DRV_MEM_CRYPTO,     /* the rest: keys, cipher contexts, BIOs, ... */
+    DRV_MEM_MAX
+};
+
+static const char *const drv_mem_names[DRV_MEM_MAX] = {
+    "SSL object", "record buffers", "BIO pair", "certificates",
+    "other libcrypto"
+};
+
+static atomic_llong drv_mem_bytes[DRV_MEM_MAX], drv_mem_allocs[DRV_MEM_MAX];
+
+/* Each block is preceded by its size and the component it is counted under. */
+typedef union drv_mem_hdr_un {
+    struct {
+        size_t size;
+        int comp;
+    } h;
+    max_align_t align;
+} DRV_MEM_HDR;
+
+/* Maps the source file an allocation comes from to a component. */
+static int drv_mem_comp(const char *file)
+{
+    if (file == NULL)
+        return DRV_MEM_CRYPTO;
+
+    while (strncmp(file, "../", 3) == 0)
+        file += 3;
+
+    if (strncmp(file, "ssl/record/", 11) == 0)
+        return DRV_MEM_RECORD;
+    if (strncmp(file, "ssl/", 4) == 0)
+        return DRV_MEM_SSL;
+    if (strcmp(file, "crypto/bio/bss_bio.c") == 0)
+        return DRV_MEM_BIO_PAIR;
+    if (strncmp(file, "crypto/x509/", 12) == 0
+        || strncmp(file, "crypto/asn1/", 12) == 0)
+        return DRV_MEM_X509;
+    return DRV_MEM_CRYPTO;
+}
+
+static void drv_mem_count(const DRV_MEM_HDR *hdr, long long sign)
+{
+    atomic_fetch_add_explicit(&drv_mem_bytes[hdr->h.comp],
+                              sign * (long long)hdr->h.size,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&drv_mem_allocs[hdr->h.comp], sign,
+                              memory_order_relaxed);
+}
+
+static void *drv_mem_malloc(size_t num, const char *file, int line)
+{
+    DRV_MEM_HDR *hdr;
+
+    if (num > SIZE_MAX - sizeof(*hdr))
+        return NULL;
+
+    hdr = malloc(sizeof(*hdr) + num);
+    if (hdr == NULL)
+        return NULL;
+
+    hdr->h.size = num;
+    hdr->h.comp = drv_mem_comp(file);
+    drv_mem_count(hdr, 1);
+    return hdr + 1;
+}
+
+static void drv_mem_free(void *ptr, const char *file, int line)
+{
+    DRV_MEM_HDR *hdr;
+
+    if (ptr == NULL)
+        return;
+
+    hdr = (DRV_MEM_HDR *)ptr - 1;
+    drv_mem_count(hdr, -1);
+    free(hdr);
+}
+
+/* A block keeps the component it was first allocated under. */
+static void *drv_mem_realloc(void *ptr, size_t num, const char *file, int line)
+{
+    DRV_MEM_HDR *hdr, *old;
+
+    if (ptr == NULL)
+        return drv_mem_malloc(num, file, line);
+
+    if (num == 0) {
+        drv_mem_free(ptr, file, line);
+        return NULL;
+    }
+
+    if (num > SIZE_MAX - sizeof(*hdr))
+        return NULL;
+
+    old = (DRV_MEM_HDR *)ptr - 1;
+    drv_mem_count(old, -1);
+    hdr = realloc(old, sizeof(*hdr) + num);
+    if (hdr == NULL) {
+        drv_mem_count(old, 1);
+        return NULL;
+    }
+
+    hdr->h.size = num;
+    drv_mem_count(hdr, 1);
+    return hdr + 1;
+}
+
+/*
+ * Installs the counting allocator. This fails once libcrypto has allocated
+ * anything, so drv_getopt() calls it before the demo gets going.
+ */
+static int drv_mem_hook(void)
+{
+    return CRYPTO_set_mem_functions(drv_mem_malloc, drv_mem_realloc,
+                                    drv_mem_free);
+}
+
+typedef struct drv_mem_snap_st {
+    long long bytes[DRV_MEM_MAX], allocs[DRV_MEM_MAX];
+    long long heap, rss;
+} DRV_MEM_SNAP;
+
+static void drv_mem_snap(DRV_MEM_SNAP *s)
+{
+    struct mallinfo2 mi = mallinfo2();
+    long pages = 0;
+    FILE *f;
+    int i;
+
+    for (i = 0; i < DRV_MEM_MAX; ++i) {
+        s->bytes[i]     = atomic_load(&drv_mem_bytes[i]);
+        s->allocs[i]    = atomic_load(&drv_mem_allocs[i]);
+    }
+
+    s->heap = mi.uordblks + mi.hblkhd;
+
+    f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose(f);
+    }
+    s->rss = pages * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Opens a connection, switches it to echoing and has one message echoed, after
+ * which it is left idle.
+ */
+static DRV_LINK *drv_idle_open(SSL_CTX *ctx, const DRV_TARGET *t)
+{
+    static const char req[] = "ECHO / HTTP/1.0\r\n\r\n";
+    DRV_XFER x = {0};
+    DRV_LINK *lk;
+    char msg[16], buf[16];
+    int l, got;
+
+    memset(msg, 'x', sizeof(msg));
+
+    lk = drv_open(ctx, t);
+    if (lk == NULL)
+        return NULL;
+
+    if (!drv_send(lk, req, sizeof(req) - 1, &x)
+        || !drv_send(lk, msg, sizeof(msg), &x))
+        goto fail;
+
+    for (got = 0; got < (int)sizeof(msg); got += l)
+        if ((l = drv_recv(lk, buf, sizeof(msg) - got, &x)) == 0)
+            goto fail;
+
+    return lk;
+
+fail:
+    drv_close(lk);
+    return NULL;
+}
+
+static void drv_idle_report(const char *name, double bytes, double allocs)
+{
+    fprintf(stderr, "  %-20s %10.0f", name, bytes);
+    if (allocs >= 0)
+        fprintf(stderr, " %8.1f\n", allocs);
+    else
+        fprintf(stderr, " %8s\n", "-");
+}
+
+/*
+ * Runs the idle connection memory benchmark with count connections on ctx.
+ */
+static int drv_bench_idle(SSL_CTX *ctx, const DRV_TARGET *t, size_t count)
+{
+    DRV_LINK *lk, **links;
+    DRV_MEM_SNAP s0, s1, s2;
+    DRV_CTX_STATS st0, st;
+    struct rlimit rl;
+    long long bytes = 0, allocs = 0;
+    size_t i, n = 0;
+    int j;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Each connection needs an fd, so raise the soft limit as far as we can. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    links = calloc(count, sizeof(DRV_LINK *));
+    if (links == NULL)
+        return 0;
+
+    /* Leave libcrypto's lazy initialisation out of the resident set growth. */
+    lk = drv_idle_open(ctx, t);
+    if (lk == NULL) {
+        fprintf(stderr, "warm-up connection failed\n");
+        free(links);
+        return 0;
+    }
+    drv_close(lk);
+
+    drv_ctx_stats(ctx, &st0);
+    drv_mem_snap(&s0);
+
+    for (i = 0; i < count; ++i)
+        if ((links[n] = drv_idle_open(ctx, t)) != NULL)
+            ++n;
+
+    drv_mem_snap(&s1);
+    drv_ctx_stats(ctx, &st);
+
+    for (i = 0; i < n; ++i)
+        drv_close(links[i]);
+    free(links);
+
+    drv_mem_snap(&s2);
+
+    fprintf(stderr, "%s: %zu idle connections (%lu full, %lu resumed, "
+            "%zu failed)\n", t->opts->prog, n,
+            st.num_full - st0.num_full, st.num_resumed - st0.num_resumed,
+            count - n);
+    if (n == 0)
+        return 0;
+
+    fprintf(stderr, "  %-20s %10s %8s\n", "per connection", "bytes", "allocs");
+# ifdef DRV_REACTOR
+    drv_idle_report("APP_CONN", sizeof(APP_CONN), 1);
+# endif
+    for (j = 0; j < DRV_MEM_MAX; ++j) {
+        drv_idle_report(drv_mem_names[j],
+                        (double)(s1.bytes[j] - s2.bytes[j]) / n,
+                        (double)(s1.allocs[j] - s2.allocs[j]) / n);
+        bytes   += s1.bytes[j] - s2.bytes[j];
+        allocs  += s1.allocs[j] - s2.allocs[j];
+    }
+    drv_idle_report("libssl+libcrypto", (double)bytes / n, (double)allocs / n);
+    drv_idle_report("malloc in use", (double)(s1.heap - s2.heap) / n, -1);
+    drv_idle_report("resident set growth", (double)(s1.rss - s0.rss) / n, -1);
+
+    return count == n;
+}
+
+/*
+ * Startup benchmark
+ * -----------------
+ *
+ * With -X, the driver makes one connection and reports how long after the
+ * start of main() (strictly, of drv_getopt()) the SSL_CTX was ready and the
+ * connection, verification of the server's chain included, was complete, and
+ * how much CPU time and heap the process had used by then. Each run is one
+ * process start, so compare the default PEM path (-C file) with a compiled
+ * bundle (-b file) over several runs; "make bench-startup" does that.
+ */
+static int drv_bench_startup(SSL_CTX *ctx, const DRV_TARGET *t)
+{
+    DRV_XFER x = {0};
+    struct timespec t0, t1;
+    struct mallinfo2 mi;
+    char buf[16384];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    x.buf       = buf;
+    x.buf_len   = sizeof(buf);
+    if (!drv_once(ctx, t, &x)) {
+        fprintf(stderr, "connection failed\n");
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mi = mallinfo2();
+
+    fprintf(stderr, "%s: SSL_CTX ready after %.3f ms, first connection done "
+            "after %.3f ms; %.3f ms CPU, %zu KB heap\n", t->opts->prog,
+            timespec_diff(&drv_start, &t0) * 1e3,
+            timespec_diff(&drv_start, &t1) * 1e3, drv_cpu_now() * 1e3,
+            (mi.uordblks + mi.hblkhd) >> 10);
+    return 1;
+}
+
+/*
+ * Delayed dummy provider
+ * ----------------------
+ *
+ * With -D, the driver registers and loads a provider of its own, "ddd-delay",
+ * and makes it the preferred source of SHA-256 for everything fetched through
+ * the default library context. Its SHA-256 is the default provider's, except
+ * that finishing a digest takes another -D microseconds, as if the work had
+ * been handed to a slow accelerator. Every handshake finishes several digests
+ * (transcript hashes, signature verification), so a small delay adds up.
+ *
+ * Inside an async job, i.e. on an APP_CONN_ASYNC connection, the wait is on a
+ * timerfd which the provider stores in the job's ASYNC_WAIT_CTX, and the job
+ * pauses until the timer fires, just as an asynchronous engine would. The
+ * application learns of the fd from get_conn_async_fds(). Anywhere else the
+ * calling thread simply sleeps.
+ */
+# include <sys/timerfd.h>
+# include <openssl/async.h>
+# include <openssl/core_dispatch.h>
+# include <openssl/core_names.h>
+# include <openssl/params.h>
+# include <openssl/provider.h>
+
+static unsigned long drv_delay_us;
+static EVP_MD *drv_delay_sha256;
+
+/* Key of the timerfd in a job's ASYNC_WAIT_CTX. */
+static const char drv_delay_key[] = "ddd-delay";
+
+static void drv_delay_cleanup(ASYNC_WAIT_CTX *waitctx, const void *key,
+                              OSSL_ASYNC_FD fd, void *custom)
+{
+    close(fd);
+}
+
+static int drv_delay(void)
+{
+    ASYNC_JOB *job = ASYNC_get_current_job();
+    ASYNC_WAIT_CTX *waitctx;
+    struct itimerspec its = {0};
+    struct timespec ts;
+    OSSL_ASYNC_FD fd;
+    void *custom;
+    uint64_t n;
+
+    if (job == NULL) {
+        ts.tv_sec   = drv_delay_us / 1000000;
+        ts.tv_nsec  = drv_delay_us % 1000000 * 1000;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+        return 1;
+    }
+
+    waitctx = ASYNC_get_wait_ctx(job);
+    if (!ASYNC_WAIT_CTX_get_fd(waitctx, drv_delay_key, &fd, &custom)) {
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0)
+            return 0;
+
+        if (!ASYNC_WAIT_CTX_set_wait_fd(waitctx, drv_delay_key, fd, NULL,
+                                        drv_delay_cleanup)) {
+            close(fd);
+            return 0;
+        }
+    }
+
+    its.it_value.tv_sec     = drv_delay_us / 1000000;
+    its.it_value.tv_nsec    = drv_delay_us % 1000000 * 1000;
+    if (timerfd_settime(fd, 0, &its, NULL) < 0)
+        return 0;
+
+    /* The fd stays registered, so a wakeup may come before the timer fires. */
+    while (read(fd, &n, sizeof(n)) < 0) {
+        if (errno != EAGAIN || !ASYNC_pause_job())
+            return 0;
+    }
+
+    return 1;
+}
+
+static void *drv_delay_newctx(void *provctx)
+{
+    return EVP_MD_CTX_new();
+}
+
+static void drv_delay_freectx(void *vctx)
+{
+    EVP_MD_CTX_free(vctx);
+}
+
+static void *drv_delay_dupctx(void *vctx)
+{
+    EVP_MD_CTX *dup = EVP_MD_CTX_new();
+
+    if (dup != NULL && !EVP_MD_CTX_copy_ex(dup, vctx)) {
+        EVP_MD_CTX_free(dup);
+        return NULL;
+    }
+
+    return dup;
+}
+
+static int drv_delay_init(void *vctx, const OSSL_PARAM params[])
+{
+    return EVP_DigestInit_ex(vctx, drv_delay_sha256, NULL);
+}
+
+static int drv_delay_update(void *vctx, const unsigned char *in, size_t inl)
+{
+    return EVP_DigestUpdate(vctx, in, inl);
+}
+
+static int drv_delay_final(void *vctx, unsigned char *out, size_t *outl,
+                           size_t outsz)
+{
+    unsigned int len;
+
+    if (outsz < 32 || !drv_delay())
+        return 0;
+
+    if (!EVP_DigestFinal_ex(vctx, out, &len))
+        return 0;
+
+    *outl = len;
+    return 1;
+}
+
+static const OSSL_PARAM *drv_delay_gettable_params(void *provctx)
+{
+    static const OSSL_PARAM params[] = {
+        OSSL_PARAM_size_t(OSSL_DIGEST_PARAM_BLOCK_SIZE, NULL),
+        OSSL_PARAM_size_t(OSSL_DIGEST_PARAM_SIZE, NULL),
+        OSSL_PARAM_int(OSSL_DIGEST_PARAM_XOF, NULL),
+        OSSL_PARAM_int(OSSL_DIGEST_PARAM_ALGID_ABSENT, NULL),
+        OSSL_PARAM_END
+    };
+
+    return params;
+}
+
+static int drv_delay_get_params(OSSL_PARAM params[])
+{
+    OSSL_PARAM *p;
+
+    if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_BLOCK_SIZE)) != NULL
+        && !OSSL_PARAM_set_size_t(p, 64))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_SIZE)) != NULL
+        && !OSSL_PARAM_set_size_t(p, 32))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_XOF)) != NULL
+        && !OSSL_PARAM_set_int(p, 0))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_ALGID_ABSENT)) != NULL
+        && !OSSL_PARAM_set_int(p, 0))
+        return 0;
+
+    return 1;
+}
+
+static const OSSL_DISPATCH drv_delay_sha256_functions[] = {
+    { OSSL_FUNC_DIGEST_NEWCTX, (void (*)(void))drv_delay_newctx },
+    { OSSL_FUNC_DIGEST_INIT, (void (*)(void))drv_delay_init },
+    { OSSL_FUNC_DIGEST_UPDATE, (void (*)(void))drv_delay_update },
+    { OSSL_FUNC_DIGEST_FINAL, (void (*)(void))drv_delay_final },
+    { OSSL_FUNC_DIGEST_FREECTX, (void (*)(void))drv_delay_freectx },
+    { OSSL_FUNC_DIGEST_DUPCTX, (void (*)(void))drv_delay_dupctx },
+    { OSSL_FUNC_DIGEST_GET_PARAMS, (void (*)(void))drv_delay_get_params },
+    { OSSL_FUNC_DIGEST_GETTABLE_PARAMS,
+      (void (*)(void))drv_delay_gettable_params },
+    { 0, NULL }
+};
+
+static const OSSL_ALGORITHM drv_delay_digests[] = {
+    { "SHA2-256:SHA-256:SHA256:2.16.840.1.101.3.4.2.1", "provider=ddd-delay",
+      drv_delay_sha256_functions, NULL },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const OSSL_ALGORITHM *drv_delay_query(void *provctx, int operation_id,
+                                             int *no_cache)
+{
+    *no_cache = 0;
+    return operation_id == OSSL_OP_DIGEST ? drv_delay_digests : NULL;
+}
+
+static const OSSL_DISPATCH drv_delay_provider_functions[] = {
+    { OSSL_FUNC_PROVIDER_QUERY_OPERATION, (void (*)(void))drv_delay_query },
+    { 0, NULL }
+};
+
+static int drv_delay_provider_init(const OSSL_CORE_HANDLE *handle,
+                                   const OSSL_DISPATCH *in,
+                                   const OSSL_DISPATCH **out, void **provctx)
+{
+    *out        = drv_delay_provider_functions;
+    *provctx    = NULL;
+    return 1;
+}
+
+/*
+ * Loads the provider into the default library context, next to the default
+ * provider which does the actual hashing.
+ */
+static int drv_delay_load(unsigned long usecs)
+{
+    drv_delay_us = usecs;
+
+    /* Loading any provider explicitly stops the default one from autoloading. */
+    if (OSSL_PROVIDER_load(NULL, "default") == NULL)
+        return 0;
+
+    drv_delay_sha256 = EVP_MD_fetch(NULL, "SHA256", "provider=default");
+    if (drv_delay_sha256 == NULL)
+        return 0;
+
+    if (!OSSL_PROVIDER_add_builtin(NULL, "ddd-delay", drv_delay_provider_init)
+        || OSSL_PROVIDER_load(NULL, "ddd-delay") == NULL)
+        return 0;
+
+    return EVP_set_default_properties(NULL, "?provider=ddd-delay");
+}
+
+# ifdef DRV_REACTOR
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+
+/*
+ * Many-connection driver
+ * ----------------------
+ *
+ * The driver opens the requested number of connections at once and runs each
+ * of them through the same request/response exchange as the single-connection
+ * driver, reading each response until the peer closes the connection.
+ * Connections are multiplexed by an edge-triggered epoll reactor, or with -P by
+ * a level-triggered poll() over all connections, which is what the
+ * single-connection drivers do today.
+ *
+ * With -t, connections are split evenly across several event loops, each
+ * running on its own thread pinned to its own CPU and owning its connections
+ * outright, so that the loops share nothing but (without -S) the SSL_CTX.
+ *
+ * With -A, a connection whose chain is being verified by a worker waits for
+ * nothing on its fd. The worker's notification puts it on its loop's wake list
+ * and signals the loop's eventfd, which the loop waits on alongside the
+ * connections and which makes it drive everything on the list. With -O, a
+ * handshake worker's notification does the same.
+ *
+ * With -a, a connection whose async job is paused likewise waits for nothing
+ * on its own fd. Instead the epoll reactor keeps the connection's async wait
+ * fds (get_conn_async_fds()) registered, pointing at the connection, so that
+ * the fd becoming readable drives it and resumes the job. As the point of -a
+ * is that no connection holds up the others, the epoll reactor also records
+ * how long it is busy after each wakeup.
+ */
+enum {
+    DRV_TX, DRV_RX, DRV_DONE
+};
+
+typedef struct drv_conn_st {
+    APP_CONN *conn;
+    int fd;         /* fd registered with the loop, or -1 if not yet known */
+    int state;
+    int events;     /* poll(2) events currently registered for fd */
+    int tx_off;
+    size_t rx_total;
+    void *io;       /* private to the demo's drv_conn_* hooks */
+    struct drv_loop_st *loop;
+    struct drv_conn_st *wake_next;
+    int wake_queued; /* on the loop's wake list */
+} DRV_CONN;
+
+typedef struct drv_loop_st {
+    SSL_CTX *ctx;
+    const DRV_TARGET *t;
+    int use_poll, shard, cpu, timeout, epfd, res;
+    DRV_CONN *conns;
+    size_t num_conns, num_active, num_ok, num_failed;
+    unsigned long long rx_bytes;
+    unsigned long wakeups, ctl_mods;
+    DRV_CTX_STATS stats; /* if sharded */
+    DRV_CACHE_STATS cache;
+    void *(*main)(void *);
+    pthread_t thread;
+    int wake_fd;    /* eventfd signalled by verification workers, or -1 */
+    pthread_mutex_t wake_lock;
+    DRV_CONN *wake_head;
+    DRV_HIST busy;  /* ns from each epoll_wait() return to the next call */
+    char buf[16384];
+} DRV_LOOP;
+
+/*
+ * Hooks to be defined by the demo.
+ *
+ * drv_conn_new creates a connection to the target, using dc->io for any state
+ * of its own. If drv_conn_fd cannot yet tell which fd to wait on it returns -1
+ * and is asked again after the next -2. drv_conn_pump moves data between the
+ * network and the connection if the application is responsible for that,
+ * returning -1 on error or EOF, 1 if any data was moved and 0 otherwise.
+ * drv_conn_events turns the events returned by get_conn_pending_tx or
+ * get_conn_pending_rx into the events to wait for on the fd.
+ */
+static APP_CONN *drv_conn_new(SSL_CTX *ctx, const DRV_TARGET *t, DRV_CONN *dc);
+static int drv_conn_fd(DRV_CONN *dc);
+static int drv_conn_pump(DRV_CONN *dc);
+static int drv_conn_events(DRV_CONN *dc, int pending);
+static void drv_conn_free(DRV_CONN *dc);
+
+#  ifdef DRV_URING
+/*
+ * Demos which can be driven from io_uring define DRV_URING and provide an
+ * alternative body for an event loop, used with -U.
+ */
+static void *drv_uring_loop_main(void *arg);
+#  endif
+
+/*
+ * Translates poll(2) events into an edge-triggered epoll interest set.
+ */
+static uint32_t poll_to_epoll(int events)
+{
+    uint32_t ev = EPOLLET;
+
+    if (events & POLLIN)
+        ev |= EPOLLIN;
+    if (events & POLLOUT)
+        ev |= EPOLLOUT;
+    if (events & POLLERR)
+        ev |= EPOLLERR;
+
+    return ev;
+}
+
+/*
+ * Updates the events a connection is waiting for, registering its fd with the
+ * loop the first time round. epoll_ctl is only called if the interest set
+ * actually changes.
+ */
+static int drv_set_interest(DRV_LOOP *lp, DRV_CONN *dc, int events)
+{
+    struct epoll_event ev = {0};
+    int op = EPOLL_CTL_MOD;
+
+    if (dc->fd < 0) {
+        dc->fd = drv_conn_fd(dc);
+        if (dc->fd < 0)
+            return 0;
+        op = EPOLL_CTL_ADD;
+    } else if (dc->events == events) {
+        return 1;
+    }
+
+    dc->events = events;
+    if (lp->use_poll)
+        return 1;
+
+    ev.events   = poll_to_epoll(events);
+    ev.data.ptr = dc;
+    if (epoll_ctl(lp->epfd, op, dc->fd, &ev) < 0)
+        return 0;
+
+    if (op == EPOLL_CTL_MOD)
+        ++lp->ctl_mods;
+    return 1;
+}
+
+static void drv_finish(DRV_LOOP *lp, DRV_CONN *dc, int ok)
+{
+    drv_conn_free(dc); /* closing the fd also removes it from the epoll set */
+    dc->conn  = NULL;
+    dc->state = DRV_DONE;
+
+    --lp->num_active;
+    lp->rx_bytes += dc->rx_total;
+    if (ok)
+        ++lp->num_ok;
+    else
+        ++lp->num_failed;
+}
+
+/*
+ * Runs tx() or rx() until it returns -2 or the exchange is over. Returns the
+ * events the connection is waiting for, or 0 if it is done.
+ */
+static int drv_advance(DRV_LOOP *lp, DRV_CONN *dc)
+{
+    const DRV_TARGET *t = lp->t;
+    int l;
+
+    while (dc->state == DRV_TX) {
+        l = tx(dc->conn, t->tx_msg + dc->tx_off, t->tx_len - dc->tx_off);
+        if (l > 0) {
+            dc->tx_off += l;
+            if (dc->tx_off == t->tx_len)
+                dc->state = DRV_RX;
+        } else if (l == -2) {
+            return get_conn_pending_tx(dc->conn);
+        } else {
+            drv_finish(lp, dc, 0);
+            return 0;
+        }
+    }
+
+    while (dc->state == DRV_RX) {
+        l = rx(dc->conn, lp->buf, sizeof(lp->buf));
+        if (l > 0) {
+            dc->rx_total += l;
+        } else if (l == -2) {
+            return get_conn_pending_rx(dc->conn);
+        } else {
+            /* The response ends when the peer closes the connection. */
+            drv_finish(lp, dc, dc->rx_total > 0);
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Registers the async wait fds the connection has gained with the loop and
+ * forgets those it has lost. libssl closes the fds with the connection, which
+ * also removes them from the epoll set.
+ */
+static int drv_update_async_fds(DRV_LOOP *lp, DRV_CONN *dc)
+{
+#  ifdef DRV_ASYNC
+    struct epoll_event ev = {0};
+    int add[8], del[8];
+    size_t i, num_add, num_del;
+
+    if (!lp->t->opts->async)
+        return 1;
+
+    if (!get_conn_async_fds(dc->conn, NULL, &num_add, NULL, &num_del)
+        || num_add > sizeof(add) / sizeof(add[0])
+        || num_del > sizeof(del) / sizeof(del[0])
+        || !get_conn_async_fds(dc->conn, add, &num_add, del, &num_del))
+        return 0;
+
+    for (i = 0; i < num_del; ++i)
+        epoll_ctl(lp->epfd, EPOLL_CTL_DEL, del[i], NULL);
+
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.ptr = dc;
+    for (i = 0; i < num_add; ++i)
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, add[i], &ev) < 0)
+            return 0;
+#  endif
+
+    return 1;
+}
+
+/*
+ * Advances a connection as far as it will go without blocking. As the reactor
+ * is edge-triggered, this only returns once the connection is waiting on the
+ * network again (or is finished); otherwise a wakeup could be lost.
+ */
+static void drv_drive(DRV_LOOP *lp, DRV_CONN *dc)
+{
+    int pending, rc;
+
+    for (;;) {
+        pending = drv_advance(lp, dc);
+        if (dc->state == DRV_DONE)
+            return;
+
+        /*
+         * A connection waiting for nothing on the network has work in flight
+         * elsewhere, which may yet consume what was received before EOF.
+         */
+        rc = drv_conn_pump(dc);
+        if (rc < 0 && pending != 0) {
+            drv_finish(lp, dc, dc->state == DRV_RX && dc->rx_total > 0);
+            return;
+        }
+        if (rc <= 0)
+            break;
+    }
+
+    if (drv_set_interest(lp, dc, drv_conn_events(dc, pending)) == 0
+        || drv_update_async_fds(lp, dc) == 0)
+        drv_finish(lp, dc, 0);
+}
+
+/* Called on a worker's thread when dc can carry on. */
+static void drv_verify_notify(void *arg)
+{
+    DRV_CONN *dc = arg;
+    DRV_LOOP *lp = dc->loop;
+    uint64_t one = 1;
+
+    /* A connection may be notified again before the loop gets to it. */
+    pthread_mutex_lock(&lp->wake_lock);
+    if (!dc->wake_queued) {
+        dc->wake_queued = 1;
+        dc->wake_next   = lp->wake_head;
+        lp->wake_head   = dc;
+    }
+    pthread_mutex_unlock(&lp->wake_lock);
+
+    if (write(lp->wake_fd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "cannot signal event loop: %d\n", errno);
+}
+
+/* Drives the connections on the wake list. */
+static void drv_wake(DRV_LOOP *lp)
+{
+    DRV_CONN *dc, *next;
+    uint64_t n;
+
+    if (read(lp->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        return;
+
+    pthread_mutex_lock(&lp->wake_lock);
+    dc = lp->wake_head;
+    lp->wake_head = NULL;
+    pthread_mutex_unlock(&lp->wake_lock);
+
+    for (; dc != NULL; dc = next) {
+        pthread_mutex_lock(&lp->wake_lock);
+        next            = dc->wake_next;
+        dc->wake_queued = 0;
+        pthread_mutex_unlock(&lp->wake_lock);
+
+        if (dc->state != DRV_DONE)
+            drv_drive(lp, dc);
+    }
+}
+
+static int drv_run_epoll(DRV_LOOP *lp)
+{
+    struct epoll_event evs[256];
+    struct timespec t0, t1;
+    int i, n;
+
+    while (lp->num_active > 0) {
+        n = epoll_wait(lp->epfd, evs, sizeof(evs)/sizeof(evs[0]), lp->timeout);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ++lp->wakeups;
+        for (i = 0; i < n; ++i) {
+            if (evs[i].data.ptr == NULL)
+                drv_wake(lp);
+            else
+                drv_drive(lp, evs[i].data.ptr);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        drv_hist_record(&lp->busy, drv_ns(timespec_diff(&t0, &t1)));
+    }
+
+    return 1;
+}
+
+static int drv_run_poll(DRV_LOOP *lp)
+{
+    struct pollfd *pfds;
+    DRV_CONN **pconns;
+    size_t i, n;
+    int rc, res = 0;
+
+    pfds    = calloc(lp->num_conns + 1, sizeof(struct pollfd));
+    pconns  = calloc(lp->num_conns + 1, sizeof(DRV_CONN *));
+    if (pfds == NULL || pconns == NULL)
+        goto out;
+
+    while (lp->num_active > 0) {
+        for (i = 0, n = 0; i < lp->num_conns; ++i) {
+            if (lp->conns[i].state == DRV_DONE)
+                continue;
+
+            pfds[n].fd      = lp->conns[i].fd;
+            pfds[n].events  = lp->conns[i].events;
+            pfds[n].revents = 0;
+            pconns[n++]     = &lp->conns[i];
+        }
+
+        if (lp->wake_fd >= 0) {
+            pfds[n].fd      = lp->wake_fd;
+            pfds[n].events  = POLLIN;
+            pfds[n].revents = 0;
+            pconns[n++]     = NULL;
+        }
+
+        rc = poll(pfds, n, lp->timeout);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            goto out;
+
+        ++lp->wakeups;
+        for (i = 0; i < n; ++i) {
+            if (pfds[i].revents == 0)
+                continue;
+            if (pconns[i] == NULL)
+                drv_wake(lp);
+            else
+                drv_drive(lp, pconns[i]);
+        }
+    }
+
+    res = 1;
+out:
+    free(pfds);
+    free(pconns);
+    return res;
+}
+
+/*
+ * Body of one event loop: opens the loop's share of connections and runs them
+ * to completion.
+ */
+static double rusage_cpu(const struct rusage *ru)
+{
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6
+         + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Pins the calling thread to a CPU. Failure is not fatal; the loop simply runs
+ * wherever the scheduler puts it.
+ */
+static void drv_pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        fprintf(stderr, "cannot pin to cpu %d: %d\n", cpu, errno);
+}
+
+static void *drv_loop_main(void *arg)
+{
+    DRV_LOOP *lp = arg;
+    DRV_CONN *dc;
+    size_t i;
+    int rc;
+
+    lp->res         = 0;
+    lp->epfd        = -1;
+    lp->wake_fd     = -1;
+    lp->wake_head   = NULL;
+    pthread_mutex_init(&lp->wake_lock, NULL);
+
+    if (lp->cpu >= 0)
+        drv_pin_cpu(lp->cpu);
+
+    if (lp->shard) {
+        lp->ctx = drv_create_ctx(lp->t->opts);
+        if (lp->ctx == NULL) {
+            fprintf(stderr, "cannot create SSL context\n");
+            return NULL;
+        }
+    }
+
+    if (!lp->use_poll) {
+        lp->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (lp->epfd < 0) {
+            fprintf(stderr, "cannot create epoll fd\n");
+            goto out;
+        }
+    }
+
+    if (lp->t->opts->verify_workers > 0 || lp->t->opts->hs_workers > 0) {
+        struct epoll_event ev = {0};
+
+        lp->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (lp->wake_fd < 0) {
+            fprintf(stderr, "cannot create eventfd\n");
+            goto out;
+        }
+
+        ev.events   = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;
+        if (!lp->use_poll
+            && epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->wake_fd, &ev) < 0) {
+            fprintf(stderr, "cannot register eventfd\n");
+            goto out;
+        }
+    }
+
+    lp->conns = calloc(lp->num_conns, sizeof(DRV_CONN));
+    if (lp->conns == NULL)
+        goto out;
+
+    for (i = 0; i < lp->num_conns; ++i) {
+        dc = &lp->conns[i];
+        dc->state   = DRV_DONE;
+        dc->fd      = -1;
+        dc->loop    = lp;
+
+        dc->conn = drv_conn_new(lp->ctx, lp->t, dc);
+        if (dc->conn == NULL) {
+            fprintf(stderr, "cannot establish connection\n");
+            goto out;
+        }
+
+        if (lp->t->opts->verify_workers > 0
+            && !set_conn_verify_notify(dc->conn, drv_verify_notify, dc)) {
+            drv_conn_free(dc);
+            goto out;
+        }
+
+#  ifdef DRV_OFFLOAD
+        if (lp->t->opts->hs_workers > 0
+            && !set_conn_handshake_notify(dc->conn, drv_verify_notify, dc)) {
+            drv_conn_free(dc);
+            goto out;
+        }
+#  endif
+
+        dc->state = DRV_TX;
+        ++lp->num_active;
+
+        /* Kick off the handshake; this also registers the fd. */
+        drv_drive(lp, dc);
+    }
+
+    if (lp->use_poll)
+        rc = drv_run_poll(lp);
+    else
+        rc = drv_run_epoll(lp);
+
+    if (rc == 0)
+        fprintf(stderr, "timeout with %zu connections outstanding\n",
+                lp->num_active);
+
+    lp->res = (rc == 1 && lp->num_failed == 0);
+out:
+    if (lp->conns != NULL) {
+        for (i = 0; i < lp->num_conns; ++i)
+            if (lp->conns[i].state != DRV_DONE)
+                drv_finish(lp, &lp->conns[i], 0);
+        free(lp->conns);
+        lp->conns = NULL;
+    }
+    if (lp->epfd >= 0)
+        close(lp->epfd);
+    if (lp->wake_fd >= 0)
+        close(lp->wake_fd);
+    pthread_mutex_destroy(&lp->wake_lock);
+    if (lp->shard) {
+        drv_ctx_stats(lp->ctx, &lp->stats);
+        teardown_ctx(lp->ctx);
+    }
+    return NULL;
+}
+
+/* Runs an event loop, counting its thread's connection cache traffic. */
+static void *drv_loop_thread(void *arg)
+{
+    DRV_LOOP *lp = arg;
+    DRV_CACHE_STATS cs0;
+
+    drv_cache_stats(&cs0);
+    lp->main(lp);
+    drv_cache_stats(&lp->cache);
+    drv_cache_stats_since(&lp->cache, &cs0);
+    return NULL;
+}
+
+/*
+ * Runs num_conns connections to the target spread over num_threads event
+ * loops and reports handshakes and bytes per second on stderr.
+ */
+static int drv_run(SSL_CTX *ctx, const DRV_TARGET *t, const DRV_OPTS *opts,
+                   int num_threads)
+{
+    DRV_LOOP *loops;
+    struct timespec t0, t1;
+    struct rusage ru0, ru1;
+    struct rlimit rl;
+    size_t num_ok = 0, num_failed = 0;
+    unsigned long long rx_bytes = 0;
+    unsigned long wakeups = 0, ctl_mods = 0;
+    DRV_CTX_STATS st0, st = {0};
+    DRV_CACHE_STATS cs = {0};
+    DRV_HIST *busy;
+    void *(*loop_main)(void *) = drv_loop_main;
+    const char *mode = opts->use_poll ? "poll" : "epoll";
+    double wall, cpu;
+    long num_cpus;
+    int i, res = 1;
+
+#  ifdef DRV_URING
+    if (opts->use_uring) {
+        loop_main   = drv_uring_loop_main;
+        mode        = "io_uring";
+    }
+#  endif
+
+    /* Each connection needs an fd, so raise the soft limit as far as we can. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    loops = calloc(num_threads, sizeof(DRV_LOOP));
+    busy  = calloc(1, sizeof(DRV_HIST));
+    if (loops == NULL || busy == NULL) {
+        free(loops);
+        free(busy);
+        return 0;
+    }
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* The shared SSL_CTX's session cache outlives the run. */
+    drv_ctx_stats(ctx, &st0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    getrusage(RUSAGE_SELF, &ru0);
+
+    for (i = 0; i < num_threads; ++i) {
+        loops[i].ctx        = ctx;
+        loops[i].t          = t;
+        loops[i].use_poll   = opts->use_poll;
+        loops[i].shard      = opts->shard;
+        loops[i].timeout    = 2000 /* ms */;
+        loops[i].cpu        = num_threads > 1 ? i % num_cpus : -1;
+        loops[i].num_conns  = opts->num_conns / num_threads
+                            + ((size_t)i < opts->num_conns % num_threads);
+        loops[i].main       = loop_main;
+
+        if (num_threads == 1) {
+            drv_loop_thread(&loops[i]);
+        } else if (pthread_create(&loops[i].thread, NULL, drv_loop_thread,
+                                  &loops[i]) != 0) {
+            fprintf(stderr, "cannot create thread\n");
+            num_threads = i;
+            res = 0;
+            break;
+        }
+    }
+
+    for (i = 0; i < num_threads; ++i) {
+        if (num_threads > 1)
+            pthread_join(loops[i].thread, NULL);
+
+        res         = res && loops[i].res;
+        num_ok      += loops[i].num_ok;
+        num_failed  += loops[i].num_failed;
+        rx_bytes    += loops[i].rx_bytes;
+        wakeups     += loops[i].wakeups;
+        ctl_mods    += loops[i].ctl_mods;
+        st.num_full             += loops[i].stats.num_full;
+        st.num_resumed          += loops[i].stats.num_resumed;
+        st.num_early_accepted   += loops[i].stats.num_early_accepted;
+        st.num_early_rejected   += loops[i].stats.num_early_rejected;
+        st.num_verify_hits      += loops[i].stats.num_verify_hits;
+        st.num_verify_misses    += loops[i].stats.num_verify_misses;
+        st.num_pool_new         += loops[i].stats.num_pool_new;
+        st.num_pool_reused      += loops[i].stats.num_pool_reused;
+        cs.num_new              += loops[i].cache.num_new;
+        cs.num_reused           += loops[i].cache.num_reused;
+        cs.num_bio_reused       += loops[i].cache.num_bio_reused;
+        drv_hist_add(busy, &loops[i].busy);
+    }
+
+    if (!opts->shard) {
+        drv_ctx_stats(ctx, &st);
+        st.num_full             -= st0.num_full;
+        st.num_resumed          -= st0.num_resumed;
+        st.num_early_accepted   -= st0.num_early_accepted;
+        st.num_early_rejected   -= st0.num_early_rejected;
+        st.num_verify_hits      -= st0.num_verify_hits;
+        st.num_verify_misses    -= st0.num_verify_misses;
+        st.num_pool_new         -= st0.num_pool_new;
+        st.num_pool_reused      -= st0.num_pool_reused;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    getrusage(RUSAGE_SELF, &ru1);
+
+    wall    = timespec_diff(&t0, &t1);
+    cpu     = rusage_cpu(&ru1) - rusage_cpu(&ru0);
+    fprintf(stderr,
+            "%s x%d%s: %zu conns (%zu ok, %zu failed) in %.3f s; "
+            "%.0f handshakes/s (%lu full, %lu resumed), %.2f MB/s; "
+            "%lu wakeups (%.0f/s), %lu epoll_ctl(MOD); "
+            "%.1f us CPU/conn",
+            mode, num_threads,
+            opts->shard ? " sharded" : "",
+            opts->num_conns, num_ok, num_failed, wall,
+            num_ok / wall, st.num_full, st.num_resumed, rx_bytes / wall / 1e6,
+            wakeups, wakeups / wall, ctl_mods,
+            cpu * 1e6 / opts->num_conns);
+    if (st.num_early_accepted + st.num_early_rejected > 0)
+        fprintf(stderr, "; 0-RTT %lu accepted, %lu rejected",
+                st.num_early_accepted, st.num_early_rejected);
+    drv_print_ctx_stats(&st);
+    drv_print_cache_stats(&cs);
+    if (busy->count > 0)
+        fprintf(stderr, "; loop busy p50 %.1f us, p99 %.1f us, max %.1f us",
+                drv_hist_percentile(busy, 50) / 1e3,
+                drv_hist_percentile(busy, 99) / 1e3, busy->max / 1e3);
+    fprintf(stderr, "\n");
+
+    free(busy);
+    free(loops);
+    return res;
+}
+
+/*
+ * Runs the many-connection driver as requested on the command line, once per
+ * event loop count if sweeping.
+ */
+static int drv_run_many(SSL_CTX *ctx, const DRV_TARGET *t,
+                        const DRV_OPTS *opts)
+{
+    int n, r, res = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (n = opts->sweep ? 1 : opts->num_threads; n <= opts->num_threads; ++n)
+        for (r = 0; r < opts->num_rounds; ++r)
+            res = drv_run(ctx, t, opts, n) && res;
+
+    return res;
+}
+
+#  ifdef DRV_CONNECT
+/*
+ * Helper for drv_conn_new hooks which create their own socket: starts a
+ * nonblocking connect to the target. Demos with such hooks define DRV_CONNECT.
+ */
+static int drv_connect(const DRV_TARGET *t)
+{
+    int fd, on = 1;
+
+    fd = socket(t->ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (fd < 0)
+        return -1;
+
+    /*
+     * A demo which moves the bytes itself may write a record in several
+     * pieces. Under Nagle's algorithm the last piece would wait for the first
+     * to be acknowledged, which the peer delays until it has the whole record.
+     */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(fd, t->ai->ai_addr, t->ai->ai_addrlen) < 0
+        && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+#  endif
+
+/*
+ * The single-connection hooks for the nonblocking demos: a DRV_CONN waited on
+ * with poll().
+ */
+struct drv_link_st {
+    DRV_CONN dc;
+};
+
+static DRV_LINK *drv_open(SSL_CTX *ctx, const DRV_TARGET *t)
+{
+    DRV_LINK *lk;
+
+    lk = calloc(1, sizeof(DRV_LINK));
+    if (lk == NULL)
+        return NULL;
+
+    lk->dc.fd   = -1;
+    lk->dc.conn = drv_conn_new(ctx, t, &lk->dc);
+    if (lk->dc.conn == NULL) {
+        free(lk);
+        return NULL;
+    }
+
+    return lk;
+}
+
+/*
+ * Called when tx() or rx() returns -2. Moves data if the demo does so itself,
+ * or else waits for the events pending. Returns 1 to try again and 0 on EOF,
+ * error or timeout.
+ */
+static int drv_wait(DRV_LINK *lk, int pending, DRV_XFER *x)
+{
+    DRV_CONN *dc = &lk->dc;
+    struct pollfd pfd = {0};
+    struct timespec t0, t1;
+    int rc;
+
+    rc = drv_conn_pump(dc);
+    if (rc != 0)
+        return rc > 0;
+
+    if (dc->fd < 0 && (dc->fd = drv_conn_fd(dc)) < 0)
+        return 0;
+
+    pfd.fd      = dc->fd;
+    pfd.events  = drv_conn_events(dc, pending);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    rc = poll(&pfd, 1, 2000 /* ms */);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    ++x->waits;
+    x->wait_time += timespec_diff(&t0, &t1);
+    return rc > 0;
+}
+
+static int drv_send(DRV_LINK *lk, const void *buf, int len, DRV_XFER *x)
+{
+    int l, off = 0;
+
+    while (off < len) {
+        l = tx(lk->dc.conn, (const char *)buf + off, len - off);
+        if (l > 0)
+            off += l;
+        else if (l != -2
+                 || !drv_wait(lk, get_conn_pending_tx(lk->dc.conn), x))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int drv_recv(DRV_LINK *lk, void *buf, int len, DRV_XFER *x)
+{
+    int l;
+
+    for (;;) {
+        l = rx(lk->dc.conn, buf, len);
+        if (l > 0)
+            return l;
+        if (l != -2 || !drv_wait(lk, get_conn_pending_rx(lk->dc.conn), x))
+            return 0;
+    }
+}
+
+static void drv_close(DRV_LINK *lk)
+{
+    drv_conn_free(&lk->dc);
+    free(lk);
+}
+# endif /* DRV_REACTOR */
+
+#endif /* DDD_DRIVER_H */
@@ -0,0 +1,656 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/*
+ * Loopback Test Server
+ * ====================
+ *
+ * A small HTTP/1.0-over-TLS server for running the demos and benchmarking them
+ * without network access. It is a stand-in for www.example.com, not a demo of
+ * good server-side libssl usage.
+ *
+ *   GET /<n>   Responds with an n-byte HTML body.
+ *   GET /...   Any other path responds with a body of the default size (-s).
+ *   PUT, POST  A request body of Content-Length bytes is read and discarded,
+ *              then the server responds as for GET.
+ *   ECHO       Everything sent after the request header is sent straight
+ *              back, without a response header, until the client closes the
+ *              connection. For latency benchmarks; -d does not apply.
+ *
+ * Every body starts with "<html>" and ends with "</html>\n", and the
+ * connection is closed after one response. Each thread runs its own edge-
+ * triggered epoll loop on its own SO_REUSEPORT listening socket.
+ *
+ *   -a addr    Address to listen on (default 127.0.0.1).
+ *   -p port    Port to listen on (default 4433).
+ *   -c file    Certificate chain (default pki/server.pem, see "make pki").
+ *   -k file    Private key (default pki/server.key).
+ *   -s size    Default response body size in bytes (default 1024).
+ *   -d ms      Delay each response by this many milliseconds.
+ *   -D ms      Delay the start of each handshake by this many milliseconds,
+ *              as if the server were that much further away.
+ *   -m ver     Minimum TLS version: 1.0, 1.1, 1.2 or 1.3.
+ *   -M ver     Maximum TLS version.
+ *   -E         Accept TLS 1.3 early data (0-RTT requests).
+ *   -t threads Number of event loop threads (default 1).
+ */
+#define SRV_REQ_MAX     4096
+#define SRV_CHUNK       16384
+
+static const char body_head[] = "<html>", body_tail[] = "</html>\n";
+#define BODY_HEAD_LEN   (sizeof(body_head) - 1)
+#define BODY_TAIL_LEN   (sizeof(body_tail) - 1)
+
+typedef struct srv_opts_st {
+    const char *addr, *port, *cert, *key;
+    size_t size;
+    long delay_ms, hs_delay_ms;
+    int min_version, max_version, early_data, num_threads;
+} SRV_OPTS;
+
+enum {
+    SRV_EARLY,      /* reading 0-RTT early data */
+    SRV_HANDSHAKE,
+    SRV_READ,       /* reading the request header */
+    SRV_DISCARD,    /* reading and dropping the request body */
+    SRV_DELAY,      /* waiting until due, then going on to next_state */
+    SRV_WRITE,
+    SRV_ECHO,       /* sending back whatever is read */
+    SRV_CLOSE
+};
+
+typedef struct srv_conn_st {
+    SSL *ssl;
+    int fd, state, next_state, events;
+    size_t req_len, body_left, echo_off;
+    size_t resp_size, resp_off;
+    int hdr_len, hdr_off;
+    struct timespec due;
+    struct srv_conn_st *next;   /* delay queue */
+    char hdr[128];
+    char req[SRV_REQ_MAX];
+} SRV_CONN;
+
+typedef struct srv_thread_st {
+    SSL_CTX *ctx;
+    const SRV_OPTS *opts;
+    int lfd, epfd;
+    SRV_CONN *delay_head, *delay_tail;
+    pthread_t thread;
+    char buf[SRV_CHUNK];
+} SRV_THREAD;
+
+static int parse_version(const char *s)
+{
+    if (strcmp(s, "1.0") == 0)
+        return TLS1_VERSION;
+    if (strcmp(s, "1.1") == 0)
+        return TLS1_1_VERSION;
+    if (strcmp(s, "1.2") == 0)
+        return TLS1_2_VERSION;
+    if (strcmp(s, "1.3") == 0)
+        return TLS1_3_VERSION;
+    return -1;
+}
+
+static SSL_CTX *srv_create_ctx(const SRV_OPTS *opts)
+{
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+        return NULL;
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, opts->cert) <= 0
+        || SSL_CTX_use_PrivateKey_file(ctx, opts->key, SSL_FILETYPE_PEM) <= 0
+        || SSL_CTX_check_private_key(ctx) <= 0)
+        goto fail;
+
+    if ((opts->min_version != 0
+         && !SSL_CTX_set_min_proto_version(ctx, opts->min_version))
+        || (opts->max_version != 0
+            && !SSL_CTX_set_max_proto_version(ctx, opts->max_version)))
+        goto fail;
+
+    /* Needed for clients to resume sessions. */
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"ddd", 3);
+
+    if (opts->early_data)
+        SSL_CTX_set_max_early_data(ctx, 16384);
+
+    /* Response bodies are generated chunk by chunk into a shared buffer. */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                          | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return ctx;
+
+fail:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+static int srv_listen(const SRV_OPTS *opts)
+{
+    struct sockaddr_in sa = {0};
+    int fd, on = 1;
+
+    sa.sin_family   = AF_INET;
+    sa.sin_port     = htons(atoi(opts->port));
+    if (inet_pton(AF_INET, opts->addr, &sa.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", opts->addr);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+        || listen(fd, 4096) < 0) {
+        fprintf(stderr, "cannot listen on %s:%s: %s\n",
+                opts->addr, opts->port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Fills buf with len bytes of a size-byte response body, starting at off.
+ */
+static void body_chunk(char *buf, size_t off, size_t len, size_t size)
+{
+    size_t i;
+
+    memset(buf, 'x', len);
+    for (i = off; i < BODY_HEAD_LEN && i < off + len; ++i)
+        buf[i - off] = body_head[i];
+    for (i = off > size - BODY_TAIL_LEN ? off : size - BODY_TAIL_LEN;
+         i < off + len; ++i)
+        buf[i - off] = body_tail[i - (size - BODY_TAIL_LEN)];
+}
+
+static void srv_close(SRV_THREAD *th, SRV_CONN *c)
+{
+    SSL_free(c->ssl);
+    close(c->fd);
+    free(c);
+}
+
+static void srv_set_events(SRV_THREAD *th, SRV_CONN *c, int events)
+{
+    struct epoll_event ev = {0};
+
+    if (events == c->events)
+        return;
+
+    ev.events   = events | EPOLLET;
+    ev.data.ptr = c;
+    epoll_ctl(th->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+/*
+ * Once the request header is in, works out the response and how much of the
+ * request body remains to be read, or switches to echoing for ECHO. Returns 0
+ * if the request is malformed.
+ */
+static int srv_parse_request(SRV_THREAD *th, SRV_CONN *c, const char *end)
+{
+    const char *path, *cl;
+    size_t have, size = th->opts->size;
+    char *p;
+
+    path = memchr(c->req, ' ', end - c->req);
+    if (path == NULL)
+        return 0;
+
+    ++path;
+    if (*path == '/' && path[1] >= '0' && path[1] <= '9')
+        size = strtoull(path + 1, NULL, 10);
+    if (size < BODY_HEAD_LEN + BODY_TAIL_LEN)
+        size = BODY_HEAD_LEN + BODY_TAIL_LEN;
+
+    /* Whatever followed the header is the first data to echo. */
+    if (strncmp(c->req, "ECHO ", 5) == 0) {
+        c->req_len  -= end + 4 - c->req;
+        c->echo_off = 0;
+        memmove(c->req, end + 4, c->req_len);
+        c->state    = SRV_ECHO;
+        return 1;
+    }
+
+    c->body_left = 0;
+    cl = strcasestr(c->req, "\r\nContent-Length:");
+    if (cl != NULL && cl < end)
+        c->body_left = strtoull(cl + 17, &p, 10);
+
+    /* Some of the body may have arrived along with the header. */
+    have = c->req_len - (end + 4 - c->req);
+    c->body_left = have >= c->body_left ? 0 : c->body_left - have;
+
+    c->resp_size    = size;
+    c->resp_off     = 0;
+    c->hdr_off      = 0;
+    c->hdr_len      = snprintf(c->hdr, sizeof(c->hdr),
+                               "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n"
+                               "Content-Length: %zu\r\n\r\n", size);
+    return 1;
+}
+
+static int srv_due_before(const SRV_CONN *a, const SRV_CONN *b)
+{
+    return a->due.tv_sec < b->due.tv_sec
+        || (a->due.tv_sec == b->due.tv_sec && a->due.tv_nsec < b->due.tv_nsec);
+}
+
+/*
+ * Puts a connection to sleep for ms milliseconds, after which it continues in
+ * state next.
+ */
+static void srv_delay(SRV_THREAD *th, SRV_CONN *c, long ms, int next)
+{
+    SRV_CONN **pc;
+
+    if (ms <= 0) {
+        c->state = next;
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c->due);
+    c->due.tv_sec   += ms / 1000;
+    c->due.tv_nsec  += (ms % 1000) * 1000000;
+    if (c->due.tv_nsec >= 1000000000) {
+        ++c->due.tv_sec;
+        c->due.tv_nsec -= 1000000000;
+    }
+
+    c->state        = SRV_DELAY;
+    c->next_state   = next;
+
+    /*
+     * The queue is kept in order of due time. Delays of one kind are all the
+     * same, so nearly always the connection simply goes at the end.
+     */
+    if (th->delay_tail == NULL || !srv_due_before(c, th->delay_tail)) {
+        c->next = NULL;
+        if (th->delay_tail != NULL)
+            th->delay_tail->next = c;
+        else
+            th->delay_head = c;
+        th->delay_tail = c;
+        return;
+    }
+
+    for (pc = &th->delay_head; !srv_due_before(c, *pc); pc = &(*pc)->next)
+        ;
+    c->next = *pc;
+    *pc     = c;
+}
+
+static void srv_respond(SRV_THREAD *th, SRV_CONN *c)
+{
+    srv_delay(th, c, th->opts->delay_ms, SRV_WRITE);
+}
+
+/*
+ * Advances a connection as far as it will go without blocking.
+ */
+static void srv_step(SRV_THREAD *th, SRV_CONN *c)
+{
+    size_t n, written;
+    char *end;
+    int l = 0;
+
+    for (;;) {
+        switch (c->state) {
+            case SRV_EARLY:
+                l = SSL_read_early_data(c->ssl, c->req + c->req_len,
+                                        sizeof(c->req) - 1 - c->req_len, &n);
+                if (l == SSL_READ_EARLY_DATA_ERROR)
+                    goto want;
+
+                c->req_len += n;
+                if (l == SSL_READ_EARLY_DATA_FINISH)
+                    c->state = SRV_HANDSHAKE;
+                break;
+
+            case SRV_HANDSHAKE:
+                l = SSL_do_handshake(c->ssl);
+                if (l <= 0)
+                    goto want;
+
+                c->state = SRV_READ;
+                break;
+
+            case SRV_READ:
+                c->req[c->req_len] = '\0';
+                end = strstr(c->req, "\r\n\r\n");
+                if (end != NULL) {
+                    c->state = SRV_DISCARD;
+                    if (!srv_parse_request(th, c, end))
+                        goto close;
+                    break;
+                }
+
+                if (c->req_len == sizeof(c->req) - 1)
+                    goto close;
+
+                l = SSL_read(c->ssl, c->req + c->req_len,
+                             sizeof(c->req) - 1 - c->req_len);
+                if (l <= 0)
+                    goto want;
+
+                c->req_len += l;
+                break;
+
+            case SRV_DISCARD:
+                if (c->body_left == 0) {
+                    srv_respond(th, c);
+                    break;
+                }
+
+                n = c->body_left < sizeof(th->buf) ? c->body_left
+                                                   : sizeof(th->buf);
+                l = SSL_read(c->ssl, th->buf, n);
+                if (l <= 0)
+                    goto want;
+
+                c->body_left -= l;
+                break;
+
+            case SRV_DELAY:
+                srv_set_events(th, c, 0);
+                return;
+
+            case SRV_WRITE:
+                if (c->hdr_off < c->hdr_len) {
+                    l = SSL_write(c->ssl, c->hdr + c->hdr_off,
+                                  c->hdr_len - c->hdr_off);
+                    if (l <= 0)
+                        goto want;
+
+                    c->hdr_off += l;
+                    break;
+                }
+
+                if (c->resp_off == c->resp_size) {
+                    c->state = SRV_CLOSE;
+                    break;
+                }
+
+                n = c->resp_size - c->resp_off;
+                if (n > sizeof(th->buf))
+                    n = sizeof(th->buf);
+
+                body_chunk(th->buf, c->resp_off, n, c->resp_size);
+                if (SSL_write_ex(c->ssl, th->buf, n, &written) <= 0) {
+                    l = 0;
+                    goto want;
+                }
+
+                c->resp_off += written;
+                break;
+
+            case SRV_ECHO:
+                if (c->echo_off < c->req_len) {
+                    l = SSL_write(c->ssl, c->req + c->echo_off,
+                                  c->req_len - c->echo_off);
+                    if (l <= 0)
+                        goto want;
+
+                    c->echo_off += l;
+                    break;
+                }
+
+                l = SSL_read(c->ssl, c->req, sizeof(c->req));
+                if (l <= 0)
+                    goto want;
+
+                c->req_len  = l;
+                c->echo_off = 0;
+                break;
+
+            case SRV_CLOSE:
+                SSL_shutdown(c->ssl);
+                goto close;
+        }
+    }
+
+want:
+    switch (SSL_get_error(c->ssl, l)) {
+        case SSL_ERROR_WANT_READ:
+            srv_set_events(th, c, EPOLLIN);
+            return;
+        case SSL_ERROR_WANT_WRITE:
+            srv_set_events(th, c, EPOLLOUT);
+            return;
+        default:
+            break;
+    }
+
+close:
+    srv_close(th, c);
+}
+
+static void srv_accept(SRV_THREAD *th)
+{
+    struct epoll_event ev = {0};
+    SRV_CONN *c;
+    int fd, on = 1;
+
+    for (;;) {
+        fd = accept4(th->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        c = calloc(1, sizeof(SRV_CONN));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+
+        c->fd   = fd;
+        c->ssl  = SSL_new(th->ctx);
+        if (c->ssl == NULL || SSL_set_fd(c->ssl, fd) <= 0) {
+            srv_close(th, c);
+            continue;
+        }
+
+        SSL_set_accept_state(c->ssl);
+        c->events = EPOLLIN;
+
+        ev.events   = EPOLLIN | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(th->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            srv_close(th, c);
+            continue;
+        }
+
+        srv_delay(th, c, th->opts->hs_delay_ms,
+                  th->opts->early_data ? SRV_EARLY : SRV_HANDSHAKE);
+
+        srv_step(th, c);
+    }
+}
+
+/*
+ * Returns the epoll timeout until the first delayed response is due, and
+ * sends any which are due now.
+ */
+static int srv_run_delayed(SRV_THREAD *th)
+{
+    struct timespec now;
+    SRV_CONN *c;
+    long ms;
+
+    while ((c = th->delay_head) != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (c->due.tv_sec - now.tv_sec) * 1000
+           + (c->due.tv_nsec - now.tv_nsec + 999999) / 1000000;
+        if (ms > 0)
+            return ms;
+
+        th->delay_head = c->next;
+        if (th->delay_head == NULL)
+            th->delay_tail = NULL;
+
+        c->state = c->next_state;
+        srv_step(th, c);
+    }
+
+    return -1;
+}
+
+static void *srv_thread_main(void *arg)
+{
+    SRV_THREAD *th = arg;
+    struct epoll_event ev = {0}, evs[256];
+    int i, n, timeout;
+
+    th->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (th->epfd < 0)
+        return NULL;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(th->epfd, EPOLL_CTL_ADD, th->lfd, &ev) < 0)
+        return NULL;
+
+    for (;;) {
+        timeout = srv_run_delayed(th);
+
+        n = epoll_wait(th->epfd, evs, sizeof(evs) / sizeof(evs[0]), timeout);
+        for (i = 0; i < n; ++i) {
+            if (evs[i].data.ptr == NULL)
+                srv_accept(th);
+            else
+                srv_step(th, evs[i].data.ptr);
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    SRV_OPTS opts;
+    SRV_THREAD *threads;
+    SSL_CTX *ctx;
+    int c, i;
+
+    opts.addr           = "127.0.0.1";
+    opts.port           = "4433";
+    opts.cert           = "pki/server.pem";
+    opts.key            = "pki/server.key";
+    opts.size           = 1024;
+    opts.delay_ms       = 0;
+    opts.hs_delay_ms    = 0;
+    opts.min_version    = 0;
+    opts.max_version    = 0;
+    opts.early_data     = 0;
+    opts.num_threads    = 1;
+
+    while ((c = getopt(argc, argv, "a:p:c:k:s:d:D:m:M:Et:")) != -1) {
+        switch (c) {
+            case 'a':
+                opts.addr = optarg;
+                break;
+            case 'p':
+                opts.port = optarg;
+                break;
+            case 'c':
+                opts.cert = optarg;
+                break;
+            case 'k':
+                opts.key = optarg;
+                break;
+            case 's':
+                opts.size = strtoull(optarg, NULL, 0);
+                break;
+            case 'd':
+                opts.delay_ms = atol(optarg);
+                break;
+            case 'D':
+                opts.hs_delay_ms = atol(optarg);
+                break;
+            case 'm':
+                opts.min_version = parse_version(optarg);
+                break;
+            case 'M':
+                opts.max_version = parse_version(optarg);
+                break;
+            case 'E':
+                opts.early_data = 1;
+                break;
+            case 't':
+                opts.num_threads = atoi(optarg);
+                if (opts.num_threads < 1)
+                    opts.num_threads = 1;
+                break;
+            default:
+                goto usage;
+        }
+    }
+
+    if (opts.min_version < 0 || opts.max_version < 0)
+        goto usage;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    ctx = srv_create_ctx(&opts);
+    if (ctx == NULL) {
+        fprintf(stderr, "cannot create SSL context\n");
+        return 1;
+    }
+
+    threads = calloc(opts.num_threads, sizeof(SRV_THREAD));
+    if (threads == NULL)
+        return 1;
+
+    for (i = 0; i < opts.num_threads; ++i) {
+        threads[i].ctx  = ctx;
+        threads[i].opts = &opts;
+        threads[i].lfd  = srv_listen(&opts);
+        if (threads[i].lfd < 0)
+            return 1;
+    }
+
+    for (i = 1; i < opts.num_threads; ++i)
+        if (pthread_create(&threads[i].thread, NULL, srv_thread_main,
+                           &threads[i]) != 0) {
+            fprintf(stderr, "cannot create thread\n");
+            return 1;
+        }
+
+    srv_thread_main(&threads[0]);
+    return 1;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-a addr] [-p port] [-c cert] [-k key] [-s size] "
+            "[-d ms] [-D ms]\n"
+            "       [-m version] [-M version] [-E] [-t threads]\n", argv[0]);
+    return 1;
+}